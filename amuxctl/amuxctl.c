@@ -1,15 +1,19 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
 #include <sys/file.h>
 
 #include <alsa/asoundlib.h>
 
 #include "amuxctl.h"
 #include "pcmlist.h"
+#include "gain.h"
 
 struct amux_ctx {
 	snd_config_t *top;
+	char const *dev;
 	char const *file;
+	char const *gfile;
 	struct pcmlst plst;
 };
 
@@ -52,16 +56,19 @@ out:
 
 static int amux_cfg_parse(struct amux_ctx *ctx)
 {
-	snd_config_t *dft;
+	snd_config_t *dft, *gain;
 	char const *str;
+	char key[256];
 	int ret;
 
 	ctx->top = snd_config;
 	snd_config_ref(ctx->top);
 
-	ret = snd_config_search(ctx->top, "pcm.default", &dft);
+	snprintf(key, sizeof(key), "pcm.%s",
+			(ctx->dev != NULL) ? ctx->dev : "default");
+	ret = snd_config_search(ctx->top, key, &dft);
 	if(ret < 0) {
-		fprintf(stderr, "Cannot get default config\n");
+		fprintf(stderr, "Cannot get %s config\n", key);
 		goto err;
 	}
 
@@ -77,6 +84,13 @@ static int amux_cfg_parse(struct amux_ctx *ctx)
 		goto unref;
 
 	ctx->file = str;
+
+	/* Gain control is optional */
+	ctx->gfile = NULL;
+	if((snd_config_search(dft, "gain.file", &gain) == 0) &&
+			(snd_config_get_string(gain, &str) == 0))
+		ctx->gfile = str;
+
 	return 0;
 unref:
 	snd_config_unref(ctx->top);
@@ -167,6 +181,48 @@ out:
 	return ret;
 }
 
+static struct amux_gain_ctl *amux_gain_map(struct amux_ctx *actx)
+{
+	struct amux_gain_ctl *g;
+
+	if(actx->gfile == NULL) {
+		fprintf(stderr, "No gain control file configured\n");
+		return NULL;
+	}
+
+	g = amux_gain_ctl_map(actx->gfile);
+	if(g == NULL)
+		fprintf(stderr, "Cannot map gain file %s\n", actx->gfile);
+
+	return g;
+}
+
+int amux_gain_set(struct amux_ctx *actx, double db)
+{
+	struct amux_gain_ctl *g;
+
+	g = amux_gain_map(actx);
+	if(g == NULL)
+		return -EINVAL;
+
+	amux_gain_ctl_set_mb(g, (int32_t)lround(db * 100.0));
+	amux_gain_ctl_unmap(g);
+	return 0;
+}
+
+int amux_gain_mute(struct amux_ctx *actx, int mute)
+{
+	struct amux_gain_ctl *g;
+
+	g = amux_gain_map(actx);
+	if(g == NULL)
+		return -EINVAL;
+
+	amux_gain_ctl_set_mute(g, mute ? 1 : 0);
+	amux_gain_ctl_unmap(g);
+	return 0;
+}
+
 struct amux_ctx *amux_ctx_new() {
 	struct amux_ctx *actx = NULL;
 
@@ -175,6 +231,11 @@ struct amux_ctx *amux_ctx_new() {
 	return actx;
 }
 
+void amux_ctx_set_dev(struct amux_ctx *actx, char const *dev)
+{
+	actx->dev = dev;
+}
+
 int amux_ctx_init(struct amux_ctx *actx)
 {
 	int ret;
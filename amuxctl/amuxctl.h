@@ -11,6 +11,8 @@ struct amux_ctx;
 
 struct amux_ctx *amux_ctx_new();
 
+void amux_ctx_set_dev(struct amux_ctx *actx, char const *dev);
+
 int amux_ctx_init(struct amux_ctx *actx);
 
 void amux_pcmlst_dump(struct amux_ctx *actx);
@@ -19,6 +21,14 @@ int amux_pcm_set(struct amux_ctx *actx, char const *pcm);
 
 int amux_pcm_get(struct amux_ctx *actx, char *pcm, size_t len);
 
+int amux_gain_set(struct amux_ctx *actx, double db);
+
+int amux_gain_mute(struct amux_ctx *actx, int mute);
+
+int amux_stats_dump(void);
+
+int amux_stats_top(unsigned int period_ms);
+
 void amux_ctx_cleanup(struct amux_ctx *actx);
 
 void amux_ctx_free(struct amux_ctx *actx);
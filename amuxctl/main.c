@@ -17,12 +17,23 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	/* Statistics are host wide, no amux PCM config needed */
+	if(opt.act == AA_STATS) {
+		ret = amux_stats_dump();
+		goto out;
+	}
+	if(opt.act == AA_TOP) {
+		ret = amux_stats_top(opt.topt.period_ms);
+		goto out;
+	}
+
 	actx = amux_ctx_new();
 	if(actx == NULL) {
 		perror("amux_ctx_new");
 		goto out;
 	}
 
+	amux_ctx_set_dev(actx, opt.dev);
 	ret = amux_ctx_init(actx);
 	if(ret != 0) {
 		fprintf(stderr, "Cannot initialize amux context\n");
@@ -44,6 +55,15 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "Can't get PCM: %s\n", strerror(-ret));
 		printf("Current PCM: %.*s\n", ret, pcm);
 		break;
+	case AA_GAIN:
+		ret = amux_gain_set(actx, opt.gopt.db);
+		break;
+	case AA_MUTE:
+		ret = amux_gain_mute(actx, 1);
+		break;
+	case AA_UNMUTE:
+		ret = amux_gain_mute(actx, 0);
+		break;
 	default:
 		break;
 	}
@@ -19,22 +19,38 @@
 #define AM_OPT_INIT(ao) do						\
 {									\
 	(ao)->act = AA_INVAL;						\
+	(ao)->dev = NULL;						\
 } while(0)
 
 #define AM_OPT_VALID(ao)						\
 	(((ao)->act == AA_LIST) || ((ao)->act == AA_GET) ||		\
-	 (AM_SOPT_VALID(ao)))
+	 ((ao)->act == AA_GAIN) || ((ao)->act == AA_MUTE) ||		\
+	 ((ao)->act == AA_UNMUTE) || ((ao)->act == AA_STATS) ||	\
+	 ((ao)->act == AA_TOP) || (AM_SOPT_VALID(ao)))
 
 static void usage(char const *progname)
 {
 	fprintf(stderr, "Usage:\n");
-	fprintf(stderr, "\t%s [OPTION]\n", progname);
+	fprintf(stderr, "\t%s [-D <AMUX PCM>] [OPTION]\n", progname);
+	fprintf(stderr, "\t-D, --device <AMUX PCM>\n");
+	fprintf(stderr, "\t\tamux PCM to control (default is \"default\")\n");
 	fprintf(stderr, "\t-l, --list\n");
 	fprintf(stderr, "\t\tlist available PCM name\n");
 	fprintf(stderr, "\t-s, --set <PCM>\n");
 	fprintf(stderr, "\t\tconfigure PCM as system soundcard\n");
 	fprintf(stderr, "\t-g, --get\n");
 	fprintf(stderr, "\t\tget current system soundcard\n");
+	fprintf(stderr, "\t-G, --gain <dB>\n");
+	fprintf(stderr, "\t\tset stream gain (needs gain file config)\n");
+	fprintf(stderr, "\t-m, --mute\n");
+	fprintf(stderr, "\t\tmute stream\n");
+	fprintf(stderr, "\t-u, --unmute\n");
+	fprintf(stderr, "\t\tunmute stream\n");
+	fprintf(stderr, "\t-S, --stats\n");
+	fprintf(stderr, "\t\tshow statistics of every live amux stream\n");
+	fprintf(stderr, "\t-t, --top [<ms>]\n");
+	fprintf(stderr, "\t\tshow live amux streams activity, refreshed "
+			"every ms (default 1000)\n");
 }
 
 int parse_args(struct am_opt *aopt, int argc, char *argv[])
@@ -58,12 +74,52 @@ int parse_args(struct am_opt *aopt, int argc, char *argv[])
 			.flag = NULL,
 			.val = 'g',
 		},
+		{
+			.name = "gain",
+			.has_arg = 1,
+			.flag = NULL,
+			.val = 'G',
+		},
+		{
+			.name = "mute",
+			.has_arg = 0,
+			.flag = NULL,
+			.val = 'm',
+		},
+		{
+			.name = "unmute",
+			.has_arg = 0,
+			.flag = NULL,
+			.val = 'u',
+		},
+		{
+			.name = "stats",
+			.has_arg = 0,
+			.flag = NULL,
+			.val = 'S',
+		},
+		{
+			.name = "top",
+			.has_arg = 2,
+			.flag = NULL,
+			.val = 't',
+		},
+		{
+			.name = "device",
+			.has_arg = 1,
+			.flag = NULL,
+			.val = 'D',
+		},
+		{
+			.name = NULL,
+		},
 	};
+	char *end;
 	int idx, ret;
 
 	AM_OPT_INIT(aopt);
 
-	while((ret = getopt_long(argc, argv, "s:lg", opt, &idx)) != -1) {
+	while((ret = getopt_long(argc, argv, "s:lgG:muSt::D:", opt, &idx)) != -1) {
 		switch(ret) {
 		case 's':
 			aopt->act = AA_SET;
@@ -75,6 +131,35 @@ int parse_args(struct am_opt *aopt, int argc, char *argv[])
 		case 'g':
 			aopt->act = AA_GET;
 			break;
+		case 'G':
+			aopt->gopt.db = strtod(optarg, &end);
+			if((end == optarg) || (*end != '\0'))
+				goto out;
+			aopt->act = AA_GAIN;
+			break;
+		case 'm':
+			aopt->act = AA_MUTE;
+			break;
+		case 'u':
+			aopt->act = AA_UNMUTE;
+			break;
+		case 'S':
+			aopt->act = AA_STATS;
+			break;
+		case 't':
+			aopt->topt.period_ms = 1000;
+			if(optarg != NULL) {
+				aopt->topt.period_ms = strtoul(optarg, &end,
+						10);
+				if((end == optarg) || (*end != '\0') ||
+						(aopt->topt.period_ms == 0))
+					goto out;
+			}
+			aopt->act = AA_TOP;
+			break;
+		case 'D':
+			aopt->dev = optarg;
+			break;
 		case '?':
 			goto out;
 		}
@@ -6,16 +6,32 @@ enum am_act {
 	AA_LIST,
 	AA_SET,
 	AA_GET,
+	AA_GAIN,
+	AA_MUTE,
+	AA_UNMUTE,
+	AA_STATS,
+	AA_TOP,
 };
 
 struct am_sopt {
 	char const *pcm;
 };
 
+struct am_gopt {
+	double db;
+};
+
+struct am_topt {
+	unsigned int period_ms;
+};
+
 struct am_opt {
 	enum am_act act;
+	char const *dev;
 	union {
 		struct am_sopt sopt;
+		struct am_gopt gopt;
+		struct am_topt topt;
 	};
 };
 
@@ -0,0 +1,283 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+
+#include "amuxctl.h"
+#include "stats.h"
+
+#define STATS_STREAM_NR 64
+
+static char const * const stats_cb_name[AMUX_STATS_CB_NR] = {
+	[AMUX_STATS_CB_TRANSFER] = "transfer",
+	[AMUX_STATS_CB_POINTER] = "pointer",
+	[AMUX_STATS_CB_POLL_REVENTS] = "poll_revents",
+	[AMUX_STATS_CB_DELAY] = "delay",
+	[AMUX_STATS_CB_HW_PARAMS] = "hw_params",
+	[AMUX_STATS_CB_SW_PARAMS] = "sw_params",
+	[AMUX_STATS_CB_PREPARE] = "prepare",
+	[AMUX_STATS_CB_START] = "start",
+	[AMUX_STATS_CB_STOP] = "stop",
+	[AMUX_STATS_CB_DRAIN] = "drain",
+	[AMUX_STATS_CB_PAUSE] = "pause",
+	[AMUX_STATS_CB_RESUME] = "resume",
+};
+
+static char const * const stats_switch_ph_name[] = AMUX_SWITCH_PH_NAMES;
+
+struct stats_stream {
+	char file[sizeof(AMUX_STATS_DIR) + 256];
+	struct amux_stats const *s;
+	uint64_t frames;
+	uint64_t wakeup;
+	uint64_t cb;
+};
+
+static uint64_t stats_cb_total(struct amux_stats const *s)
+{
+	uint64_t total = 0;
+	size_t i;
+
+	for(i = 0; i < AMUX_STATS_CB_NR; ++i)
+		total += AMUX_STATS_GET(s, cb[i]);
+
+	return total;
+}
+
+/*
+ * Map statistics of every live amux stream of the host, stale files left by
+ * dead processes are removed. The stream array grows as needed and has to be
+ * released with stats_release().
+ */
+static size_t stats_scan(struct stats_stream **pst)
+{
+	struct stats_stream *st = NULL, *tmp;
+	struct amux_stats const *s;
+	struct dirent *de;
+	size_t n = 0, nr = 0;
+	DIR *dir;
+
+	*pst = NULL;
+	dir = opendir(AMUX_STATS_DIR);
+	if(dir == NULL)
+		return 0;
+
+	while((de = readdir(dir)) != NULL) {
+		if(strncmp(de->d_name, AMUX_STATS_PREFIX,
+					strlen(AMUX_STATS_PREFIX)) != 0)
+			continue;
+		if(n == nr) {
+			nr = nr ? nr * 2 : STATS_STREAM_NR;
+			tmp = realloc(st, nr * sizeof(*st));
+			if(tmp == NULL) {
+				fprintf(stderr, "Out of memory, not all streams"
+						" are shown\n");
+				break;
+			}
+			st = tmp;
+		}
+		snprintf(st[n].file, sizeof(st[n].file), "%s/%s",
+				AMUX_STATS_DIR, de->d_name);
+		s = amux_stats_open(st[n].file);
+		if(s == NULL)
+			continue;
+		if((kill(s->pid, 0) != 0) && (errno == ESRCH)) {
+			amux_stats_unmap(s);
+			unlink(st[n].file);
+			continue;
+		}
+		st[n].s = s;
+		st[n].frames = 0;
+		st[n].wakeup = 0;
+		st[n].cb = 0;
+		++n;
+	}
+
+	closedir(dir);
+	*pst = st;
+	return n;
+}
+
+static void stats_release(struct stats_stream *st, size_t nr)
+{
+	size_t i;
+
+	for(i = 0; i < nr; ++i)
+		amux_stats_unmap(st[i].s);
+	free(st);
+}
+
+static char const *stats_stream_name(struct amux_stats const *s)
+{
+	return (s->stream == 0) ? "playback" : "capture";
+}
+
+/*
+ * Print performance counters per callback and for transfer copy kernel,
+ * averaged per call (and per frame for cycles)
+ */
+static void stats_dump_perf(struct amux_stats const *s)
+{
+	uint64_t calls, frames, v[AMUX_STATS_PERF_NR];
+	size_t i, j;
+
+	printf("  %-14s %10s %9s %11s %11s %5s %9s %8s %8s\n", "perf",
+			"calls", "us/call", "cycles/call", "instr/call",
+			"IPC", "miss/call", "ctxsw", "cyc/frame");
+	for(i = 0; i < AMUX_STATS_PERF_ROWS; ++i) {
+		calls = AMUX_STATS_GET(s, perf_calls[i]);
+		if(calls == 0)
+			continue;
+		frames = AMUX_STATS_GET(s, perf_frames[i]);
+		for(j = 0; j < AMUX_STATS_PERF_NR; ++j)
+			v[j] = AMUX_STATS_GET(s, perf[i][j]);
+		printf("  %-14s %10llu %9.2f %11.0f %11.0f %5.2f %9.1f %8llu",
+				(i == AMUX_STATS_PERF_COPY) ? "copy" :
+				stats_cb_name[i], (unsigned long long)calls,
+				v[AMUX_STATS_PERF_TASK_CLOCK] / 1e3 / calls,
+				(double)v[AMUX_STATS_PERF_CYCLES] / calls,
+				(double)v[AMUX_STATS_PERF_INSTRUCTIONS] / calls,
+				v[AMUX_STATS_PERF_CYCLES] ?
+				(double)v[AMUX_STATS_PERF_INSTRUCTIONS] /
+				v[AMUX_STATS_PERF_CYCLES] : 0.0,
+				(double)v[AMUX_STATS_PERF_CACHE_MISSES] / calls,
+				(unsigned long long)
+				v[AMUX_STATS_PERF_CTX_SWITCHES]);
+		if(frames != 0)
+			printf(" %8.2f", (double)v[AMUX_STATS_PERF_CYCLES] /
+					frames);
+		printf("\n");
+	}
+}
+
+/*
+ * Print last slave switches of a stream, most recent first, with time spent
+ * in each switch phase
+ */
+static void stats_dump_switches(struct amux_stats const *s)
+{
+	struct amux_stats_switch rec;
+	uint32_t i, total;
+	size_t j;
+
+	for(i = 0; amux_stats_switch_get(s, i, &rec) == 0; ++i) {
+		total = 0;
+		for(j = 0; j < AMUX_SWITCH_PH_NR; ++j)
+			total += rec.us[j];
+		printf("  switch to %s: %s in %uus (", rec.sname,
+				(rec.result == 0) ? "done" :
+				strerror(-rec.result),
+				total);
+		for(j = 0; j < AMUX_SWITCH_PH_NR; ++j)
+			printf("%s%s %u", (j == 0) ? "" : ", ",
+					stats_switch_ph_name[j], rec.us[j]);
+		printf(")\n");
+	}
+}
+
+int amux_stats_dump(void)
+{
+	struct stats_stream *st;
+	struct amux_stats const *s;
+	char sname[AMUX_STATS_NAMESZ];
+	size_t i, j, nr;
+
+	nr = stats_scan(&st);
+	if(nr == 0) {
+		free(st);
+		printf("No live amux stream\n");
+		return 0;
+	}
+
+	for(i = 0; i < nr; ++i) {
+		s = st[i].s;
+		amux_stats_get_slave(s, sname, sizeof(sname));
+		printf("PID %d PCM \"%s\" %s\n", (int)s->pid, s->pcm,
+				stats_stream_name(s));
+		printf("  slave %s, rate %u, fill %llu/%llu\n", sname,
+				AMUX_STATS_GET(s, rate),
+				(unsigned long long)AMUX_STATS_GET(s, fill),
+				(unsigned long long)AMUX_STATS_GET(s,
+					buffer_size));
+		printf("  frames %llu, xrun %llu, wakeup %llu (spurious %llu)"
+				", switch %llu (failed %llu)\n",
+				(unsigned long long)AMUX_STATS_GET(s, frames),
+				(unsigned long long)AMUX_STATS_GET(s, xrun),
+				(unsigned long long)AMUX_STATS_GET(s, wakeup),
+				(unsigned long long)AMUX_STATS_GET(s, spurious),
+				(unsigned long long)AMUX_STATS_GET(s, switches),
+				(unsigned long long)AMUX_STATS_GET(s,
+					switch_fail));
+		printf("  callbacks:");
+		for(j = 0; j < AMUX_STATS_CB_NR; ++j)
+			printf(" %s %llu", stats_cb_name[j],
+					(unsigned long long)AMUX_STATS_GET(s,
+						cb[j]));
+		printf("\n");
+		if(s->perf_enabled)
+			stats_dump_perf(s);
+		stats_dump_switches(s);
+	}
+
+	stats_release(st, nr);
+	return 0;
+}
+
+int amux_stats_top(unsigned int period_ms)
+{
+	struct stats_stream *st;
+	struct timespec ts = {
+		.tv_sec = period_ms / 1000,
+		.tv_nsec = (period_ms % 1000) * 1000000L,
+	};
+	struct amux_stats const *s;
+	char sname[AMUX_STATS_NAMESZ];
+	uint64_t frames, wakeup, cb, bsz;
+	double sec = period_ms / 1000.0;
+	size_t i, nr;
+
+	for(;;) {
+		nr = stats_scan(&st);
+		for(i = 0; i < nr; ++i) {
+			st[i].frames = AMUX_STATS_GET(st[i].s, frames);
+			st[i].wakeup = AMUX_STATS_GET(st[i].s, wakeup);
+			st[i].cb = stats_cb_total(st[i].s);
+		}
+
+		nanosleep(&ts, NULL);
+
+		printf("\033[H\033[2J");
+		printf("%-7s %-16s %-4s %-24s %5s %9s %6s %7s %8s %6s\n",
+				"PID", "PCM", "DIR", "SLAVE", "FILL%",
+				"FRAMES/s", "XRUN", "WAKE/s", "CB/s", "SWITCH");
+		for(i = 0; i < nr; ++i) {
+			s = st[i].s;
+			frames = AMUX_STATS_GET(s, frames) - st[i].frames;
+			wakeup = AMUX_STATS_GET(s, wakeup) - st[i].wakeup;
+			cb = stats_cb_total(s) - st[i].cb;
+			bsz = AMUX_STATS_GET(s, buffer_size);
+			amux_stats_get_slave(s, sname, sizeof(sname));
+			printf("%-7d %-16.16s %-4.4s %-24.24s %5llu %9.0f "
+					"%6llu %7.1f %8.1f %6llu\n",
+					(int)s->pid, s->pcm,
+					stats_stream_name(s), sname,
+					(unsigned long long)(bsz ?
+						AMUX_STATS_GET(s, fill) * 100 /
+						bsz : 0),
+					frames / sec,
+					(unsigned long long)AMUX_STATS_GET(s,
+						xrun),
+					wakeup / sec, cb / sec,
+					(unsigned long long)AMUX_STATS_GET(s,
+						switches));
+		}
+		fflush(stdout);
+
+		stats_release(st, nr);
+	}
+
+	return 0;
+}
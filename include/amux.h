@@ -4,6 +4,14 @@
 #include <stdio.h>
 #include <stddef.h>
 #include <assert.h>
+#include <time.h>
+
+#include "dsp/dsp.h"
+#include "log.h"
+#include "rt.h"
+#include "arena.h"
+#include "stats.h"
+#include "trace.h"
 
 //#define DEBUG
 
@@ -13,8 +21,8 @@
 #define AMUX_DBG(...)
 #endif
 
-#define AMUX_ERR(...) fprintf(stderr, __VA_ARGS__)
-#define AMUX_WARN(...) fprintf(stdout, __VA_ARGS__)
+#define AMUX_ERR(...) AMUX_LOG(AMUX_LOG_ERR, __VA_ARGS__)
+#define AMUX_WARN(...) AMUX_LOG(AMUX_LOG_WARN, __VA_ARGS__)
 
 #ifdef DEBUG
 #define AMUX_ASSERT(expr) assert(expr)
@@ -26,6 +34,10 @@
 #define ARRAY_SIZE(s) (sizeof(s) / sizeof(*(s)))
 #endif
 
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+
 #ifndef container_of
 /**
  * container_of - cast a member of a structure out to the containing structure
@@ -50,8 +62,84 @@
 #define SLAVENR 32
 
 struct poller;
+struct amux_gain_ctl;
 
 #define CARD_NAMESZ 128
+/* Switch duration histogram buckets: < 1ms, < 2ms, ... < 512ms, >= 512ms */
+#define SWITCH_HIST_NR 11
+
+/**
+ * Gain to apply when a given slave is used
+ */
+struct amux_preset {
+	/**
+	 * Slave name
+	 */
+	char sname[CARD_NAMESZ];
+	/**
+	 * Gain in dB
+	 */
+	float db;
+};
+
+/**
+ * Per-slave runtime statistics
+ */
+struct amux_slave_stats {
+	/**
+	 * Slave name
+	 */
+	char sname[CARD_NAMESZ];
+	/**
+	 * Number of xrun recovered
+	 */
+	unsigned long xrun;
+	/**
+	 * Last xrun recovery time (CLOCK_MONOTONIC)
+	 */
+	struct timespec xrun_ts;
+	/**
+	 * First use time of this slave (CLOCK_MONOTONIC)
+	 */
+	struct timespec first_ts;
+	/**
+	 * Number of slave wakeups
+	 */
+	unsigned long wakeup;
+	/**
+	 * Number of wakeups with less than avail_min frames ready
+	 */
+	unsigned long spurious;
+	/**
+	 * Learned slave avail_min, 0 if client one is used
+	 */
+	snd_pcm_uframes_t avail_min;
+	/**
+	 * Highest avail_min that can be used without causing xrun
+	 */
+	snd_pcm_uframes_t avail_max;
+	/**
+	 * Number of times slave has been put idle
+	 */
+	unsigned long idle;
+	/**
+	 * Learned slave buffer headroom (in frames) for adaptive buffering
+	 */
+	snd_pcm_uframes_t headroom;
+	/**
+	 * Last headroom change time (CLOCK_MONOTONIC)
+	 */
+	struct timespec headroom_ts;
+	/**
+	 * Histogram of successful switch durations to this slave
+	 */
+	unsigned long switch_hist[SWITCH_HIST_NR];
+	/**
+	 * Longest successful switch to this slave in microseconds
+	 */
+	unsigned long switch_max;
+};
+
 /**
  * Amux master PCM structure
  */
@@ -80,11 +168,178 @@ struct snd_pcm_amux {
 	 * Configured ring buffer boundary
 	 */
 	snd_pcm_uframes_t boundary;
+	/**
+	 * Slave application pointer expressed in master buffer positions. It
+	 * follows io.appl_ptr except when a master rewind or forward could not
+	 * be fully applied on the slave.
+	 */
+	snd_pcm_uframes_t sappl;
+	/**
+	 * Slave buffer size, can be bigger than master one to make room for
+	 * xrun silence prefill
+	 */
+	snd_pcm_uframes_t sbuffer_size;
+	/**
+	 * Silence frames to prefill slave with on xrun recovery
+	 */
+	snd_pcm_uframes_t prefill;
+	/**
+	 * Maximum adaptive buffering headroom, 0 for one buffer size
+	 */
+	snd_pcm_uframes_t adapt_max;
+	/**
+	 * File learned adaptive buffering headrooms are persisted in, NULL if
+	 * adaptive buffering is disabled
+	 */
+	char *adapt_file;
+	/**
+	 * Adaptive headroom grew past the slave buffer, slave is reconfigured
+	 * at next prepare or switch
+	 */
+	unsigned char headroom_stale;
+	/**
+	 * Seconds of silence after which slave is put idle, 0 to disable
+	 */
+	unsigned int idle_timeout;
+	/**
+	 * Number of consecutive silent frames written
+	 */
+	snd_pcm_uframes_t idle_frames;
+	/**
+	 * Virtual clock hardware pointer origin while slave is idle
+	 */
+	snd_pcm_uframes_t idle_hw;
+	/**
+	 * Virtual clock time origin while slave is idle (CLOCK_MONOTONIC)
+	 */
+	struct timespec idle_ts;
+	/**
+	 * Virtual clock timer file descriptor, polled while slave is idle
+	 */
+	int idle_fd;
+	/**
+	 * Hardware pointer to report until prefilled silence has been played
+	 */
+	snd_pcm_uframes_t hwmin;
+	/**
+	 * Client avail_min, slave is ready when at least this many frames are
+	 * available
+	 */
+	snd_pcm_uframes_t avail_min;
+	/**
+	 * Wakeups in current spurious wakeup measuring window
+	 */
+	unsigned int wkwin;
+	/**
+	 * Spurious wakeups in current measuring window
+	 */
+	unsigned int wkspurious;
+	/**
+	 * Slave avail_min raised by spurious wakeup adaptation, applied at
+	 * next transfer or prepare rather than from poll_revents, 0 if none
+	 */
+	snd_pcm_uframes_t avail_min_pending;
+	/**
+	 * Per-slave statistics
+	 */
+	struct amux_slave_stats sstats[SLAVENR];
+	/**
+	 * Number of used per-slave statistics
+	 */
+	size_t sstatsnr;
+	/**
+	 * Transfer path processing (format conversion and channel mixing)
+	 */
+	struct dsp dsp;
+	/**
+	 * Channel map set by user, as a snd_pcm_chmap_t (first element is the
+	 * number of channels, 0 if no map has been set)
+	 */
+	unsigned int chmap[DSP_CHANNELS_MAX + 1];
+	/**
+	 * Shared gain control, NULL if not configured
+	 */
+	struct amux_gain_ctl *gctl;
+	/**
+	 * Last gain control value applied (in millibel)
+	 */
+	int32_t gain_mb;
+	/**
+	 * Last gain control mute value applied
+	 */
+	uint32_t gain_mute;
+	/**
+	 * Gain preset of current slave in dB
+	 */
+	float gain_preset;
+	/**
+	 * Per-slave gain presets
+	 */
+	struct amux_preset preset[SLAVENR];
+	/**
+	 * Number of gain presets
+	 */
+	size_t presetnr;
 	/**
 	 * Keep slave tstamp type so we can reset it at swparams
 	 * This params cannot be changed at runtime
 	 */
 	snd_pcm_tstamp_type_t slave_tstamp;
+	/**
+	 * Master state before slave got suspended, restored on resume
+	 */
+	snd_pcm_state_t suspend_state;
+	/**
+	 * Live statistics, shared memory mapped if published, stats_priv
+	 * otherwise
+	 */
+	struct amux_stats *stats;
+	/**
+	 * Unpublished live statistics
+	 */
+	struct amux_stats stats_priv;
+	/**
+	 * Published live statistics file path, empty if not published
+	 */
+	char stats_path[64];
+	/**
+	 * Per-instance memory arena (poller instance and scratch params)
+	 */
+	struct amux_arena arena;
+	/**
+	 * Slave software params scratch, carved from arena at open so that
+	 * avail_min can be changed without allocating
+	 */
+	snd_pcm_sw_params_t *swp;
+	/**
+	 * Realtime mode parameters
+	 */
+	struct amux_rt rt;
+	/**
+	 * Configuration file watching thread (realtime mode only)
+	 */
+	pthread_t wth;
+	/**
+	 * Configuration file inotify descriptor, -1 if not watched
+	 */
+	int wfd;
+	/**
+	 * Configuration file change generation, bumped by watching thread
+	 */
+	unsigned int swgen;
+	/**
+	 * Last configuration file change generation checked for slave switch
+	 */
+	unsigned int swseen;
+	/**
+	 * Powersave wakeup alignment in microseconds
+	 */
+	unsigned int slack;
+	/**
+	 * Current slave trace id, also read by the thread poller, use
+	 * AMUX_TRACE_SLAVE() and AMUX_TRACE_SLAVE_SET()
+	 */
+	unsigned short trace_slave;
 	/**
 	 * Current open mode
 	 */
@@ -98,6 +353,47 @@ struct snd_pcm_amux {
 	 * situations
 	 */
 	unsigned char noresample_ignore;
+	/**
+	 * Use dither when converting to a less precise slave format
+	 */
+	unsigned char dither;
+	/**
+	 * Measure performance counters per callback
+	 */
+	unsigned char perf;
+	/**
+	 * Performance counters of perf_thread are held by this PCM
+	 */
+	unsigned char perf_held;
+	/**
+	 * Thread that prepared the PCM and holds its performance counters
+	 */
+	pthread_t perf_thread;
+	/**
+	 * Current slave supports hardware pause
+	 */
+	unsigned char can_pause;
+	/**
+	 * Asynchronous logger has been started for this PCM
+	 */
+	unsigned char logging;
+	/**
+	 * Tracer has been started for this PCM
+	 */
+	unsigned char tracing;
+	/**
+	 * Powersave profile, wakeups are coalesced and buffer is maximized
+	 */
+	unsigned char powersave;
+	/**
+	 * Slave is idle (paused or stopped) and clients are fed from a virtual
+	 * clock
+	 */
+	unsigned char idle;
+	/**
+	 * Prefilled silence is being played, hwmin is valid
+	 */
+	unsigned char prefilling;
 	/**
 	 * Does asound library version need workarounds
 	 */
@@ -109,4 +405,8 @@ struct snd_pcm_amux {
 #define to_pcm_amux(p) (container_of(p, struct snd_pcm_amux, io))
 
 #define POLLER_DEFAULT "dupfd"
+
+int amux_wakeup(struct snd_pcm_amux *amx, snd_pcm_sframes_t avail);
+snd_pcm_sframes_t amux_avail(struct snd_pcm_amux *amx);
+void amux_idle_arm(struct snd_pcm_amux *amx);
 #endif
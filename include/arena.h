@@ -0,0 +1,112 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "rt.h"
+
+#define AMUX_ARENA_ALIGN 16
+
+/**
+ * Per-instance memory arena. It is allocated once at open and everything amux
+ * and pollers need afterwards is carved from it, so that neither steady state
+ * nor slave switches allocate. Allocations are only released all at once, or
+ * back to a mark for scratch memory.
+ */
+struct amux_arena {
+	/**
+	 * Arena memory
+	 */
+	char *base;
+	/**
+	 * Arena size in bytes
+	 */
+	size_t size;
+	/**
+	 * Used bytes
+	 */
+	size_t used;
+	/**
+	 * Highest used bytes
+	 */
+	size_t peak;
+};
+
+/**
+ * Round up a size to arena alignment
+ */
+#define amux_arena_round(sz)						\
+	(((sz) + AMUX_ARENA_ALIGN - 1) & ~((size_t)AMUX_ARENA_ALIGN - 1))
+
+/**
+ * Allocate arena memory
+ *
+ * @param a: Arena to initialize
+ * @param size: Arena size in bytes
+ * @return: 0 on success, negative number otherwise
+ */
+static inline int amux_arena_init(struct amux_arena *a, size_t size)
+{
+	RT_ASSERT_COLD();
+	size = amux_arena_round(size);
+	if(posix_memalign((void **)&a->base, AMUX_ARENA_ALIGN, size) != 0)
+		return -ENOMEM;
+
+	a->size = size;
+	a->used = 0;
+	a->peak = 0;
+
+	return 0;
+}
+
+/**
+ * Release arena memory
+ *
+ * @param a: Arena to release
+ */
+static inline void amux_arena_destroy(struct amux_arena *a)
+{
+	RT_ASSERT_COLD();
+	free(a->base);
+	a->base = NULL;
+	a->size = 0;
+}
+
+/**
+ * Carve zeroed memory from arena
+ *
+ * @param a: Arena to allocate from
+ * @param size: Number of bytes to allocate
+ * @return: Allocated memory on success, NULL if arena is exhausted
+ */
+static inline void *amux_arena_alloc(struct amux_arena *a, size_t size)
+{
+	void *ret;
+
+	RT_ASSERT_COLD();
+	size = amux_arena_round(size);
+	if(size > a->size - a->used)
+		return NULL;
+
+	ret = a->base + a->used;
+	a->used += size;
+	if(a->used > a->peak)
+		a->peak = a->used;
+	memset(ret, 0, size);
+
+	return ret;
+}
+
+/**
+ * Get current arena position, to release scratch memory back to it
+ */
+#define amux_arena_mark(a) ((a)->used)
+
+/**
+ * Release all memory allocated since mark
+ */
+#define amux_arena_release(a, mark) ((a)->used = (mark))
+
+#endif
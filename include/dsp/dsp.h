@@ -0,0 +1,189 @@
+#ifndef _DSP_H_
+#define _DSP_H_
+
+#include <stdint.h>
+
+/**
+ * Number of samples processed at once when the slave and the master formats
+ * differ. The intermediate block lives on the stack and should stay cache hot.
+ */
+#define DSP_BLOCK_SAMPLES 1024
+
+/**
+ * Maximum number of channels amux can remap or mix.
+ */
+#define DSP_CHANNELS_MAX 8
+
+/**
+ * Number of frames used to ramp from a gain value to another one.
+ */
+#define DSP_RAMP_FRAMES 256
+
+/*
+ * Kernels are written so that the compiler can vectorize the contiguous case
+ * (dstep == 1 and sstep == sample size). On x86_64 an AVX2 version of each
+ * kernel is also built, the best one is picked by the dynamic loader.
+ */
+#if defined(__x86_64__) && defined(__GNUC__) && (__GNUC__ >= 6)
+#define DSP_KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define DSP_KERNEL
+#endif
+
+struct dsp;
+
+/**
+ * Convert n samples from a PCM format into float
+ *
+ * @param dst: Float samples output
+ * @param dstep: Distance between two output samples (in samples)
+ * @param src: PCM samples input
+ * @param sstep: Distance between two input samples (in bytes)
+ * @param n: Number of samples to convert
+ */
+typedef void (*dsp_load_t)(float *dst, size_t dstep, void const *src,
+		size_t sstep, size_t n);
+
+/**
+ * Convert n float samples into a PCM format
+ *
+ * @param d: DSP instance (for dither state)
+ * @param dst: PCM samples output
+ * @param dstep: Distance between two output samples (in bytes)
+ * @param src: Float samples input
+ * @param sstep: Distance between two input samples (in samples)
+ * @param n: Number of samples to convert
+ */
+typedef void (*dsp_store_t)(struct dsp *d, void *dst, size_t dstep,
+		float const *src, size_t sstep, size_t n);
+
+/**
+ * Sample conversion kernels for one PCM format
+ */
+struct dsp_kernel {
+	/**
+	 * PCM format these kernels handle
+	 */
+	snd_pcm_format_t fmt;
+	/**
+	 * Format to float conversion
+	 */
+	dsp_load_t load;
+	/**
+	 * Float to format conversion
+	 */
+	dsp_store_t store;
+	/**
+	 * Float to format conversion with TPDF dither, NULL if format is
+	 * precise enough not to need dither
+	 */
+	dsp_store_t store_dither;
+	/**
+	 * Significant bits of the format
+	 */
+	unsigned int bits;
+};
+
+/**
+ * Transfer path processing, everything that happens between master and slave
+ * buffers.
+ */
+struct dsp {
+	/**
+	 * Input format kernels
+	 */
+	struct dsp_kernel const *in;
+	/**
+	 * Output format kernels
+	 */
+	struct dsp_kernel const *out;
+	/**
+	 * Output store function (with or without dither)
+	 */
+	dsp_store_t store;
+	/**
+	 * Input PCM format
+	 */
+	snd_pcm_format_t ifmt;
+	/**
+	 * Output PCM format
+	 */
+	snd_pcm_format_t ofmt;
+	/**
+	 * Input sample physical size in bytes
+	 */
+	unsigned int iwidth;
+	/**
+	 * Output sample physical size in bytes
+	 */
+	unsigned int owidth;
+	/**
+	 * Number of input channels
+	 */
+	unsigned int ichannels;
+	/**
+	 * Number of output channels
+	 */
+	unsigned int ochannels;
+	/**
+	 * Channel mixing matrix, output channel o is the sum of input channels
+	 * i weighted by matrix[o * DSP_CHANNELS_MAX + i]
+	 */
+	float matrix[DSP_CHANNELS_MAX * DSP_CHANNELS_MAX];
+	/**
+	 * Current linear gain
+	 */
+	float gain;
+	/**
+	 * Linear gain to ramp to
+	 */
+	float gtarget;
+	/**
+	 * Gain increment per frame while ramping
+	 */
+	float gstep;
+	/**
+	 * Number of frames left to ramp
+	 */
+	unsigned int gramp;
+	/**
+	 * Dither noise generator state
+	 */
+	uint32_t seed;
+	/**
+	 * Channels need to be remapped or mixed
+	 */
+	unsigned char mix;
+	/**
+	 * Input and output formats and channels are the same, do a plain copy
+	 */
+	unsigned char passthrough;
+};
+
+void dsp_init(struct dsp *d);
+int dsp_format_supported(snd_pcm_format_t fmt);
+snd_pcm_format_t const *dsp_formats(size_t *nr);
+int dsp_setup(struct dsp *d, snd_pcm_format_t ifmt, unsigned int ichannels,
+		snd_pcm_format_t ofmt, unsigned int ochannels, int dither);
+int dsp_set_chmap(struct dsp *d, snd_pcm_chmap_t const *imap,
+		snd_pcm_chmap_t const *omap);
+int dsp_set_gain(struct dsp *d, float gain);
+void dsp_process(struct dsp *d, snd_pcm_channel_area_t const *dst,
+		snd_pcm_uframes_t doff, snd_pcm_channel_area_t const *src,
+		snd_pcm_uframes_t soff, snd_pcm_uframes_t frames);
+
+struct dsp_kernel const *dsp_kernel_find(snd_pcm_format_t fmt);
+void dsp_mix(float *dst, float const *src, float const *matrix,
+		unsigned int ich, unsigned int och, size_t n, size_t stride);
+void dsp_gain(struct dsp *d, float *buf, size_t frames, size_t fstep,
+		size_t cstep, unsigned int ch);
+int dsp_silent(snd_pcm_channel_area_t const *a, snd_pcm_uframes_t off,
+		unsigned int ch, snd_pcm_format_t fmt, snd_pcm_uframes_t frames);
+int dsp_zero(void const *buf, size_t len);
+
+/**
+ * Check if gain stage has nothing to do
+ */
+#define dsp_gain_unity(d) (((d)->gramp == 0) && ((d)->gain == 1.0f))
+
+#endif
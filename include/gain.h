@@ -0,0 +1,88 @@
+#ifndef _GAIN_H_
+#define _GAIN_H_
+
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define AMUX_GAIN_MAGIC 0x474d5841 /* "AMXG" */
+
+/**
+ * Gain control, shared between amux PCMs and amuxctl through a memory mapped
+ * file. Fields are only accessed atomically so that volume changes never block
+ * the audio path.
+ */
+struct amux_gain_ctl {
+	/**
+	 * Control file signature
+	 */
+	uint32_t magic;
+	/**
+	 * Stream gain in millibel (1/100 dB)
+	 */
+	int32_t mb;
+	/**
+	 * Stream is muted if not 0
+	 */
+	uint32_t mute;
+};
+
+/**
+ * Map gain control file, creating it if needed
+ *
+ * @param path: Gain control file path
+ * @return: Mapped gain control on success, NULL otherwise
+ */
+static inline struct amux_gain_ctl *amux_gain_ctl_map(char const *path)
+{
+	struct amux_gain_ctl *g;
+	struct stat st;
+	uint32_t magic = 0;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	if(fd < 0)
+		return NULL;
+
+	if((fstat(fd, &st) == 0) && ((size_t)st.st_size < sizeof(*g)) &&
+			(ftruncate(fd, sizeof(*g)) != 0)) {
+		close(fd);
+		return NULL;
+	}
+
+	g = mmap(NULL, sizeof(*g), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(g == MAP_FAILED)
+		return NULL;
+
+	/* New file, zero filled means 0dB and unmuted */
+	__atomic_compare_exchange_n(&g->magic, &magic, AMUX_GAIN_MAGIC, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	if(__atomic_load_n(&g->magic, __ATOMIC_RELAXED) != AMUX_GAIN_MAGIC) {
+		munmap(g, sizeof(*g));
+		return NULL;
+	}
+
+	return g;
+}
+
+/**
+ * Unmap gain control file
+ *
+ * @param g: Mapped gain control
+ */
+static inline void amux_gain_ctl_unmap(struct amux_gain_ctl *g)
+{
+	munmap(g, sizeof(*g));
+}
+
+#define amux_gain_ctl_get_mb(g) __atomic_load_n(&(g)->mb, __ATOMIC_RELAXED)
+#define amux_gain_ctl_get_mute(g) __atomic_load_n(&(g)->mute, __ATOMIC_RELAXED)
+#define amux_gain_ctl_set_mb(g, v)					\
+	__atomic_store_n(&(g)->mb, (v), __ATOMIC_RELAXED)
+#define amux_gain_ctl_set_mute(g, v)					\
+	__atomic_store_n(&(g)->mute, (v), __ATOMIC_RELAXED)
+
+#endif
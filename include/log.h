@@ -0,0 +1,41 @@
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#define AMUX_LOG_NONE (-1)
+#define AMUX_LOG_ERR 0
+#define AMUX_LOG_WARN 1
+
+/**
+ * Per call site log rate limiting state
+ */
+struct amux_log_site {
+	/**
+	 * Current rate limiting window (CLOCK_MONOTONIC_COARSE seconds)
+	 */
+	long window;
+	/**
+	 * Messages logged in current window
+	 */
+	unsigned int count;
+	/**
+	 * Messages suppressed in current window
+	 */
+	unsigned int suppressed;
+};
+
+/**
+ * Log a message without blocking, at most a few times per second per call
+ * site
+ */
+#define AMUX_LOG(lvl, ...) do {						\
+	static struct amux_log_site __amux_log_site;			\
+	amux_log(&__amux_log_site, (lvl), __VA_ARGS__);			\
+} while(0)
+
+void amux_log(struct amux_log_site *site, int level, char const *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+int amux_log_start(int level, char const *sink);
+void amux_log_stop(void);
+int amux_log_level(char const *str);
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef _PERF_H_
+#define _PERF_H_
+
+#include <stdint.h>
+
+#include "stats.h"
+
+/**
+ * Callback or kernel whose performance counters are being measured
+ */
+struct amux_perf_scope {
+	/**
+	 * Statistics to accumulate counters into, NULL if not measured
+	 */
+	struct amux_stats *s;
+	/**
+	 * Statistics row (callback or AMUX_STATS_PERF_COPY)
+	 */
+	unsigned int row;
+	/**
+	 * Frames processed in scope
+	 */
+	uint64_t frames;
+	/**
+	 * Counters value at scope enter
+	 */
+	uint64_t start[AMUX_STATS_PERF_NR];
+};
+
+int amux_perf_get(void);
+void amux_perf_put(void);
+int amux_perf_read(uint64_t val[AMUX_STATS_PERF_NR]);
+
+/**
+ * Start measuring a callback or kernel.
+ *
+ * @param s: Statistics to accumulate counters into.
+ * @param enabled: Performance counters are enabled.
+ * @param row: Statistics row.
+ * @return: Measure scope.
+ */
+static inline struct amux_perf_scope amux_perf_enter(struct amux_stats *s,
+		unsigned char enabled, unsigned int row)
+{
+	struct amux_perf_scope sc = {
+		.s = NULL,
+		.row = row,
+		.frames = 0,
+	};
+
+	if(enabled && (amux_perf_read(sc.start) == 0))
+		sc.s = s;
+	return sc;
+}
+
+/**
+ * Stop measuring a callback or kernel and account counters deltas.
+ *
+ * @param sc: Measure scope.
+ */
+static inline void amux_perf_exit(struct amux_perf_scope *sc)
+{
+	uint64_t end[AMUX_STATS_PERF_NR];
+	size_t i;
+
+	if((sc->s == NULL) || (amux_perf_read(end) != 0))
+		return;
+
+	for(i = 0; i < AMUX_STATS_PERF_NR; ++i)
+		AMUX_STATS_ADD(sc->s, perf[sc->row][i], end[i] - sc->start[i]);
+	AMUX_STATS_ADD(sc->s, perf_calls[sc->row], 1);
+	AMUX_STATS_ADD(sc->s, perf_frames[sc->row], sc->frames);
+}
+
+/**
+ * Measure performance counters of the rest of the enclosing scope
+ */
+#define AMUX_PERF_SCOPE(amx, row)					\
+	struct amux_perf_scope __amux_perf				\
+		__attribute__((cleanup(amux_perf_exit), unused)) =	\
+		amux_perf_enter((amx)->stats, (amx)->perf, (row))
+
+/**
+ * Set frames processed in measured scope
+ */
+#define AMUX_PERF_FRAMES(n) (__amux_perf.frames = (n))
+
+#endif
@@ -2,19 +2,21 @@
 #define _POLLER_H_
 
 #define POLLER_NAME_MAXSZ 64
+#define POLLER_POLLFD_MAX 16 /* Alsa lib max poll fd */
 
 struct poller;
+struct amux_arena;
 
 /**
  * Poller operations
  */
 struct poller_ops {
 	/**
-	 * Create a new poller instance
+	 * Create a new poller instance, memory is taken from amux arena
 	 */
-	int (*create)(struct poller **p, void *args);
+	int (*create)(struct poller **p, struct amux_arena *arena, void *args);
 	/**
-	 * Destroy a poller instance
+	 * Destroy a poller instance, its memory is released with amux arena
 	 */
 	void (*destroy)(struct poller *p);
 	/**
@@ -38,6 +40,12 @@ struct poller_ops {
 	 * Notify that a slave data transfer has been done
 	 */
 	void (*transfer)(struct poller *p);
+	/**
+	 * Poll fd instead of slave descriptors while slave is idle, fd < 0
+	 * restores slave descriptors. Optional, idle detection is not
+	 * available if not implemented.
+	 */
+	int (*idle)(struct poller *p, int fd);
 };
 
 /**
@@ -69,6 +77,18 @@ struct poller {
 	struct snd_pcm_amux *amx;
 };
 
+/**
+ * Poll event notifying that slave is ready (POLLOUT for playback, POLLIN for
+ * capture)
+ */
+#define poller_event(p)							\
+	(((p)->amx->stream == SND_PCM_STREAM_PLAYBACK) ? POLLOUT : POLLIN)
+
+/**
+ * Number of available frames needed for slave to be ready
+ */
+#define poller_threshold(p) ((snd_pcm_sframes_t)(p)->amx->avail_min)
+
 /**
  * Register a poller implementation
  */
@@ -83,5 +103,13 @@ int poller_descriptors(struct poller *p, struct pollfd *pfd, size_t nr);
 int poller_poll_revents(struct poller *p, struct pollfd *pfd, size_t nr,
 		unsigned short *revents);
 void poller_transfer(struct poller *p);
+int poller_ready(struct poller *p, snd_pcm_sframes_t avail);
+int poller_idle(struct poller *p, int fd);
+int poller_idle_revents(struct poller *p, unsigned short *revents);
+
+/**
+ * Check if poller can be used with an idle slave
+ */
+#define poller_can_idle(p) ((p)->desc->ops->idle != NULL)
 
 #endif
@@ -0,0 +1,21 @@
+#ifndef _POLLER_THREAD_H_
+#define _POLLER_THREAD_H_
+
+struct amux_rt;
+
+/**
+ * Thread poller creation arguments
+ */
+struct pollthr_args {
+	/**
+	 * Amux master, bound before the polling thread starts as the thread
+	 * traces with it
+	 */
+	struct snd_pcm_amux *amx;
+	/**
+	 * Realtime parameters of the polling thread, NULL for default ones
+	 */
+	struct amux_rt const *rt;
+};
+
+#endif
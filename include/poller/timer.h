@@ -0,0 +1,15 @@
+#ifndef _POLLER_TIMER_H_
+#define _POLLER_TIMER_H_
+
+/**
+ * Timer poller creation arguments
+ */
+struct timer_args {
+	/**
+	 * Wakeups are aligned on multiple of this value (in microseconds) so
+	 * that they can be coalesced with other ones, 0 for no alignment
+	 */
+	unsigned int slack;
+};
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef _PROBE_H_
+#define _PROBE_H_
+
+/*
+ * USDT static probes for bpftrace or perf, e.g. :
+ *  bpftrace -e 'usdt:./build/libasound_pcm_amux.so:amux:xrun
+ *  { printf("%s\n", str(arg0)); }'
+ * A probe is a single nop until a tracer attaches to it. Probes are only built
+ * in if sys/sdt.h (systemtap sdt development files) is found at build time,
+ * otherwise their arguments are not even evaluated.
+ */
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define AMUX_PROBE1(name, a) DTRACE_PROBE1(amux, name, a)
+#define AMUX_PROBE2(name, a, b) DTRACE_PROBE2(amux, name, a, b)
+#define AMUX_PROBE3(name, a, b, c) DTRACE_PROBE3(amux, name, a, b, c)
+#else
+#define AMUX_PROBE1(name, a) do {					\
+	(void)sizeof(a);						\
+} while(0)
+#define AMUX_PROBE2(name, a, b) do {					\
+	(void)sizeof(a);						\
+	(void)sizeof(b);						\
+} while(0)
+#define AMUX_PROBE3(name, a, b, c) do {					\
+	(void)sizeof(a);						\
+	(void)sizeof(b);						\
+	(void)sizeof(c);						\
+} while(0)
+#endif
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef _RT_H_
+#define _RT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/**
+ * Realtime parameters applied to every amux owned thread
+ */
+struct amux_rt {
+	/**
+	 * CPU affinity mask (bit n for CPU n), 0 to keep inherited one
+	 */
+	uint64_t cpus;
+	/**
+	 * Scheduling policy (SCHED_FIFO or SCHED_RR)
+	 */
+	int policy;
+	/**
+	 * Scheduling priority
+	 */
+	int priority;
+	/**
+	 * Lock per-stream structures in memory
+	 */
+	unsigned char mlock;
+	/**
+	 * Realtime mode is enabled
+	 */
+	unsigned char enabled;
+};
+
+int rt_thread_create(struct amux_rt const *rt, pthread_t *th,
+		void *(*fn)(void *), void *arg);
+void rt_mlock(struct amux_rt const *rt, void const *addr, size_t len);
+void rt_munlock(struct amux_rt const *rt, void const *addr, size_t len);
+int rt_parse_cpus(char const *str, uint64_t *cpus);
+
+#ifdef DEBUG
+#include <assert.h>
+
+extern __thread unsigned char rt_hot;
+
+static inline unsigned char rt_hot_enter(struct amux_rt const *rt)
+{
+	unsigned char prev = rt_hot;
+	rt_hot = rt->enabled;
+	return prev;
+}
+
+static inline void rt_hot_restore(unsigned char *prev)
+{
+	rt_hot = *prev;
+}
+
+/**
+ * Mark the rest of the enclosing scope as realtime steady state hot path, no
+ * allocation, file I/O or blocking lock is allowed there
+ */
+#define RT_HOT_SECTION(rt)						\
+	unsigned char __rt_prev						\
+		__attribute__((cleanup(rt_hot_restore), unused)) =	\
+		rt_hot_enter(rt)
+
+/**
+ * Leave steady state (e.g. on slave switch or xrun recovery)
+ */
+#define RT_HOT_LEAVE() (rt_hot = 0)
+
+/**
+ * Fire if called from realtime steady state hot path
+ */
+#define RT_ASSERT_COLD() assert(!rt_hot)
+#else
+#define RT_HOT_SECTION(rt) do {} while(0)
+#define RT_HOT_LEAVE() do {} while(0)
+#define RT_ASSERT_COLD() do {} while(0)
+#endif
+
+#endif
@@ -0,0 +1,403 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define AMUX_STATS_MAGIC 0x53584d41 /* "AMXS" */
+#define AMUX_STATS_VERSION 3
+#define AMUX_STATS_DIR "/dev/shm"
+#define AMUX_STATS_PREFIX "amux-stats."
+#define AMUX_STATS_NAMESZ 128
+#define AMUX_STATS_SWITCH_NR 16
+
+/**
+ * Callbacks counted in live statistics
+ */
+enum amux_stats_cb {
+	AMUX_STATS_CB_TRANSFER,
+	AMUX_STATS_CB_POINTER,
+	AMUX_STATS_CB_POLL_REVENTS,
+	AMUX_STATS_CB_DELAY,
+	AMUX_STATS_CB_HW_PARAMS,
+	AMUX_STATS_CB_SW_PARAMS,
+	AMUX_STATS_CB_PREPARE,
+	AMUX_STATS_CB_START,
+	AMUX_STATS_CB_STOP,
+	AMUX_STATS_CB_DRAIN,
+	AMUX_STATS_CB_PAUSE,
+	AMUX_STATS_CB_RESUME,
+	AMUX_STATS_CB_NR,
+};
+
+/**
+ * Performance counters measured per callback
+ */
+enum amux_stats_perf {
+	AMUX_STATS_PERF_TASK_CLOCK,
+	AMUX_STATS_PERF_CYCLES,
+	AMUX_STATS_PERF_INSTRUCTIONS,
+	AMUX_STATS_PERF_CACHE_MISSES,
+	AMUX_STATS_PERF_CTX_SWITCHES,
+	AMUX_STATS_PERF_NR,
+};
+
+/* Performance counters row of the transfer copy kernel */
+#define AMUX_STATS_PERF_COPY AMUX_STATS_CB_NR
+/* Number of performance counters rows, one per callback plus copy kernel */
+#define AMUX_STATS_PERF_ROWS (AMUX_STATS_CB_NR + 1)
+
+/**
+ * Slave switch phases
+ */
+enum amux_switch_phase {
+	AMUX_SWITCH_PH_CONFIG,
+	AMUX_SWITCH_PH_OPEN,
+	AMUX_SWITCH_PH_HW_PARAMS,
+	AMUX_SWITCH_PH_SW_PARAMS,
+	AMUX_SWITCH_PH_PREPARE,
+	AMUX_SWITCH_PH_POLLER,
+	AMUX_SWITCH_PH_NR,
+};
+
+/**
+ * Slave switch phase names, indexed by enum amux_switch_phase
+ */
+#define AMUX_SWITCH_PH_NAMES {						\
+	"config", "open", "hw_params", "sw_params", "prepare", "poller"	\
+}
+
+/**
+ * Slave switch profile record
+ */
+struct amux_stats_switch {
+	/**
+	 * Record sequence counter, odd while record is updated
+	 */
+	uint32_t seq;
+	/**
+	 * Switch result, 0 on success, negative number otherwise
+	 */
+	int32_t result;
+	/**
+	 * Switch end time (CLOCK_MONOTONIC nanoseconds)
+	 */
+	uint64_t ts;
+	/**
+	 * Time spent in each switch phase in microseconds
+	 */
+	uint32_t us[AMUX_SWITCH_PH_NR];
+	/**
+	 * Target slave name
+	 */
+	char sname[AMUX_STATS_NAMESZ];
+};
+
+/**
+ * Live statistics of an amux stream, shared with amuxctl through a memory
+ * mapped file per stream. Counters are only updated with relaxed atomics so
+ * that publishing them costs the audio path nothing more than an increment.
+ */
+struct amux_stats {
+	/**
+	 * Statistics file signature
+	 */
+	uint32_t magic;
+	/**
+	 * Layout version
+	 */
+	uint32_t version;
+	/**
+	 * Process the stream belongs to
+	 */
+	int32_t pid;
+	/**
+	 * Stream direction (SND_PCM_STREAM_PLAYBACK or SND_PCM_STREAM_CAPTURE)
+	 */
+	uint32_t stream;
+	/**
+	 * Amux PCM name
+	 */
+	char pcm[AMUX_STATS_NAMESZ];
+	/**
+	 * Current slave name, consistent when sseq is even and has not changed
+	 * while reading it
+	 */
+	char sname[AMUX_STATS_NAMESZ];
+	/**
+	 * Slave name sequence counter, odd while slave name is updated
+	 */
+	uint32_t sseq;
+	/**
+	 * Stream rate
+	 */
+	uint32_t rate;
+	/**
+	 * Stream buffer size in frames
+	 */
+	uint64_t buffer_size;
+	/**
+	 * Frames queued in buffer at last transfer
+	 */
+	uint64_t fill;
+	/**
+	 * Frames transferred
+	 */
+	uint64_t frames;
+	/**
+	 * Xrun recovered
+	 */
+	uint64_t xrun;
+	/**
+	 * Slave wakeups
+	 */
+	uint64_t wakeup;
+	/**
+	 * Wakeups with less than avail_min frames ready
+	 */
+	uint64_t spurious;
+	/**
+	 * Slave switches
+	 */
+	uint64_t switches;
+	/**
+	 * Failed slave switches
+	 */
+	uint64_t switch_fail;
+	/**
+	 * Number of calls per callback
+	 */
+	uint64_t cb[AMUX_STATS_CB_NR];
+	/**
+	 * Performance counters are measured
+	 */
+	uint32_t perf_enabled;
+	/**
+	 * Number of measured calls per callback and for copy kernel
+	 */
+	uint64_t perf_calls[AMUX_STATS_PERF_ROWS];
+	/**
+	 * Frames processed in measured calls
+	 */
+	uint64_t perf_frames[AMUX_STATS_PERF_ROWS];
+	/**
+	 * Performance counters accumulated per callback and for copy kernel
+	 */
+	uint64_t perf[AMUX_STATS_PERF_ROWS][AMUX_STATS_PERF_NR];
+	/**
+	 * Number of switch records written, last one is at
+	 * sw[(swnr - 1) % AMUX_STATS_SWITCH_NR]
+	 */
+	uint32_t swnr;
+	/**
+	 * Last slave switch profiles
+	 */
+	struct amux_stats_switch sw[AMUX_STATS_SWITCH_NR];
+};
+
+/**
+ * Add to a statistics counter
+ */
+#define AMUX_STATS_ADD(s, field, n)					\
+	__atomic_add_fetch(&(s)->field, (n), __ATOMIC_RELAXED)
+
+/**
+ * Set a statistics value
+ */
+#define AMUX_STATS_SET(s, field, v)					\
+	__atomic_store_n(&(s)->field, (v), __ATOMIC_RELAXED)
+
+/**
+ * Get a statistics value
+ */
+#define AMUX_STATS_GET(s, field)					\
+	__atomic_load_n(&(s)->field, __ATOMIC_RELAXED)
+
+/**
+ * Create and map a stream statistics file. A stale file left by a previous
+ * process with the same pid is removed first, then the file is created
+ * exclusively without following links, so that a file or link planted in the
+ * shared directory is never written through. If the path still exists (e.g.
+ * a link owned by another user that cannot be removed), creation fails and
+ * statistics are kept private.
+ *
+ * @param path: Resulting statistics file path
+ * @param len: Size of path buffer
+ * @param id: Stream identifier, unique in process
+ * @return: Mapped statistics on success, NULL otherwise
+ */
+static inline struct amux_stats *amux_stats_create(char *path, size_t len,
+		unsigned int id)
+{
+	struct amux_stats *s;
+	int fd;
+
+	snprintf(path, len, "%s/%s%d.%u", AMUX_STATS_DIR, AMUX_STATS_PREFIX,
+			(int)getpid(), id);
+
+	unlink(path);
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if(fd < 0)
+		return NULL;
+
+	if(ftruncate(fd, sizeof(*s)) != 0) {
+		close(fd);
+		unlink(path);
+		return NULL;
+	}
+
+	s = mmap(NULL, sizeof(*s), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(s == MAP_FAILED) {
+		unlink(path);
+		return NULL;
+	}
+
+	s->version = AMUX_STATS_VERSION;
+	s->pid = getpid();
+	__atomic_store_n(&s->magic, AMUX_STATS_MAGIC, __ATOMIC_RELEASE);
+
+	return s;
+}
+
+/**
+ * Map a stream statistics file read only
+ *
+ * @param path: Statistics file path
+ * @return: Mapped statistics on success, NULL otherwise
+ */
+static inline struct amux_stats const *amux_stats_open(char const *path)
+{
+	struct amux_stats *s;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+		return NULL;
+
+	if((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(*s))) {
+		close(fd);
+		return NULL;
+	}
+
+	s = mmap(NULL, sizeof(*s), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(s == MAP_FAILED)
+		return NULL;
+
+	if((__atomic_load_n(&s->magic, __ATOMIC_ACQUIRE) != AMUX_STATS_MAGIC)
+			|| (s->version != AMUX_STATS_VERSION)) {
+		munmap(s, sizeof(*s));
+		return NULL;
+	}
+
+	return s;
+}
+
+/**
+ * Unmap stream statistics
+ *
+ * @param s: Mapped statistics
+ */
+static inline void amux_stats_unmap(struct amux_stats const *s)
+{
+	munmap((void *)s, sizeof(*s));
+}
+
+/**
+ * Update stream statistics slave name
+ *
+ * @param s: Stream statistics
+ * @param sname: New slave name
+ */
+static inline void amux_stats_set_slave(struct amux_stats *s,
+		char const *sname)
+{
+	__atomic_add_fetch(&s->sseq, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	strncpy(s->sname, sname, sizeof(s->sname) - 1);
+	__atomic_add_fetch(&s->sseq, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Read stream statistics slave name
+ *
+ * @param s: Stream statistics
+ * @param sname: Resulting slave name
+ * @param len: Size of sname buffer
+ */
+static inline void amux_stats_get_slave(struct amux_stats const *s,
+		char *sname, size_t len)
+{
+	uint32_t seq;
+
+	do {
+		seq = __atomic_load_n(&s->sseq, __ATOMIC_ACQUIRE);
+		strncpy(sname, s->sname, len - 1);
+		sname[len - 1] = '\0';
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while((seq & 1) ||
+			(seq != __atomic_load_n(&s->sseq, __ATOMIC_RELAXED)));
+}
+
+/**
+ * Record a slave switch profile
+ *
+ * @param s: Stream statistics
+ * @param rec: Switch profile to record
+ */
+static inline void amux_stats_switch_push(struct amux_stats *s,
+		struct amux_stats_switch const *rec)
+{
+	uint32_t nr = __atomic_load_n(&s->swnr, __ATOMIC_RELAXED);
+	struct amux_stats_switch *r = &s->sw[nr % AMUX_STATS_SWITCH_NR];
+	uint32_t seq = r->seq;
+
+	__atomic_store_n(&r->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	r->result = rec->result;
+	r->ts = rec->ts;
+	memcpy(r->us, rec->us, sizeof(r->us));
+	strncpy(r->sname, rec->sname, sizeof(r->sname) - 1);
+	__atomic_store_n(&r->seq, seq + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&s->swnr, nr + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Read a slave switch profile
+ *
+ * @param s: Stream statistics
+ * @param idx: Record index, 0 for the most recent one
+ * @param rec: Resulting switch profile
+ * @return: 0 on success, -1 if there is no such record
+ */
+static inline int amux_stats_switch_get(struct amux_stats const *s,
+		uint32_t idx, struct amux_stats_switch *rec)
+{
+	uint32_t nr = __atomic_load_n(&s->swnr, __ATOMIC_ACQUIRE);
+	struct amux_stats_switch const *r;
+	uint32_t seq;
+
+	if((idx >= nr) || (idx >= AMUX_STATS_SWITCH_NR))
+		return -1;
+
+	r = &s->sw[(nr - 1 - idx) % AMUX_STATS_SWITCH_NR];
+	do {
+		seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+		memcpy(rec, r, sizeof(*rec));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while((seq & 1) ||
+			(seq != __atomic_load_n(&r->seq, __ATOMIC_RELAXED)));
+	rec->sname[sizeof(rec->sname) - 1] = '\0';
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+/* Slave id used when slave name cannot be traced */
+#define AMUX_TRACE_NOSLAVE 0xffff
+
+/**
+ * Callback or poller operation being traced
+ */
+struct amux_trace_scope {
+	/**
+	 * Event name, must be a string literal
+	 */
+	char const *name;
+	/**
+	 * Frames reported at exit
+	 */
+	long frames;
+	/**
+	 * Slave id at enter
+	 */
+	unsigned short slave;
+};
+
+extern unsigned char amux_tracing;
+
+/**
+ * Check if tracer is recording
+ */
+#define AMUX_TRACING() __atomic_load_n(&amux_tracing, __ATOMIC_RELAXED)
+
+void amux_trace_event(char ph, char const *name, unsigned short slave,
+		long frames);
+void amux_trace_thread_name(char const *name);
+unsigned short amux_trace_slave(char const *sname);
+int amux_trace_start(char const *path, unsigned long events);
+void amux_trace_stop(void);
+
+static inline struct amux_trace_scope amux_trace_enter(char const *name,
+		unsigned short slave)
+{
+	struct amux_trace_scope s = {
+		.name = name,
+		.frames = 0,
+		.slave = slave,
+	};
+
+	if(AMUX_TRACING())
+		amux_trace_event('B', name, slave, 0);
+	return s;
+}
+
+static inline void amux_trace_exit(struct amux_trace_scope *s)
+{
+	if(AMUX_TRACING())
+		amux_trace_event('E', s->name, s->slave, s->frames);
+}
+
+/**
+ * Get current slave trace id of an amux master, which may be switched while
+ * the thread poller traces
+ */
+#define AMUX_TRACE_SLAVE(amx)						\
+	__atomic_load_n(&(amx)->trace_slave, __ATOMIC_RELAXED)
+
+/**
+ * Set current slave trace id of an amux master
+ */
+#define AMUX_TRACE_SLAVE_SET(amx, id)					\
+	__atomic_store_n(&(amx)->trace_slave, (id), __ATOMIC_RELAXED)
+
+/**
+ * Trace enter and exit of the rest of the enclosing scope
+ */
+#define AMUX_TRACE_SCOPE(amx, name)					\
+	struct amux_trace_scope __amux_trace				\
+		__attribute__((cleanup(amux_trace_exit), unused)) =	\
+		amux_trace_enter(name, AMUX_TRACE_SLAVE(amx))
+
+/**
+ * Set frames reported at traced scope exit
+ */
+#define AMUX_TRACE_FRAMES(n) (__amux_trace.frames = (n))
+
+/**
+ * Trace an instant event
+ */
+#define AMUX_TRACE_INSTANT(amx, name, n) do {				\
+	if(AMUX_TRACING())						\
+		amux_trace_event('i', name, AMUX_TRACE_SLAVE(amx), (n));	\
+} while(0)
+
+/**
+ * Trace a counter value
+ */
+#define AMUX_TRACE_COUNTER(amx, name, n) do {				\
+	if(AMUX_TRACING())						\
+		amux_trace_event('C', name, AMUX_TRACE_SLAVE(amx), (n));	\
+} while(0)
+
+#endif
@@ -1,18 +1,35 @@
 #include <stdlib.h>
+#include <limits.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <stddef.h>
 #include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
 
 #include <alsa/asoundlib.h>
 #include <alsa/pcm_external.h>
 
 #include "amux.h"
+#include "gain.h"
+#include "perf.h"
+#include "probe.h"
 #include "poller/poller.h"
+#include "poller/timer.h"
+#include "poller/thread.h"
 
 #define AMUX_POLLFD_MAX 4
 #define AMUX_SLAVE_DFT "sysdefault"
+/* Number of wakeups to measure spurious wakeup rate on */
+#define AMUX_WAKEUP_WINDOW 256
+/* Seconds without xrun before adaptive headroom is decreased */
+#define AMUX_ADAPT_PERIOD 60
+/* Arena room for poller instance */
+#define AMUX_ARENA_POLLER 1024
 
 /**
  * Check if libasound is old and flawed. Libraries before 1.1.4 need to setup hw
@@ -52,214 +69,1429 @@ static inline struct snd_pcm_amux *amux_create(void)
 		goto out;
 
 	amx->fd = -1;
+	amx->idle_fd = -1;
+	amx->wfd = -1;
+	amx->trace_slave = AMUX_TRACE_NOSLAVE;
+	amx->stats = &amx->stats_priv;
+	dsp_init(&amx->dsp);
 	if(amux_libasound_need_kludge())
 		amx->asound_kludge = 1;
 out:
 	return amx;
 }
 
+/**
+ * Load adaptive buffering headrooms learned by previous instances.
+ *
+ * @param amx: Amux master.
+ * @return: 0 on success, negative number otherwise.
+ */
+static int amux_adapt_load(struct snd_pcm_amux *amx)
+{
+	struct amux_slave_stats *st;
+	char name[CARD_NAMESZ];
+	unsigned long headroom;
+	FILE *f;
+
+	f = fopen(amx->adapt_file, "r");
+	if(f == NULL)
+		return (errno == ENOENT) ? 0 : -errno;
+
+	flock(fileno(f), LOCK_SH);
+	while(amx->sstatsnr < ARRAY_SIZE(amx->sstats)) {
+		if(fscanf(f, "%lu %127[^\n]\n", &headroom, name) != 2)
+			break;
+		st = &amx->sstats[amx->sstatsnr++];
+		strncpy(st->sname, name, sizeof(st->sname) - 1);
+		st->headroom = headroom;
+	}
+	flock(fileno(f), LOCK_UN);
+	fclose(f);
+
+	return 0;
+}
+
+/**
+ * Persist adaptive buffering headrooms, merging them with the ones saved by
+ * other instances.
+ *
+ * @param amx: Amux master.
+ * @return: 0 on success, negative number otherwise.
+ */
+static int amux_adapt_save(struct snd_pcm_amux *amx)
+{
+	struct {
+		char sname[CARD_NAMESZ];
+		unsigned long headroom;
+	} saved[SLAVENR];
+	char name[CARD_NAMESZ];
+	unsigned long headroom;
+	size_t i, j, nr = 0;
+	FILE *f;
+	int fd;
+
+	fd = open(amx->adapt_file, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR |
+			S_IRGRP | S_IROTH);
+	if(fd < 0)
+		return -errno;
+
+	f = fdopen(fd, "r+");
+	if(f == NULL) {
+		close(fd);
+		return -errno;
+	}
+
+	flock(fd, LOCK_EX);
+	while(nr < ARRAY_SIZE(saved)) {
+		if(fscanf(f, "%lu %127[^\n]\n", &headroom, name) != 2)
+			break;
+		for(i = 0; i < amx->sstatsnr; ++i)
+			if(strcmp(amx->sstats[i].sname, name) == 0)
+				break;
+		if(i != amx->sstatsnr)
+			continue;
+		strcpy(saved[nr].sname, name);
+		saved[nr++].headroom = headroom;
+	}
+
+	rewind(f);
+	for(i = 0; i < amx->sstatsnr; ++i)
+		fprintf(f, "%lu %s\n", (unsigned long)amx->sstats[i].headroom,
+				amx->sstats[i].sname);
+	for(j = 0; (j < nr) && (i + j < SLAVENR); ++j)
+		fprintf(f, "%lu %s\n", saved[j].headroom, saved[j].sname);
+	fflush(f);
+	if(ftruncate(fd, ftell(f)) < 0)
+		AMUX_ERR("%s: Cannot truncate %s\n", __func__,
+				amx->adapt_file);
+	flock(fd, LOCK_UN);
+	fclose(f);
+
+	return 0;
+}
+
+/**
+ * Hold performance counters of the calling thread, expected to be the one
+ * running the audio callbacks. Opening them is kept out of those callbacks.
+ *
+ * @param amx: Amux master.
+ */
+static void amux_perf_hold(struct snd_pcm_amux *amx)
+{
+	if(!amx->perf || amx->perf_held)
+		return;
+
+	amux_perf_get();
+	amx->perf_thread = pthread_self();
+	amx->perf_held = 1;
+}
+
+/**
+ * Release performance counters held by PCM. Counters can only be closed by the
+ * thread they measure, if another thread closes the PCM they are closed when
+ * the holding thread exits.
+ *
+ * @param amx: Amux master.
+ */
+static void amux_perf_release(struct snd_pcm_amux *amx)
+{
+	if(!amx->perf_held)
+		return;
+
+	if(pthread_equal(amx->perf_thread, pthread_self()))
+		amux_perf_put();
+	amx->perf_held = 0;
+}
+
 /**
  * Cleanup an Amux PCM
  *
- * @param amx: PCM to destroy
+ * @param amx: PCM to destroy
+ */
+static inline void amux_destroy(struct snd_pcm_amux *amx)
+{
+	if(amx == NULL)
+		return;
+
+	amux_perf_release(amx);
+
+	if(amx->wfd >= 0) {
+		pthread_cancel(amx->wth);
+		pthread_join(amx->wth, NULL);
+		close(amx->wfd);
+	}
+
+	if(amx->poller)
+		poller_destroy(amx->poller);
+
+	rt_munlock(&amx->rt, amx->arena.base, amx->arena.size);
+	amux_arena_destroy(&amx->arena);
+
+	if(amx->slave)
+		snd_pcm_close(amx->slave);
+
+	if(amx->fd >= 0)
+		close(amx->fd);
+
+	if(amx->idle_fd >= 0)
+		close(amx->idle_fd);
+
+	if(amx->gctl)
+		amux_gain_ctl_unmap(amx->gctl);
+
+	if(amx->adapt_file) {
+		amux_adapt_save(amx);
+		free(amx->adapt_file);
+	}
+
+	if(amx->stats != &amx->stats_priv) {
+		amux_stats_unmap(amx->stats);
+		unlink(amx->stats_path);
+	}
+
+	if(amx->tracing)
+		amux_trace_stop();
+
+	if(amx->logging)
+		amux_log_stop();
+
+	rt_munlock(&amx->rt, amx, sizeof(*amx));
+	free(amx);
+}
+
+/**
+ * Initialize Amux PCM poller
+ *
+ * @param amx: Amux PCM to intialize poller with
+ * @param name: Poller name
+ * @return: 0 on success, negative number otherwise
+ */
+static inline int amux_poller_init(struct snd_pcm_amux *amx, char const *name)
+{
+	struct timer_args ta = {
+		.slack = amx->slack,
+	};
+	struct pollthr_args pa = {
+		.amx = amx,
+		.rt = &amx->rt,
+	};
+
+	/* Coalesced wakeups need the timer poller */
+	if(amx->powersave)
+		amx->poller = poller_create(amx, "timer", &ta);
+	else if(strcmp(name, "thread") == 0)
+		amx->poller = poller_create(amx, name, &pa);
+	else
+		amx->poller = poller_create(amx, name, NULL);
+	if(amx->poller == NULL)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/**
+ * Apply gain control and current slave preset to transfer path if they
+ * changed. Gain control is read without any lock so this is cheap enough to be
+ * called at each transfer.
+ *
+ * @param amx: Amux PCM
+ * @param force: Recompute gain even if gain control did not change
+ */
+static inline void amux_gain_update(struct snd_pcm_amux *amx, int force)
+{
+	int32_t mb = 0;
+	uint32_t mute = 0;
+	float db;
+
+	if(amx->gctl) {
+		mb = amux_gain_ctl_get_mb(amx->gctl);
+		mute = amux_gain_ctl_get_mute(amx->gctl);
+	}
+
+	if(!force && (mb == amx->gain_mb) && (mute == amx->gain_mute))
+		return;
+
+	amx->gain_mb = mb;
+	amx->gain_mute = mute;
+	db = (float)mb / 100.0f + amx->gain_preset;
+	dsp_set_gain(&amx->dsp, mute ? 0.0f : powf(10.0f, db / 20.0f));
+}
+
+/**
+ * Select current slave gain preset
+ *
+ * @param amx: Amux PCM
+ */
+static inline void amux_gain_preset(struct snd_pcm_amux *amx)
+{
+	size_t i;
+
+	amx->gain_preset = 0.0f;
+	for(i = 0; i < amx->presetnr; ++i) {
+		if(strcmp(amx->preset[i].sname, amx->sname) == 0) {
+			amx->gain_preset = amx->preset[i].db;
+			break;
+		}
+	}
+
+	amux_gain_update(amx, 1);
+}
+
+/**
+ * Parse gain configuration block
+ *
+ * @param amx: Amux PCM
+ * @param conf: Gain configuration node
+ * @return: 0 on success, negative number otherwise
+ */
+static int amux_gain_parse(struct snd_pcm_amux *amx, snd_config_t *conf)
+{
+	snd_config_iterator_t i, next, j, jnext;
+	char const *id, *path;
+	double db;
+	int ret;
+
+	snd_config_for_each(i, next, conf) {
+		snd_config_t *cfg = snd_config_iterator_entry(i);
+		if(snd_config_get_id(cfg, &id) < 0)
+			continue;
+		if(strcmp(id, "file") == 0) {
+			ret = snd_config_get_string(cfg, &path);
+			if(ret < 0) {
+				SNDERR("Invalid string for gain.%s", id);
+				return ret;
+			}
+			amx->gctl = amux_gain_ctl_map(path);
+			if(amx->gctl == NULL) {
+				SNDERR("Cannot map gain file %s", path);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if(strcmp(id, "preset") == 0) {
+			snd_config_for_each(j, jnext, cfg) {
+				snd_config_t *p = snd_config_iterator_entry(j);
+				struct amux_preset *pr;
+				if(snd_config_get_id(p, &id) < 0)
+					continue;
+				if(amx->presetnr == ARRAY_SIZE(amx->preset)) {
+					SNDERR("Too many gain presets");
+					return -EINVAL;
+				}
+				ret = snd_config_get_ireal(p, &db);
+				if(ret < 0) {
+					SNDERR("Invalid gain preset for %s",
+							id);
+					return ret;
+				}
+				pr = &amx->preset[amx->presetnr++];
+				strncpy(pr->sname, id, sizeof(pr->sname) - 1);
+				pr->db = (float)db;
+			}
+			continue;
+		}
+		SNDERR("Unknown field gain.%s", id);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/**
+ * Parse adaptive buffering configuration.
+ *
+ * @param amx: Amux master.
+ * @param conf: adaptive configuration node.
+ * @return: 0 on success, negative number otherwise.
+ */
+static int amux_adapt_parse(struct snd_pcm_amux *amx, snd_config_t *conf)
+{
+	snd_config_iterator_t i, next;
+	char const *id, *path;
+	long val;
+	int ret;
+
+	snd_config_for_each(i, next, conf) {
+		snd_config_t *cfg = snd_config_iterator_entry(i);
+		if(snd_config_get_id(cfg, &id) < 0)
+			continue;
+		if(strcmp(id, "file") == 0) {
+			ret = snd_config_get_string(cfg, &path);
+			if(ret < 0) {
+				SNDERR("Invalid string for adaptive.%s", id);
+				return ret;
+			}
+			free(amx->adapt_file);
+			amx->adapt_file = strdup(path);
+			if(amx->adapt_file == NULL)
+				return -ENOMEM;
+			continue;
+		}
+		if(strcmp(id, "max") == 0) {
+			ret = snd_config_get_integer(cfg, &val);
+			if((ret < 0) || (val < 0)) {
+				SNDERR("Invalid value for adaptive.%s", id);
+				return -EINVAL;
+			}
+			amx->adapt_max = val;
+			continue;
+		}
+		SNDERR("Unknown field adaptive.%s", id);
+		return -EINVAL;
+	}
+
+	if(amx->adapt_file == NULL) {
+		SNDERR("Missing adaptive.file");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/**
+ * Parse powersave profile configuration.
+ *
+ * @param amx: Amux master.
+ * @param conf: powersave configuration node.
+ * @return: 0 on success, negative number otherwise.
+ */
+static int amux_powersave_parse(struct snd_pcm_amux *amx, snd_config_t *conf)
+{
+	snd_config_iterator_t i, next;
+	char const *id;
+	long val;
+	int ret;
+
+	amx->powersave = 1;
+	snd_config_for_each(i, next, conf) {
+		snd_config_t *cfg = snd_config_iterator_entry(i);
+		if(snd_config_get_id(cfg, &id) < 0)
+			continue;
+		if(strcmp(id, "slack") == 0) {
+			ret = snd_config_get_integer(cfg, &val);
+			if((ret < 0) || (val < 0)) {
+				SNDERR("Invalid value for powersave.%s", id);
+				return -EINVAL;
+			}
+			amx->slack = val;
+			continue;
+		}
+		SNDERR("Unknown field powersave.%s", id);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/**
+ * Get per-instance arena size: poller instance with its slave poll descriptor
+ * lists, scratch room for the deepest params nesting (slave configuration
+ * refining hardware params) and permanent software params for avail_min.
+ *
+ * @return: Arena size in bytes.
+ */
+static size_t amux_arena_size(void)
+{
+	size_t hw = amux_arena_round(snd_pcm_hw_params_sizeof());
+	size_t sw = amux_arena_round(snd_pcm_sw_params_sizeof());
+
+	return AMUX_ARENA_POLLER +
+		2 * amux_arena_round(sizeof(struct pollfd) * POLLER_POLLFD_MAX) +
+		3 * hw + 3 * sw;
+}
+
+/**
+ * Parse logging configuration and start asynchronous logger.
+ *
+ * @param amx: Amux master.
+ * @param conf: Logging configuration node, NULL for default one.
+ * @return: 0 on success, negative number otherwise.
+ */
+static int amux_log_parse(struct snd_pcm_amux *amx, snd_config_t *conf)
+{
+	snd_config_iterator_t i, next;
+	char const *id, *str, *sink = "stderr";
+	int level = AMUX_LOG_WARN;
+	int ret;
+
+	if(conf == NULL)
+		goto start;
+
+	snd_config_for_each(i, next, conf) {
+		snd_config_t *cfg = snd_config_iterator_entry(i);
+		if(snd_config_get_id(cfg, &id) < 0)
+			continue;
+		if(strcmp(id, "level") == 0) {
+			ret = snd_config_get_string(cfg, &str);
+			if(ret >= 0)
+				level = amux_log_level(str);
+			if((ret < 0) || (level < AMUX_LOG_NONE)) {
+				SNDERR("Invalid value for log.%s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if(strcmp(id, "sink") == 0) {
+			ret = snd_config_get_string(cfg, &sink);
+			if(ret < 0) {
+				SNDERR("Invalid string for log.%s", id);
+				return ret;
+			}
+			continue;
+		}
+		SNDERR("Unknown field log.%s", id);
+		return -EINVAL;
+	}
+
+start:
+	ret = amux_log_start(level, sink);
+	if(ret < 0) {
+		SNDERR("Cannot start logging to %s", sink);
+		return ret;
+	}
+	amx->logging = 1;
+
+	return 0;
+}
+
+/**
+ * Parse tracing configuration and start tracer.
+ *
+ * @param amx: Amux master.
+ * @param conf: Tracing configuration node.
+ * @return: 0 on success, negative number otherwise.
+ */
+static int amux_trace_parse(struct snd_pcm_amux *amx, snd_config_t *conf)
+{
+	snd_config_iterator_t i, next;
+	char const *id, *path = NULL;
+	long events = 0;
+	int ret;
+
+	snd_config_for_each(i, next, conf) {
+		snd_config_t *cfg = snd_config_iterator_entry(i);
+		if(snd_config_get_id(cfg, &id) < 0)
+			continue;
+		if(strcmp(id, "file") == 0) {
+			ret = snd_config_get_string(cfg, &path);
+			if(ret < 0) {
+				SNDERR("Invalid string for trace.%s", id);
+				return ret;
+			}
+			continue;
+		}
+		if(strcmp(id, "events") == 0) {
+			ret = snd_config_get_integer(cfg, &events);
+			if((ret < 0) || (events <= 0)) {
+				SNDERR("Invalid value for trace.%s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+		SNDERR("Unknown field trace.%s", id);
+		return -EINVAL;
+	}
+
+	if(path == NULL) {
+		SNDERR("Missing trace.file");
+		return -EINVAL;
+	}
+
+	ret = amux_trace_start(path, events);
+	if(ret < 0) {
+		SNDERR("Cannot start tracing to %s", path);
+		return ret;
+	}
+	amx->tracing = 1;
+
+	return 0;
+}
+
+/**
+ * Publish live statistics in a shared memory file for amuxctl. Statistics are
+ * still kept privately if this fails.
+ *
+ * @param amx: Amux master.
+ * @param name: Amux PCM name.
+ * @param stream: Stream direction.
+ */
+static void amux_stats_publish(struct snd_pcm_amux *amx, char const *name,
+		snd_pcm_stream_t stream)
+{
+	static unsigned int id;
+	struct amux_stats *s;
+
+	s = amux_stats_create(amx->stats_path, sizeof(amx->stats_path),
+			__atomic_fetch_add(&id, 1, __ATOMIC_RELAXED));
+	if(s == NULL) {
+		AMUX_WARN("Cannot publish statistics in %s\n", AMUX_STATS_DIR);
+		amx->stats_path[0] = '\0';
+		s = amx->stats;
+	}
+
+	strncpy(s->pcm, name, sizeof(s->pcm) - 1);
+	s->stream = stream;
+	amx->stats = s;
+}
+
+/**
+ * Parse realtime configuration.
+ *
+ * @param amx: Amux master.
+ * @param conf: Realtime configuration node.
+ * @return: 0 on success, negative number otherwise.
+ */
+static int amux_rt_parse(struct snd_pcm_amux *amx, snd_config_t *conf)
+{
+	snd_config_iterator_t i, next;
+	char const *id, *str;
+	long val;
+	int ret;
+
+	amx->rt.enabled = 1;
+	amx->rt.mlock = 1;
+	amx->rt.policy = SCHED_FIFO;
+	amx->rt.priority = sched_get_priority_min(SCHED_FIFO);
+	snd_config_for_each(i, next, conf) {
+		snd_config_t *cfg = snd_config_iterator_entry(i);
+		if(snd_config_get_id(cfg, &id) < 0)
+			continue;
+		if(strcmp(id, "policy") == 0) {
+			ret = snd_config_get_string(cfg, &str);
+			if((ret < 0) || ((strcmp(str, "fifo") != 0) &&
+						(strcmp(str, "rr") != 0))) {
+				SNDERR("Invalid value for realtime.%s", id);
+				return -EINVAL;
+			}
+			amx->rt.policy = (str[0] == 'f') ? SCHED_FIFO :
+				SCHED_RR;
+			continue;
+		}
+		if(strcmp(id, "priority") == 0) {
+			ret = snd_config_get_integer(cfg, &val);
+			if(ret < 0) {
+				SNDERR("Invalid value for realtime.%s", id);
+				return -EINVAL;
+			}
+			amx->rt.priority = val;
+			continue;
+		}
+		if(strcmp(id, "cpus") == 0) {
+			ret = snd_config_get_string(cfg, &str);
+			if((ret < 0) || (rt_parse_cpus(str, &amx->rt.cpus) < 0)) {
+				SNDERR("Invalid value for realtime.%s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if(strcmp(id, "mlock") == 0) {
+			ret = snd_config_get_bool(cfg);
+			if(ret < 0) {
+				SNDERR("Invalid value for realtime.%s", id);
+				return ret;
+			}
+			amx->rt.mlock = ret;
+			continue;
+		}
+		SNDERR("Unknown field realtime.%s", id);
+		return -EINVAL;
+	}
+
+	if((amx->rt.priority < sched_get_priority_min(amx->rt.policy)) ||
+			(amx->rt.priority >
+			 sched_get_priority_max(amx->rt.policy))) {
+		SNDERR("Invalid value for realtime.priority");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/**
+ * Thread watching the slave configuration file. Slave switch check only reads
+ * the file when it has changed so that audio path does no file I/O otherwise.
+ */
+static void *amux_watch_thread(void *arg)
+{
+	struct snd_pcm_amux *amx = (struct snd_pcm_amux *)arg;
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+	ssize_t ret;
+
+	for(;;) {
+		ret = read(amx->wfd, buf, sizeof(buf));
+		if((ret < 0) && (errno != EINTR))
+			break;
+		if(ret > 0)
+			__atomic_add_fetch(&amx->swgen, 1, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/**
+ * Start watching slave configuration file.
+ *
+ * @param amx: Amux master.
+ * @param path: Slave configuration file path.
+ * @return: 0 on success, negative number otherwise.
+ */
+static int amux_watch_start(struct snd_pcm_amux *amx, char const *path)
+{
+	int ret;
+
+	amx->wfd = inotify_init1(IN_CLOEXEC);
+	if(amx->wfd < 0)
+		return -errno;
+
+	if(inotify_add_watch(amx->wfd, path, IN_CLOSE_WRITE) < 0)
+		goto err;
+
+	ret = rt_thread_create(&amx->rt, &amx->wth, amux_watch_thread, amx);
+	if(ret != 0) {
+		errno = -ret;
+		goto err;
+	}
+
+	return 0;
+err:
+	ret = -errno;
+	close(amx->wfd);
+	amx->wfd = -1;
+	return ret;
+}
+
+/**
+ * If slave PCM has not been configured set a default one
+ *
+ * @param amx: Amux PCM to set default slave to
+ * @param path: Path to Amux PCM configuration
+ * @return: 0 on success, negative number otherwise
+ */
+static inline int amux_set_default_pcm(struct snd_pcm_amux *amx,
+		char const *path)
+{
+	ssize_t ret;
+	size_t cur = 0, len = strlen(AMUX_SLAVE_DFT);
+	char const *dft = AMUX_SLAVE_DFT;
+	int fd;
+
+	ret = open(path, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+	if(ret < 0)
+		goto out;
+
+	fd = (int)ret;
+	flock(fd, LOCK_EX);
+	do {
+		ret = write(fd, dft + cur, len - cur);
+		if((ret < 0) && (errno == EINTR))
+			continue;
+		if(ret < 0)
+			goto unlock;
+		cur += (size_t)ret;
+	} while(cur < len);
+
+	strncpy(amx->sname, AMUX_SLAVE_DFT, sizeof(amx->sname) - 1);
+	amx->sname[sizeof(amx->sname) - 1] = '\0';
+unlock:
+	flock(fd, LOCK_UN);
+	close(fd);
+out:
+	return ret;
+}
+
+/**
+ * Read slave PCM configuration
+ *
+ * @param amx: Amux PCM to read configuration from
+ * @param pcm: Filled with name of configured PCM
+ * @param len: Max length of pcm output buffer
+ * @return: 0 on success, negative number otherwise
+ */
+static inline int amux_read_pcm(struct snd_pcm_amux *amx, char *pcm,
+		size_t len)
+{
+	ssize_t ret;
+	size_t cur = 0;
+
+	RT_ASSERT_COLD();
+
+	if(len == 0)
+		return -ENOMEM;
+
+	do {
+		ret = read(amx->fd, pcm + cur, len - 1 - cur);
+		if((ret < 0) && (errno == EINTR))
+			continue;
+		if(ret < 0)
+			goto out;
+		cur += (size_t)ret;
+	} while(ret != 0);
+
+	pcm[cur] = '\0';
+
+out:
+	return ret;
+}
+
+/**
+ * Check if the configured slave matches the currently used one.
+ *
+ * @param amx: Amux master PCM
+ * @return: -1 if configured PCM is different from current one or an error
+ * occured, 0 otherwise.
+ */
+static inline int amux_check_card(struct snd_pcm_amux *amx)
+{
+	int ret = -1;
+	char card[CARD_NAMESZ] = "default";
+
+	if(amx->slave == NULL)
+		goto out;
+
+	/* Someone is updating config, assume card has not changed yet */
+	ret = flock(amx->fd, LOCK_SH | LOCK_NB);
+	if(ret != 0)
+		return 0;
+
+	lseek(amx->fd, SEEK_SET, 0);
+
+	ret = amux_read_pcm(amx, card, sizeof(card));
+	flock(amx->fd, LOCK_UN);
+	if(ret < 0)
+		goto out;
+
+	ret = -1;
+	if(strcmp(card, amx->sname) != 0)
+		goto out;
+
+	ret = 0;
+out:
+	return ret;
+}
+
+/**
+ * Get the number of frames queued in master buffer (i.e. written by the
+ * application but not yet consumed for playback, captured but not yet read
+ * for capture).
+ *
+ * @param amx: Amux master.
+ * @return: Number of queued frames.
+ */
+static inline snd_pcm_uframes_t amux_queued(struct snd_pcm_amux *amx)
+{
+	snd_pcm_sframes_t ret;
+
+	if(amx->stream == SND_PCM_STREAM_PLAYBACK)
+		ret = amx->io.appl_ptr - amx->io.hw_ptr;
+	else
+		ret = amx->io.hw_ptr - amx->io.appl_ptr;
+	if(ret < 0)
+		ret += amx->boundary;
+
+	return (snd_pcm_uframes_t)ret;
+}
+
+/**
+ * Write silence into slave playback buffer.
+ *
+ * @param amx: Amux master.
+ * @param frames: Number of silence frames to write.
+ * @return: Number of frames written, negative number on error.
+ */
+static snd_pcm_sframes_t amux_silence(struct snd_pcm_amux *amx,
+		snd_pcm_uframes_t frames)
+{
+	snd_pcm_channel_area_t const *sareas;
+	snd_pcm_uframes_t soffset, ssize, xfer = 0;
+	snd_pcm_sframes_t ret = 0;
+
+	while(xfer < frames) {
+		ssize = frames - xfer;
+		ret = snd_pcm_mmap_begin(amx->slave, &sareas, &soffset, &ssize);
+		if((ret < 0) || (ssize == 0))
+			break;
+		snd_pcm_areas_silence(sareas, soffset, amx->dsp.ochannels,
+				ssize, amx->dsp.ofmt);
+		ret = snd_pcm_mmap_commit(amx->slave, soffset, ssize);
+		if(ret <= 0)
+			break;
+		xfer += ret;
+	}
+
+	if(ret < 0)
+		return ret;
+
+	return xfer;
+}
+
+/**
+ * Get idle slave virtual clock hardware pointer. Virtual clock consumes frames
+ * at the stream rate from the position slave was put idle at. If application
+ * did not write fast enough, clock restarts from application pointer.
+ *
+ * @param amx: Amux master.
+ * @return: Virtual hardware pointer.
+ */
+static snd_pcm_uframes_t amux_idle_hw(struct snd_pcm_amux *amx)
+{
+	struct timespec now;
+	snd_pcm_sframes_t queued;
+	snd_pcm_uframes_t hw;
+	long long elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - amx->idle_ts.tv_sec) * 1000000000LL +
+		(now.tv_nsec - amx->idle_ts.tv_nsec);
+	elapsed = elapsed * amx->io.rate / 1000000000LL;
+
+	queued = amx->sappl - amx->idle_hw;
+	if(queued < 0)
+		queued += amx->boundary;
+
+	if(elapsed > queued) {
+		amx->idle_hw = amx->sappl;
+		amx->idle_ts = now;
+		return amx->idle_hw;
+	}
+
+	hw = amx->idle_hw + elapsed;
+	if(hw >= amx->boundary)
+		hw -= amx->boundary;
+
+	return hw;
+}
+
+/**
+ * Get slave available frames, from the virtual clock if slave is idle.
+ *
+ * @param amx: Amux master.
+ * @return: Available frames, negative number on error.
+ */
+snd_pcm_sframes_t amux_avail(struct snd_pcm_amux *amx)
+{
+	snd_pcm_sframes_t queued;
+
+	if(!amx->idle)
+		return snd_pcm_avail_update(amx->slave);
+
+	queued = amx->sappl - amux_idle_hw(amx);
+	if(queued < 0)
+		queued += amx->boundary;
+
+	return amx->io.buffer_size - queued;
+}
+
+/**
+ * Arm idle slave virtual clock timer to expire when avail_min frames will be
+ * available.
+ *
+ * @param amx: Amux master.
+ */
+void amux_idle_arm(struct snd_pcm_amux *amx)
+{
+	struct itimerspec its = {};
+	snd_pcm_sframes_t avail;
+	long long ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &its.it_value);
+	avail = amux_avail(amx);
+	if((avail < (snd_pcm_sframes_t)amx->avail_min) && (amx->io.rate != 0)) {
+		ns = its.it_value.tv_nsec + (amx->avail_min - avail) *
+			1000000000LL / amx->io.rate;
+		its.it_value.tv_sec += ns / 1000000000LL;
+		its.it_value.tv_nsec = ns % 1000000000LL;
+	}
+
+	timerfd_settime(amx->idle_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/**
+ * Put slave idle after a long enough silence: pause (or stop) it so that
+ * device, DMA or wireless link can go to sleep, and feed client from a virtual
+ * clock instead. Slave stays configured so that it can be woken up quickly.
+ *
+ * @param amx: Amux master.
+ * @return: 0 on success, negative number otherwise.
+ */
+static int amux_idle_enter(struct snd_pcm_amux *amx)
+{
+	int ret;
+
+	AMUX_DBG("%s: enter PCM(%p)\n", __func__, &amx->io);
+
+	RT_HOT_LEAVE();
+
+	ret = poller_idle(amx->poller, amx->idle_fd);
+	if(ret != 0)
+		return ret;
+
+	if(!amx->can_pause || (snd_pcm_pause(amx->slave, 1) != 0))
+		snd_pcm_drop(amx->slave);
+
+	clock_gettime(CLOCK_MONOTONIC, &amx->idle_ts);
+	amx->idle_hw = amx->io.hw_ptr;
+	amx->prefilling = 0;
+	amx->idle = 1;
+
+	amux_idle_arm(amx);
+
+	return 0;
+}
+
+/**
+ * Wake idle slave up. Slave is prepared again and filled with silence up to
+ * the frames virtual clock has not consumed yet, so that hardware pointer stays
+ * continuous and next written frames are not lost.
+ *
+ * @param amx: Amux master.
+ * @param restart: Prepare and refill slave, otherwise slave is left as is for
+ * caller to stop or prepare it.
+ */
+static void amux_idle_leave(struct snd_pcm_amux *amx, int restart)
+{
+	snd_pcm_sframes_t queued;
+
+	AMUX_DBG("%s: enter PCM(%p)\n", __func__, &amx->io);
+
+	RT_HOT_LEAVE();
+
+	queued = amx->sappl - amux_idle_hw(amx);
+	if(queued < 0)
+		queued += amx->boundary;
+
+	amx->idle = 0;
+	amx->idle_frames = 0;
+	poller_idle(amx->poller, -1);
+
+	if(!restart)
+		return;
+
+	snd_pcm_drop(amx->slave);
+	snd_pcm_prepare(amx->slave);
+	if((snd_pcm_uframes_t)queued > amx->io.buffer_size)
+		queued = amx->io.buffer_size;
+	if((queued != 0) && (amux_silence(amx, queued) < 0))
+		AMUX_ERR("%s: Cannot fill slave with silence\n", __func__);
+}
+
+/**
+ * Close callback of an IO plugin PCM device.
+ *
+ * @param io: The IO plugin to close.
+ * @return: 0 on success, negative number otherwise.
+ */
+static int amux_close(struct snd_pcm_ioplug *io)
+{
+	struct snd_pcm_amux *amx = to_pcm_amux(io);
+
+	AMUX_DBG("%s: enter PCM(%p)\n", __func__, io);
+	AMUX_TRACE_INSTANT(amx, "close", 0);
+	amux_destroy(amx);
+
+	return 0;
+}
+
+/**
+ * Callback for starting IO plugin PCM playback or capture.
+ *
+ * @param io: The IO plugin interface to start.
+ * @return: 0 on success, negative number otherwise.
+ */
+static int amux_start(struct snd_pcm_ioplug *io)
+{
+	struct snd_pcm_amux *amx = to_pcm_amux(io);
+
+	AMUX_DBG("%s: enter PCM(%p)\n", __func__, io);
+	AMUX_STATS_ADD(amx->stats, cb[AMUX_STATS_CB_START], 1);
+	AMUX_TRACE_SCOPE(amx, "start");
+	AMUX_PERF_SCOPE(amx, AMUX_STATS_CB_START);
+
+
+	if(amux_check_card(amx) != 0)
+		return -EPIPE;
+
+	snd_pcm_start(amx->slave);
+
+	return 0;
+}
+
+/**
+ * Stop callback of an IO plugin PCM. This drops current slave buffers.
+ *
+ * @param io: The IO plugin interface to stop.
+ * @return: 0 on success, negative number otherwise.
+ */
+static int amux_stop(struct snd_pcm_ioplug *io)
+{
+	struct snd_pcm_amux *amx = to_pcm_amux(io);
+
+	AMUX_DBG("%s: enter PCM(%p)\n", __func__, io);
+	AMUX_STATS_ADD(amx->stats, cb[AMUX_STATS_CB_STOP], 1);
+	AMUX_TRACE_SCOPE(amx, "stop");
+	AMUX_PERF_SCOPE(amx, AMUX_STATS_CB_STOP);
+
+	if(amx->idle)
+		amux_idle_leave(amx, 0);
+
+	if(amux_check_card(amx) != 0)
+		return -EPIPE;
+
+	snd_pcm_drop(amx->slave);
+
+	return 0;
+}
+
+/**
+ * Pause callback of IO plugin PCM. Slave is paused in place if it supports it,
+ * otherwise its buffer is dropped on pause and it is prepared again on release.
+ *
+ * @param io: The IO plugin interface to pause.
+ * @param enable: 1 to pause, 0 to release.
+ * @return: 0 on success, negative number otherwise.
+ */
+static int amux_pause(struct snd_pcm_ioplug *io, int enable)
+{
+	struct snd_pcm_amux *amx = to_pcm_amux(io);
+	snd_pcm_state_t state;
+	int ret;
+
+	AMUX_DBG("%s: enter PCM(%p)\n", __func__, io);
+	AMUX_STATS_ADD(amx->stats, cb[AMUX_STATS_CB_PAUSE], 1);
+	AMUX_TRACE_SCOPE(amx, "pause");
+	AMUX_PERF_SCOPE(amx, AMUX_STATS_CB_PAUSE);
+
+	if(amux_check_card(amx) != 0)
+		return -EPIPE;
+
+	if(amx->idle)
+		amux_idle_leave(amx, 1);
+
+	state = snd_pcm_state(amx->slave);
+
+	/* Slave may have been switched while paused, it is only prepared */
+	if(!enable && (state == SND_PCM_STATE_PREPARED))
+		return snd_pcm_start(amx->slave);
+
+	if(amx->can_pause) {
+		ret = snd_pcm_pause(amx->slave, enable);
+		if(ret == 0)
+			return 0;
+		AMUX_ERR("%s: Cannot pause slave (%d)\n", __func__, ret);
+	}
+
+	if(enable)
+		return snd_pcm_drop(amx->slave);
+
+	ret = snd_pcm_prepare(amx->slave);
+	if(ret != 0)
+		return ret;
+
+	return snd_pcm_start(amx->slave);
+}
+
+/**
+ * Try to resume a suspended slave. Slaves that cannot resume by themselves are
+ * prepared again.
+ *
+ * @param amx: Amux master.
+ * @return: 0 on success, -EAGAIN if slave is not yet ready to resume, 1 if
+ * slave has been prepared again (i.e. buffer content is lost), negative number
+ * otherwise.
  */
-static inline void amux_destroy(struct snd_pcm_amux *amx)
+static int amux_slave_resume(struct snd_pcm_amux *amx)
 {
-	if(amx == NULL)
-		return;
-
-	if(amx->poller)
-		poller_destroy(amx->poller);
+	int ret;
 
-	if(amx->slave)
-		snd_pcm_close(amx->slave);
+	ret = snd_pcm_resume(amx->slave);
+	if((ret == 0) || (ret == -EAGAIN))
+		return ret;
 
-	if(amx->fd >= 0)
-		close(amx->fd);
+	ret = snd_pcm_prepare(amx->slave);
+	if(ret != 0)
+		return ret;
 
-	free(amx);
+	return 1;
 }
 
 /**
- * Initialize Amux PCM poller
+ * Resume callback of IO plugin PCM, called by the application once a
+ * suspended slave has been reported.
  *
- * @param amx: Amux PCM to intialize poller with
- * @param name: Poller name
- * @return: 0 on success, negative number otherwise
+ * @param io: The IO plugin interface to resume.
+ * @return: 0 on success, negative number otherwise.
  */
-static inline int amux_poller_init(struct snd_pcm_amux *amx, char const *name)
+static int amux_resume(struct snd_pcm_ioplug *io)
 {
-	amx->poller = poller_create(amx, name, NULL);
-	if(amx->poller == NULL)
-		return -ENOMEM;
+	struct snd_pcm_amux *amx = to_pcm_amux(io);
+	int ret;
+
+	AMUX_DBG("%s: enter PCM(%p)\n", __func__, io);
+	AMUX_STATS_ADD(amx->stats, cb[AMUX_STATS_CB_RESUME], 1);
+	AMUX_TRACE_SCOPE(amx, "resume");
+	AMUX_PERF_SCOPE(amx, AMUX_STATS_CB_RESUME);
+
+	if(amx->slave == NULL)
+		return -ENODEV;
+
+	if(snd_pcm_state(amx->slave) == SND_PCM_STATE_SUSPENDED) {
+		ret = amux_slave_resume(amx);
+		if(ret < 0)
+			return ret;
+	} else {
+		ret = 0;
+	}
+
+	/*
+	 * If slave buffer has been lost report an xrun, so that application
+	 * prepares and refills.
+	 */
+	if(ret == 1)
+		snd_pcm_ioplug_set_state(io, SND_PCM_STATE_XRUN);
+	else
+		snd_pcm_ioplug_set_state(io, amx->suspend_state);
 
 	return 0;
 }
 
 /**
- * If slave PCM has not been configured set a default one
+ * Get current slave statistics, allocating them at first use.
  *
- * @param amx: Amux PCM to set default slave to
- * @param path: Path to Amux PCM configuration
- * @return: 0 on success, negative number otherwise
+ * @param amx: Amux master.
+ * @return: Current slave statistics, NULL if too many slaves have been used.
  */
-static inline int amux_set_default_pcm(struct snd_pcm_amux *amx,
-		char const *path)
+static struct amux_slave_stats *amux_slave_stats(struct snd_pcm_amux *amx)
 {
-	ssize_t ret;
-	size_t cur = 0, len = strlen(AMUX_SLAVE_DFT);
-	char const *dft = AMUX_SLAVE_DFT;
-	int fd;
-
-	ret = open(path, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
-	if(ret < 0)
-		goto out;
+	struct amux_slave_stats *st;
+	size_t i;
 
-	fd = (int)ret;
-	flock(fd, LOCK_EX);
-	do {
-		ret = write(fd, dft + cur, len - cur);
-		if((ret < 0) && (errno == EINTR))
+	for(i = 0; i < amx->sstatsnr; ++i) {
+		st = &amx->sstats[i];
+		if(strcmp(st->sname, amx->sname) != 0)
 			continue;
-		if(ret < 0)
-			goto unlock;
-		cur += (size_t)ret;
-	} while(cur < len);
+		/* Loaded from adaptive buffering file */
+		if(st->first_ts.tv_sec == 0)
+			clock_gettime(CLOCK_MONOTONIC, &st->first_ts);
+		return st;
+	}
 
-	strncpy(amx->sname, AMUX_SLAVE_DFT, sizeof(amx->sname) - 1);
-	amx->sname[sizeof(amx->sname) - 1] = '\0';
-unlock:
-	flock(fd, LOCK_UN);
-	close(fd);
-out:
-	return ret;
+	if(amx->sstatsnr == ARRAY_SIZE(amx->sstats))
+		return NULL;
+
+	st = &amx->sstats[amx->sstatsnr++];
+	strncpy(st->sname, amx->sname, sizeof(st->sname) - 1);
+	clock_gettime(CLOCK_MONOTONIC, &st->first_ts);
+
+	return st;
 }
 
 /**
- * Read slave PCM configuration
+ * Get the slave buffer headroom, i.e. how many frames slave buffer is bigger
+ * than master one, used to prefill silence on xrun.
  *
- * @param amx: Amux PCM to read configuration from
- * @param pcm: Filled with name of configured PCM
- * @param len: Max length of pcm output buffer
- * @return: 0 on success, negative number otherwise
+ * @param amx: Amux master.
+ * @return: Headroom in frames.
  */
-static inline int amux_read_pcm(struct snd_pcm_amux *amx, char *pcm,
-		size_t len)
+static snd_pcm_uframes_t amux_headroom(struct snd_pcm_amux *amx)
 {
-	ssize_t ret;
-	size_t cur = 0;
+	struct amux_slave_stats *st;
 
-	if(len == 0)
-		return -ENOMEM;
-
-	do {
-		ret = read(amx->fd, pcm + cur, len - 1 - cur);
-		if((ret < 0) && (errno == EINTR))
-			continue;
-		if(ret < 0)
-			goto out;
-		cur += (size_t)ret;
-	} while(ret != 0);
+	if(amx->adapt_file == NULL)
+		return amx->prefill;
 
-	pcm[cur] = '\0';
+	st = amux_slave_stats(amx);
+	if((st == NULL) || (st->headroom < amx->prefill))
+		return amx->prefill;
 
-out:
-	return ret;
+	return st->headroom;
 }
 
 /**
- * Check if the configured slave matches the currently used one.
+ * Double adaptive headroom of a slave after an xrun.
  *
- * @param amx: Amux master PCM
- * @return: -1 if configured PCM is different from current one or an error
- * occured, 0 otherwise.
+ * @param amx: Amux master.
+ * @param st: Slave statistics.
+ * @return: 1 if headroom has been increased, 0 otherwise.
  */
-static inline int amux_check_card(struct snd_pcm_amux *amx)
+static int amux_headroom_grow(struct snd_pcm_amux *amx,
+		struct amux_slave_stats *st)
 {
-	int ret = -1;
-	char card[CARD_NAMESZ] = "default";
+	snd_pcm_uframes_t val, max;
 
-	if(amx->slave == NULL)
-		goto out;
+	if(amx->adapt_file == NULL)
+		return 0;
 
-	/* Someone is updating config, assume card has not changed yet */
-	ret = flock(amx->fd, LOCK_SH | LOCK_NB);
-	if(ret != 0)
+	max = amx->adapt_max ? amx->adapt_max : amx->io.buffer_size;
+	val = st->headroom ? st->headroom * 2 : amx->io.period_size / 2;
+	if(val > max)
+		val = max;
+	if(val <= st->headroom)
 		return 0;
 
-	lseek(amx->fd, SEEK_SET, 0);
+	st->headroom = val;
+	st->headroom_ts = st->xrun_ts;
 
-	ret = amux_read_pcm(amx, card, sizeof(card));
-	flock(amx->fd, LOCK_UN);
-	if(ret < 0)
-		goto out;
+	return 1;
+}
 
-	ret = -1;
-	if(strcmp(card, amx->sname) != 0)
-		goto out;
+/**
+ * Decrease adaptive headroom of a slave by a quarter if it has not xrun for
+ * AMUX_ADAPT_PERIOD seconds. This is applied next time slave is configured.
+ *
+ * @param amx: Amux master.
+ * @param st: Slave statistics.
+ */
+static void amux_headroom_shrink(struct snd_pcm_amux *amx,
+		struct amux_slave_stats *st)
+{
+	struct timespec now;
 
-	ret = 0;
-out:
-	return ret;
+	if((amx->adapt_file == NULL) || (st->headroom == 0))
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if(now.tv_sec - st->headroom_ts.tv_sec < AMUX_ADAPT_PERIOD)
+		return;
+
+	if(st->headroom_ts.tv_sec == 0) {
+		/* Loaded from file, start measuring now */
+		st->headroom_ts = now;
+		return;
+	}
+
+	st->headroom -= st->headroom / 4;
+	if(st->headroom < amx->io.period_size / 8)
+		st->headroom = 0;
+	st->headroom_ts = now;
 }
 
 /**
- * Close callback of an IO plugin PCM device.
+ * Set slave avail_min software parameter.
  *
- * @param io: The IO plugin to close.
+ * @param amx: Amux master.
+ * @param val: New slave avail_min.
  * @return: 0 on success, negative number otherwise.
  */
-static int amux_close(struct snd_pcm_ioplug *io)
+static int amux_avail_min_set(struct snd_pcm_amux *amx, snd_pcm_uframes_t val)
 {
-	struct snd_pcm_amux *amx = to_pcm_amux(io);
+	int ret;
 
-	AMUX_DBG("%s: enter PCM(%p)\n", __func__, io);
-	amux_destroy(amx);
+	ret = snd_pcm_sw_params_current(amx->slave, amx->swp);
+	if(ret < 0)
+		return ret;
 
-	return 0;
+	ret = snd_pcm_sw_params_set_avail_min(amx->slave, amx->swp, val);
+	if(ret < 0)
+		return ret;
+
+	return snd_pcm_sw_params(amx->slave, amx->swp);
 }
 
 /**
- * Callback for starting IO plugin PCM playback.
+ * Apply the avail_min learned for current slave, if any.
  *
- * @param io: The IO plugin interface to start.
- * @return: 0 on success, negative number otherwise.
+ * @param amx: Amux master.
  */
-static int amux_start(struct snd_pcm_ioplug *io)
+static void amux_avail_min_apply(struct snd_pcm_amux *amx)
 {
-	struct snd_pcm_amux *amx = to_pcm_amux(io);
+	struct amux_slave_stats *st;
 
-	AMUX_DBG("%s: enter PCM(%p)\n", __func__, io);
+	amx->wkwin = 0;
+	amx->wkspurious = 0;
+	amx->avail_min_pending = 0;
 
+	st = amux_slave_stats(amx);
+	if((st == NULL) || (st->avail_min <= amx->avail_min))
+		return;
 
-	if(amux_check_card(amx) != 0)
-		return -EPIPE;
+	if(amux_avail_min_set(amx, st->avail_min) < 0)
+		AMUX_ERR("%s: Cannot set slave avail_min\n", __func__);
+}
 
-	snd_pcm_start(amx->slave);
+/**
+ * Apply the slave avail_min raised by spurious wakeup adaptation, if any. This
+ * reconfigures the slave so it is a transition out of steady state, like xrun
+ * recovery.
+ *
+ * @param amx: Amux master.
+ */
+static void amux_avail_min_commit(struct snd_pcm_amux *amx)
+{
+	struct amux_slave_stats *st;
+	snd_pcm_uframes_t val = amx->avail_min_pending;
 
-	return 0;
+	if(val == 0)
+		return;
+
+	RT_HOT_LEAVE();
+	amx->avail_min_pending = 0;
+	st = amux_slave_stats(amx);
+	if(st == NULL)
+		return;
+
+	if(amux_avail_min_set(amx, val) == 0)
+		st->avail_min = val;
+	else
+		AMUX_ERR("%s: Cannot set slave avail_min\n", __func__);
 }
 
 /**
- * Stop callback of an IO plugin PCM. This drops current playback buffers.
+ * Account a slave wakeup. If more than 1% of wakeups in a window are spurious
+ * (i.e. slave woke us up before avail_min frames were available, which happens
+ * with coarse slave timers), slave avail_min is raised one step. It is never
+ * raised above half a period more than client avail_min, nor above a value
+ * that caused an xrun. As this is called from poll_revents, the new value is
+ * only recorded here and applied by amux_avail_min_commit().
  *
- * @param io: The IO plugin interface to stop.
- * @return: 0 on success, negative number otherwise.
+ * @param amx: Amux master.
+ * @param avail: Slave available frames at wakeup.
+ * @return: 1 if slave is ready, 0 if wakeup was spurious.
  */
-static int amux_stop(struct snd_pcm_ioplug *io)
+int amux_wakeup(struct snd_pcm_amux *amx, snd_pcm_sframes_t avail)
 {
-	struct snd_pcm_amux *amx = to_pcm_amux(io);
+	struct amux_slave_stats *st;
+	snd_pcm_uframes_t val, max, step;
+	int ready = (avail >= (snd_pcm_sframes_t)amx->avail_min);
+
+	AMUX_STATS_ADD(amx->stats, wakeup, 1);
+	AMUX_TRACE_INSTANT(amx, "wakeup", avail);
+	if(!ready)
+		AMUX_STATS_ADD(amx->stats, spurious, 1);
+
+	st = amux_slave_stats(amx);
+	if(st == NULL)
+		return ready;
+
+	++st->wakeup;
+	++amx->wkwin;
+	if(!ready) {
+		++st->spurious;
+		++amx->wkspurious;
+	}
 
-	AMUX_DBG("%s: enter PCM(%p)\n", __func__, io);
+	if(amx->wkwin < AMUX_WAKEUP_WINDOW)
+		return ready;
+
+	if(amx->wkspurious * 100 > amx->wkwin) {
+		step = amx->io.period_size / 8 ? amx->io.period_size / 8 : 1;
+		max = amx->avail_min + amx->io.period_size / 2;
+		if((st->avail_max != 0) && (st->avail_max < max))
+			max = st->avail_max;
+		val = (st->avail_min > amx->avail_min) ? st->avail_min :
+			amx->avail_min;
+		if(val + step <= max)
+			amx->avail_min_pending = val + step;
+	}
 
-	if(amux_check_card(amx) != 0)
-		return -EPIPE;
+	amx->wkwin = 0;
+	amx->wkspurious = 0;
 
-	snd_pcm_drop(amx->slave);
+	amux_headroom_shrink(amx, st);
 
-	return 0;
+	return ready;
 }
 
+static int amux_cfg_slave(struct snd_pcm_amux *amx, char const *sname);
+
 /**
  * Prepare callback of IO plugin PCM.
  *
@@ -269,18 +1501,42 @@ static int amux_stop(struct snd_pcm_ioplug *io)
 static int amux_prepare(struct snd_pcm_ioplug *io)
 {
 	struct snd_pcm_amux *amx = to_pcm_amux(io);
+	char sname[CARD_NAMESZ];
 	int ret;
 
 	AMUX_DBG("%s: enter PCM(%p)\n", __func__, io);
+	AMUX_STATS_ADD(amx->stats, cb[AMUX_STATS_CB_PREPARE], 1);
+	AMUX_TRACE_SCOPE(amx, "prepare");
+	amux_perf_hold(amx);
+	AMUX_PERF_SCOPE(amx, AMUX_STATS_CB_PREPARE);
+
+	if(amx->idle)
+		amux_idle_leave(amx, 0);
+	amx->idle_frames = 0;
 
 	if(amux_check_card(amx) != 0)
 		return 0;
 
+	/* Apply adaptive headroom learned since slave was configured */
+	if(amx->headroom_stale) {
+		strcpy(sname, amx->sname);
+		ret = amux_cfg_slave(amx, sname);
+		if(ret != 0) {
+			AMUX_ERR("Can't reconfigure slave\n");
+			return ret;
+		}
+	}
+
 	ret = snd_pcm_prepare(amx->slave);
 	if(ret != 0) {
 		AMUX_ERR("Can't prepare slave\n");
 		return ret;
 	}
+	amx->sappl = io->appl_ptr;
+	amx->prefilling = 0;
+	amux_avail_min_commit(amx);
+	AMUX_STATS_SET(amx->stats, rate, io->rate);
+	AMUX_STATS_SET(amx->stats, buffer_size, io->buffer_size);
 
 	if(poller_set_slave(amx->poller) < 0) {
 		AMUX_ERR("Can't set new slave\n");
@@ -309,10 +1565,74 @@ static snd_pcm_chmap_query_t **amux_query_chmaps(snd_pcm_ioplug_t *io)
 	struct snd_pcm_amux *amx = to_pcm_amux(io);
 
 	AMUX_DBG("%s: enter PCM(%p)\n", __func__, io);
+	AMUX_TRACE_SCOPE(amx, "query_chmaps");
 
 	return snd_pcm_query_chmaps(amx->slave);
 }
 
+/*
+ * Apply user channel map to the current slave. The slave is asked to use it
+ * directly, if it cannot, channels are remapped in the transfer path.
+ *
+ * @param amx: Amux master.
+ * @return: 0 on success, negative number otherwise.
+ */
+static int amux_chmap_update(struct snd_pcm_amux *amx)
+{
+	snd_pcm_chmap_t const *map = NULL;
+	snd_pcm_chmap_t *smap;
+	unsigned int schan;
+	int ret;
+
+	schan = (amx->stream == SND_PCM_STREAM_PLAYBACK) ?
+		amx->dsp.ochannels : amx->dsp.ichannels;
+
+	if(amx->chmap[0] != 0) {
+		map = (snd_pcm_chmap_t const *)amx->chmap;
+		if(map->channels == schan)
+			snd_pcm_set_chmap(amx->slave, map);
+	}
+
+	smap = snd_pcm_get_chmap(amx->slave);
+	if(amx->stream == SND_PCM_STREAM_PLAYBACK)
+		ret = dsp_set_chmap(&amx->dsp, map, smap);
+	else
+		ret = dsp_set_chmap(&amx->dsp, smap, map);
+	free(smap);
+
+	return ret;
+}
+
+/*
+ * Callback to get IO plugin PCM's current channel mapping.
+ *
+ * @param io: IO plugin interface to get channel mapping from.
+ * @return: Allocated channel mapping, NULL on error
+ */
+static snd_pcm_chmap_t *amux_get_chmap(snd_pcm_ioplug_t *io)
+{
+	struct snd_pcm_amux *amx = to_pcm_amux(io);
+	snd_pcm_chmap_t *map;
+	size_t sz;
+
+	AMUX_DBG("%s: enter PCM(%p)\n", __func__, io);
+	AMUX_TRACE_SCOPE(amx, "get_chmap");
+
+	if(amx->chmap[0] == 0) {
+		if(amx->dsp.mix)
+			return NULL;
+		return snd_pcm_get_chmap(amx->slave);
+	}
+
+	RT_ASSERT_COLD();
+	sz = (amx->chmap[0] + 1) * sizeof(*amx->chmap);
+	map = malloc(sz);
+	if(map != NULL)
+		memcpy(map, amx->chmap, sz);
+
+	return map;
+}
+
 /*
  * Callback to configure IO plugin PCM's channel mapping.
  *
@@ -324,8 +1644,15 @@ static int amux_set_chmap(snd_pcm_ioplug_t *io, snd_pcm_chmap_t const *map)
 	struct snd_pcm_amux *amx = to_pcm_amux(io);
 
 	AMUX_DBG("%s: enter PCM(%p)\n", __func__, io);
+	AMUX_TRACE_SCOPE(amx, "set_chmap");
+
+	/* Too many channels to be remapped by amux */
+	if(map->channels > DSP_CHANNELS_MAX)
+		return snd_pcm_set_chmap(amx->slave, map);
+
+	memcpy(amx->chmap, map, (map->channels + 1) * sizeof(*amx->chmap));
 
-	return snd_pcm_set_chmap(amx->slave, map);
+	return amux_chmap_update(amx);
 }
 
 /*
@@ -340,6 +1667,9 @@ static int amux_sw_params(snd_pcm_ioplug_t *io, snd_pcm_sw_params_t *parm)
 	int ret;
 
 	AMUX_DBG("%s: enter PCM(%p)\n", __func__, io);
+	AMUX_STATS_ADD(amx->stats, cb[AMUX_STATS_CB_SW_PARAMS], 1);
+	AMUX_TRACE_SCOPE(amx, "sw_params");
+	AMUX_PERF_SCOPE(amx, AMUX_STATS_CB_SW_PARAMS);
 
 	/* Reset tstamp type */
 	ret = snd_pcm_sw_params_set_tstamp_type(amx->slave, parm,
@@ -349,15 +1679,55 @@ static int amux_sw_params(snd_pcm_ioplug_t *io, snd_pcm_sw_params_t *parm)
 		goto out;
 	}
 
-	ret = snd_pcm_sw_params(amx->slave, parm);
-	if(ret < 0) {
-		AMUX_ERR("%s: Cannot configure slave sw params\n", __func__);
-		goto out;
+	ret = snd_pcm_sw_params(amx->slave, parm);
+	if(ret < 0) {
+		AMUX_ERR("%s: Cannot configure slave sw params\n", __func__);
+		goto out;
+	}
+
+	snd_pcm_sw_params_get_avail_min(parm, &amx->avail_min);
+	amux_avail_min_apply(amx);
+
+	ret = snd_pcm_sw_params_get_boundary(parm, &amx->boundary);
+out:
+	return ret;
+}
+
+/*
+ * Configure slave PCM format. Use the master format if slave supports it,
+ * otherwise fallback to the most precise slave native format amux can convert
+ * to.
+ *
+ * @param slv: Slave PCM.
+ * @param shw: Slave hardware params to configure.
+ * @param fmt: Master PCM format.
+ * @param sfmt: Filled with the selected slave format.
+ * @return: 0 on success, negative number otherwise.
+ */
+static int amux_hw_params_format(snd_pcm_t *slv, snd_pcm_hw_params_t *shw,
+		snd_pcm_format_t fmt, snd_pcm_format_t *sfmt)
+{
+	snd_pcm_format_t const *fmts;
+	size_t i, nr;
+
+	*sfmt = fmt;
+	if(snd_pcm_hw_params_test_format(slv, shw, fmt) == 0)
+		return snd_pcm_hw_params_set_format(slv, shw, fmt);
+
+	if(!dsp_format_supported(fmt))
+		return -EINVAL;
+
+	fmts = dsp_formats(&nr);
+	for(i = 0; i < nr; ++i) {
+		if(snd_pcm_hw_params_test_format(slv, shw, fmts[i]) != 0)
+			continue;
+		*sfmt = fmts[i];
+		AMUX_DBG("%s: Slave uses format %d instead of %d\n", __func__,
+				(int)fmts[i], (int)fmt);
+		return snd_pcm_hw_params_set_format(slv, shw, fmts[i]);
 	}
 
-	ret = snd_pcm_sw_params_get_boundary(parm, &amx->boundary);
-out:
-	return ret;
+	return -EINVAL;
 }
 
 /*
@@ -371,18 +1741,23 @@ static int amux_hw_params_refine(struct snd_pcm_amux *amx,
 		snd_pcm_hw_params_t *hw)
 {
 	snd_pcm_t *mst = amx->io.pcm, *slv = amx->slave;
+	size_t mark = amux_arena_mark(&amx->arena);
 	snd_pcm_hw_params_t *shw, *nmhw;
 	snd_pcm_sw_params_t *sw;
 	snd_pcm_access_t acc;
-	snd_pcm_format_t fmt;
-	snd_pcm_uframes_t bsz;
-	unsigned int val;
+	snd_pcm_format_t fmt, sfmt;
+	snd_pcm_uframes_t bsz, sbsz, headroom;
+	unsigned int val, chan, schan;
 	int dir, ret;
 
 	AMUX_DBG("%s: enter PCM(%p)\n", __func__, &amx->io);
 
-	snd_pcm_hw_params_alloca(&shw);
-	snd_pcm_hw_params_alloca(&nmhw);
+	shw = amux_arena_alloc(&amx->arena, snd_pcm_hw_params_sizeof());
+	nmhw = amux_arena_alloc(&amx->arena, snd_pcm_hw_params_sizeof());
+	sw = amux_arena_alloc(&amx->arena, snd_pcm_sw_params_sizeof());
+	ret = -ENOMEM;
+	if((shw == NULL) || (nmhw == NULL) || (sw == NULL))
+		goto out;
 
 	snd_pcm_hw_params_any(slv, shw);
 	snd_pcm_hw_params_any(mst, nmhw);
@@ -420,7 +1795,7 @@ static int amux_hw_params_refine(struct snd_pcm_amux *amx,
 	}
 
 	snd_pcm_hw_params_get_format(hw, &fmt);
-	ret = snd_pcm_hw_params_set_format(slv, shw, fmt);
+	ret = amux_hw_params_format(slv, shw, fmt, &sfmt);
 	if(ret != 0) {
 		AMUX_ERR("Cannot set fmt to %d\n", (int)fmt);
 		goto out;
@@ -431,15 +1806,17 @@ static int amux_hw_params_refine(struct snd_pcm_amux *amx,
 		goto out;
 	}
 
-	snd_pcm_hw_params_get_channels(hw, &val);
-	ret = snd_pcm_hw_params_set_channels(slv, shw, val);
+	/* Channels are mixed in the transfer path if slave cannot use them */
+	snd_pcm_hw_params_get_channels(hw, &chan);
+	schan = chan;
+	ret = snd_pcm_hw_params_set_channels_near(slv, shw, &schan);
 	if(ret != 0) {
-		AMUX_ERR("Cannot set channels to %u\n", val);
+		AMUX_ERR("Cannot set channels to %u\n", chan);
 		goto out;
 	}
-	ret = snd_pcm_hw_params_set_channels(mst, nmhw, val);
+	ret = snd_pcm_hw_params_set_channels(mst, nmhw, chan);
 	if(ret != 0) {
-		AMUX_ERR("Cannot set channels to %u\n", val);
+		AMUX_ERR("Cannot set channels to %u\n", chan);
 		goto out;
 	}
 
@@ -456,12 +1833,17 @@ static int amux_hw_params_refine(struct snd_pcm_amux *amx,
 		goto out;
 	}
 
+	/* Slave buffer gets extra room for xrun silence prefill */
 	snd_pcm_hw_params_get_buffer_size(hw, &bsz);
-	ret = snd_pcm_hw_params_set_buffer_size_near(slv, shw, &bsz);
+	headroom = amux_headroom(amx);
+	sbsz = bsz + headroom;
+	ret = snd_pcm_hw_params_set_buffer_size_near(slv, shw, &sbsz);
 	if(ret != 0) {
-		AMUX_ERR("Cannot set buffer size to %u\n", (unsigned int)bsz);
+		AMUX_ERR("Cannot set buffer size to %u\n", (unsigned int)sbsz);
 		goto out;
 	}
+	if((headroom == 0) || (sbsz < bsz))
+		bsz = sbsz;
 	ret = snd_pcm_hw_params_set_buffer_size(mst, nmhw, bsz);
 	if(ret != 0) {
 		AMUX_ERR("Cannot set buffer size to %u\n", (unsigned int)bsz);
@@ -485,8 +1867,10 @@ static int amux_hw_params_refine(struct snd_pcm_amux *amx,
 		AMUX_ERR("Cannot set slave's hw params\n");
 		goto out;
 	}
+	amx->can_pause = snd_pcm_hw_params_can_pause(shw);
+	amx->sbuffer_size = sbsz;
+	amx->headroom_stale = 0;
 
-	snd_pcm_sw_params_alloca(&sw);
 	snd_pcm_sw_params_current(slv, sw);
 	ret = snd_pcm_sw_params_get_tstamp_type(sw, &amx->slave_tstamp);
 	if (ret != 0) {
@@ -495,11 +1879,113 @@ static int amux_hw_params_refine(struct snd_pcm_amux *amx,
 		goto out;
 	}
 
+	/* Transfer path goes from slave to master when capturing */
+	if(amx->stream == SND_PCM_STREAM_PLAYBACK)
+		ret = dsp_setup(&amx->dsp, fmt, chan, sfmt, schan, amx->dither);
+	else
+		ret = dsp_setup(&amx->dsp, sfmt, schan, fmt, chan, amx->dither);
+	if(ret != 0) {
+		AMUX_ERR("%s: Cannot setup transfer path\n", __func__);
+		goto out;
+	}
+
+	ret = amux_chmap_update(amx);
+	if(ret != 0) {
+		AMUX_ERR("%s: Cannot map %u channels to %u\n", __func__,
+				chan, schan);
+		goto out;
+	}
+
 	snd_pcm_hw_params_copy(hw, nmhw);
 out:
+	amux_arena_release(&amx->arena, mark);
 	return ret;
 }
 
+/**
+ * Slave switch being profiled
+ */
+struct amux_switch_prof {
+	/**
+	 * Profile record being filled
+	 */
+	struct amux_stats_switch rec;
+	/**
+	 * End of last measured phase
+	 */
+	struct timespec last;
+};
+
+/**
+ * Start profiling a slave switch.
+ *
+ * @param prof: Switch profile to initialize.
+ * @param sname: Target slave name.
+ */
+static void amux_switch_prof_start(struct amux_switch_prof *prof,
+		char const *sname)
+{
+	memset(&prof->rec, 0, sizeof(prof->rec));
+	strncpy(prof->rec.sname, sname, sizeof(prof->rec.sname) - 1);
+	clock_gettime(CLOCK_MONOTONIC, &prof->last);
+}
+
+/**
+ * Account time elapsed since last phase to a switch phase.
+ *
+ * @param prof: Switch profile.
+ * @param ph: Phase that just ended.
+ */
+static void amux_switch_prof_lap(struct amux_switch_prof *prof,
+		enum amux_switch_phase ph)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	prof->rec.us[ph] = (now.tv_sec - prof->last.tv_sec) * 1000000 +
+		(now.tv_nsec - prof->last.tv_nsec) / 1000;
+	prof->last = now;
+}
+
+/**
+ * Publish a slave switch profile in the last switches ring and account
+ * successful ones in target slave duration histogram.
+ *
+ * @param amx: Amux master.
+ * @param prof: Switch profile.
+ * @param result: Switch result.
+ */
+static void amux_switch_prof_end(struct snd_pcm_amux *amx,
+		struct amux_switch_prof *prof, int result)
+{
+	struct amux_slave_stats *st;
+	unsigned long us = 0, ms;
+	size_t i, b = 0;
+
+	for(i = 0; i < AMUX_SWITCH_PH_NR; ++i)
+		us += prof->rec.us[i];
+
+	prof->rec.result = result;
+	prof->rec.ts = prof->last.tv_sec * 1000000000ULL + prof->last.tv_nsec;
+	amux_stats_switch_push(amx->stats, &prof->rec);
+
+	if(result != 0)
+		return;
+
+	st = amux_slave_stats(amx);
+	if(st == NULL)
+		return;
+
+	ms = us / 1000;
+	if(ms != 0)
+		b = sizeof(ms) * 8 - __builtin_clzl(ms);
+	if(b >= SWITCH_HIST_NR)
+		b = SWITCH_HIST_NR - 1;
+	++st->switch_hist[b];
+	if(us > st->switch_max)
+		st->switch_max = us;
+}
+
 /**
  * Configure new slave PCM.
  *
@@ -509,12 +1995,31 @@ out:
  */
 static int amux_cfg_slave(struct snd_pcm_amux *amx, char const *sname)
 {
+	size_t mark = amux_arena_mark(&amx->arena);
+	struct amux_switch_prof prof;
 	snd_pcm_hw_params_t *hw;
 	snd_pcm_sw_params_t *sw;
+	snd_pcm_sframes_t queued = 0;
 	int ret;
 
 	AMUX_DBG("%s: enter PCM(%p)\n", __func__, &amx->io);
 
+	RT_ASSERT_COLD();
+
+	AMUX_TRACE_SCOPE(amx, "switch");
+	AMUX_PROBE1(cfg_slave_begin, sname);
+	amux_switch_prof_start(&prof, sname);
+
+	/* Frames the application thinks are still to be played */
+	if((amx->stream == SND_PCM_STREAM_PLAYBACK) &&
+			((amx->io.state == SND_PCM_STATE_RUNNING) ||
+			 (amx->io.state == SND_PCM_STATE_DRAINING) ||
+			 (amx->io.state == SND_PCM_STATE_PAUSED))) {
+		queued = amx->sappl - amx->io.hw_ptr;
+		if(queued < 0)
+			queued += amx->boundary;
+	}
+
 	strncpy(amx->sname, sname, sizeof(amx->sname) - 1);
 	if(amx->slave) {
 		snd_pcm_drop(amx->slave);
@@ -523,15 +2028,24 @@ static int amux_cfg_slave(struct snd_pcm_amux *amx, char const *sname)
 
 	/* Force to reload config and the load_for_all_cards hook */
 	snd_config_update_free_global();
+	amux_switch_prof_lap(&prof, AMUX_SWITCH_PH_CONFIG);
 	ret = snd_pcm_open(&amx->slave, amx->sname, amx->stream, amx->mode);
+	amux_switch_prof_lap(&prof, AMUX_SWITCH_PH_OPEN);
 	if(ret != 0) {
 		AMUX_ERR("%s: snd_pcm_open error\n", __func__);
 		goto err;
 	}
 
-	snd_pcm_hw_params_alloca(&hw);
+	hw = amux_arena_alloc(&amx->arena, snd_pcm_hw_params_sizeof());
+	sw = amux_arena_alloc(&amx->arena, snd_pcm_sw_params_sizeof());
+	if((hw == NULL) || (sw == NULL)) {
+		ret = -ENOMEM;
+		goto close;
+	}
+
 	snd_pcm_hw_params_current(amx->io.pcm, hw);
 	ret = amux_hw_params_refine(amx, hw);
+	amux_switch_prof_lap(&prof, AMUX_SWITCH_PH_HW_PARAMS);
 	if(ret != 0) {
 		AMUX_ERR("%s: amux_hw_params_refine error\n", __func__);
 		goto close;
@@ -555,32 +2069,57 @@ static int amux_cfg_slave(struct snd_pcm_amux *amx, char const *sname)
 	amx->io.buffer_size = val;
 #endif
 
-	snd_pcm_sw_params_alloca(&sw);
 	snd_pcm_sw_params_current(amx->io.pcm, sw);
 	ret = snd_pcm_sw_params(amx->slave, sw);
 	if(ret != 0) {
+		amux_switch_prof_lap(&prof, AMUX_SWITCH_PH_SW_PARAMS);
 		AMUX_ERR("%s: snd_pcm_sw_params error\n", __func__);
 		goto close;
 	}
-
-	/* TODO get/set chmaps */
+	amux_avail_min_apply(amx);
+	amux_switch_prof_lap(&prof, AMUX_SWITCH_PH_SW_PARAMS);
 
 	ret = snd_pcm_prepare(amx->slave);
 	if(ret != 0) {
+		amux_switch_prof_lap(&prof, AMUX_SWITCH_PH_PREPARE);
 		AMUX_ERR("%s: snd_pcm_prepare error\n", __func__);
 		goto close;
 	}
 
-	if(poller_set_slave(amx->poller) != 0) {
+	/*
+	 * Replace frames dropped with previous slave with silence, so that
+	 * hardware pointer and reported delay stay continuous for the
+	 * application (e.g. for A/V sync).
+	 */
+	if((snd_pcm_uframes_t)queued > amx->io.buffer_size)
+		queued = amx->io.buffer_size;
+	if((queued != 0) && (amux_silence(amx, queued) < 0))
+		AMUX_ERR("%s: Cannot fill new slave with silence\n", __func__);
+	amx->prefilling = 0;
+	amux_switch_prof_lap(&prof, AMUX_SWITCH_PH_PREPARE);
+
+	ret = poller_set_slave(amx->poller);
+	amux_switch_prof_lap(&prof, AMUX_SWITCH_PH_POLLER);
+	if(ret != 0) {
 		AMUX_ERR("Can't set poller's new slave\n");
 		goto close;
 	}
 
+	amux_gain_preset(amx);
+	amux_stats_set_slave(amx->stats, amx->sname);
+	AMUX_TRACE_SLAVE_SET(amx, amux_trace_slave(amx->sname));
+
+	amux_switch_prof_end(amx, &prof, 0);
+	amux_arena_release(&amx->arena, mark);
+	AMUX_PROBE2(cfg_slave_end, amx->sname, 0);
 	return 0;
 close:
 	snd_pcm_close(amx->slave);
 err:
 	amx->slave = NULL;
+	amux_switch_prof_end(amx, &prof, (ret != 0) ? ret : -ENODEV);
+	amux_arena_release(&amx->arena, mark);
+	AMUX_PROBE2(cfg_slave_end, amx->sname, -ENODEV);
 	return -ENODEV;
 }
 
@@ -597,108 +2136,493 @@ static int amux_disconnected(struct snd_pcm_amux *amx)
 	if(amx->slave == NULL)
 		return 1;
 
-	s = snd_pcm_state(amx->slave);
-	if((s == SND_PCM_STATE_DISCONNECTED) || (s == SND_PCM_STATE_SUSPENDED))
-		return 1;
+	s = snd_pcm_state(amx->slave);
+	if(s == SND_PCM_STATE_DISCONNECTED)
+		return 1;
+
+	return 0;
+}
+
+/**
+ * Check slave PCM has been suspended (e.g. system sleep) and try to resume it
+ * in place.
+ *
+ * @param amx: Amux master
+ * @return: 1 if slave is still suspended, 0 otherwise
+ */
+static int amux_suspended(struct snd_pcm_amux *amx)
+{
+	if(snd_pcm_state(amx->slave) != SND_PCM_STATE_SUSPENDED)
+		return 0;
+
+	/* Resume failure is handled as a regular xrun afterwards */
+	if(amux_slave_resume(amx) != -EAGAIN)
+		return 0;
+
+	return 1;
+}
+
+/**
+ * Switch slave PCM if configuration changed
+ *
+ * @param amx: Amux master
+ * @return: 0 if slave hasn't changed or switch succeed, negative number
+ * otherwise.
+ */
+static int amux_switch(struct snd_pcm_amux *amx)
+{
+	int ret = -1;
+	char card[CARD_NAMESZ];
+	unsigned int gen = 0;
+
+	AMUX_DBG("%s: enter PCM(%p)\n", __func__, &amx->io);
+
+	/*
+	 * In realtime mode file is only read once watcher saw it changing. The
+	 * change is only marked as seen once file has been read, so that a
+	 * locked or unreadable file is retried at next callback.
+	 */
+	if(amx->wfd >= 0) {
+		gen = __atomic_load_n(&amx->swgen, __ATOMIC_ACQUIRE);
+		if(gen == amx->swseen) {
+			ret = 0;
+			goto out;
+		}
+		RT_HOT_LEAVE();
+	}
+
+	lseek(amx->fd, SEEK_SET, 0);
+	ret = flock(amx->fd, LOCK_SH | LOCK_NB);
+	if((ret < 0) && (errno == EWOULDBLOCK)) {
+		ret = 0;
+		goto out;
+	}
+	if(ret < 0)
+		goto out;
+
+	ret = amux_read_pcm(amx, card, sizeof(card));
+	flock(amx->fd, LOCK_UN);
+	if(ret < 0) {
+		AMUX_ERR("%s: Cannot read slave configuration: %s\n",
+				__func__, strerror(errno));
+		goto out;
+	}
+
+	if(amx->wfd >= 0)
+		amx->swseen = gen;
+
+	ret = 0;
+	if(strcmp(card, amx->sname) == 0)
+		goto out;
+
+	AMUX_PROBE2(switch_begin, amx->sname, card);
+	ret = amux_cfg_slave(amx, card);
+	AMUX_PROBE2(switch_end, amx->sname, ret);
+	if(ret == 0)
+		AMUX_STATS_ADD(amx->stats, switches, 1);
+	else
+		AMUX_STATS_ADD(amx->stats, switch_fail, 1);
+out:
+	if(amux_disconnected(amx)) {
+		snd_pcm_ioplug_set_state(&amx->io, SND_PCM_STATE_DISCONNECTED);
+		ret = -ENODEV;
+	} else if(amux_suspended(amx)) {
+		if(amx->io.state != SND_PCM_STATE_SUSPENDED) {
+			amx->suspend_state = amx->io.state;
+			snd_pcm_ioplug_set_state(&amx->io,
+					SND_PCM_STATE_SUSPENDED);
+		}
+		ret = -ESTRPIPE;
+	}
+	return ret;
+}
+
+/**
+ * Callback to configure IO plugin PCM hardware params.
+ *
+ * @param io: IO plugin interface.
+ * @param params: Hardware param to configure plugin with.
+ * @return: 0 on success, negative number otherwise.
+ */
+static int amux_hw_params(struct snd_pcm_ioplug *io,
+		snd_pcm_hw_params_t *params)
+{
+	struct snd_pcm_amux *amx = to_pcm_amux(io);
+
+	AMUX_DBG("%s: enter PCM(%p)\n", __func__, io);
+	AMUX_STATS_ADD(amx->stats, cb[AMUX_STATS_CB_HW_PARAMS], 1);
+	AMUX_TRACE_SCOPE(amx, "hw_params");
+	AMUX_PERF_SCOPE(amx, AMUX_STATS_CB_HW_PARAMS);
+
+	if(amux_check_card(amx) != 0)
+		return -EPIPE;
+
+	return amux_hw_params_refine(amx, params);
+}
+
+/**
+ * Recover slave from an xrun. Instead of restarting on an empty buffer, which
+ * usually leads to another xrun right away, playback slave is prefilled with
+ * silence. Until this silence has been played the hardware pointer is held
+ * still, so that the application sees it as a delay and not as lost frames.
+ *
+ * @param amx: Amux master.
+ * @return: 0 on success, negative number otherwise.
+ */
+static int amux_slave_recover(struct snd_pcm_amux *amx)
+{
+	struct amux_slave_stats *st;
+	snd_pcm_uframes_t pad;
+	snd_pcm_sframes_t ret;
+	int grown = 0;
+
+	RT_HOT_LEAVE();
+
+	AMUX_STATS_ADD(amx->stats, xrun, 1);
+	AMUX_TRACE_INSTANT(amx, "xrun", amux_queued(amx));
+	st = amux_slave_stats(amx);
+	if(st != NULL) {
+		++st->xrun;
+		clock_gettime(CLOCK_MONOTONIC, &st->xrun_ts);
+		/* Raised avail_min may have left too little headroom */
+		amx->avail_min_pending = 0;
+		if(st->avail_min > amx->avail_min) {
+			st->avail_max = st->avail_min - 1;
+			st->avail_min -= MIN(st->avail_min - amx->avail_min,
+					amx->io.period_size / 8 ?
+					amx->io.period_size / 8 : 1);
+			amux_avail_min_set(amx, st->avail_min);
+		}
+		grown = amux_headroom_grow(amx, st);
+	}
+
+	/*
+	 * Slave buffer has to be reconfigured to get the new headroom, which
+	 * reopens it. This is deferred to next prepare or switch instead of
+	 * being done from the callback, prefill is bounded by current slave
+	 * buffer meanwhile.
+	 */
+	if(grown && (amx->stream == SND_PCM_STREAM_PLAYBACK))
+		amx->headroom_stale = 1;
+
+	amx->prefilling = 0;
+	ret = snd_pcm_prepare(amx->slave);
+	if(ret != 0)
+		return ret;
+
+	if(amx->io.state != SND_PCM_STATE_RUNNING)
+		return 0;
+
+	/* Capture slave has to be restarted to get data again */
+	if(amx->stream == SND_PCM_STREAM_CAPTURE)
+		return snd_pcm_start(amx->slave);
+
+	pad = 0;
+	if(amx->sbuffer_size > amx->io.buffer_size)
+		pad = MIN(amux_headroom(amx), amx->sbuffer_size -
+				amx->io.buffer_size);
+	if(pad == 0)
+		return 0;
+
+	ret = amux_silence(amx, pad);
+	if(ret < 0)
+		return ret;
+
+	/* Slave has played everything application wrote */
+	amx->hwmin = amx->sappl;
+	amx->prefilling = 1;
+
+	return snd_pcm_start(amx->slave);
+}
+
+/**
+ * Recover slave from an xrun, see amux_slave_recover().
+ *
+ * @param amx: Amux master.
+ * @return: 0 on success, negative number otherwise.
+ */
+static int amux_recover(struct snd_pcm_amux *amx)
+{
+	int ret;
+
+	AMUX_PROBE2(xrun, amx->sname, amux_queued(amx));
+	ret = amux_slave_recover(amx);
+	AMUX_PROBE2(xrun_recovered, amx->sname, ret);
+
+	return ret;
+}
+
+/**
+ * Get the distance between master application pointer and slave one, in master
+ * buffer positions.
+ *
+ * @param amx: Amux master.
+ * @return: Positive number if master is ahead (i.e. forwarded), negative
+ * number if master is behind (i.e. rewound).
+ */
+static inline snd_pcm_sframes_t amux_appl_diff(struct snd_pcm_amux *amx)
+{
+	snd_pcm_sframes_t diff;
+
+	diff = amx->io.appl_ptr - amx->sappl;
+	if(diff > (snd_pcm_sframes_t)(amx->boundary / 2))
+		diff -= amx->boundary;
+	else if(diff < -(snd_pcm_sframes_t)(amx->boundary / 2))
+		diff += amx->boundary;
+
+	return diff;
+}
+
+/**
+ * Move slave application pointer by a number of frames in master buffer
+ * positions.
+ *
+ * @param amx: Amux master.
+ * @param frames: Number of frames to move slave pointer by.
+ */
+static inline void amux_appl_move(struct snd_pcm_amux *amx,
+		snd_pcm_sframes_t frames)
+{
+	snd_pcm_sframes_t appl = amx->sappl + frames;
+
+	if(appl < 0)
+		appl += amx->boundary;
+	else if((snd_pcm_uframes_t)appl >= amx->boundary)
+		appl -= amx->boundary;
+	amx->sappl = appl;
+}
+
+/**
+ * Apply master rewind or forward on slave. ioplug moves master application
+ * pointer without notifying us, so this is detected by comparing it with the
+ * slave one. Slave is rewound as far as it can, frames that cannot be rewound
+ * are dropped later in the transfer path.
+ *
+ * @param amx: Amux master.
+ */
+static void amux_appl_sync(struct snd_pcm_amux *amx)
+{
+	snd_pcm_sframes_t diff, max, ret = 0;
+
+	diff = amux_appl_diff(amx);
+	if(diff == 0)
+		return;
+
+	if(diff < 0) {
+		max = snd_pcm_rewindable(amx->slave);
+		if(max > 0)
+			ret = snd_pcm_rewind(amx->slave, MIN(-diff, max));
+		if(ret > 0)
+			amux_appl_move(amx, -ret);
+	} else {
+		max = snd_pcm_forwardable(amx->slave);
+		if(max > 0)
+			ret = snd_pcm_forward(amx->slave, MIN(diff, max));
+		if(ret > 0)
+			amux_appl_move(amx, ret);
+	}
+
+	AMUX_DBG("%s: moved slave by %ld/%ld frames\n", __func__,
+			(long)ret, (long)diff);
+}
+
+/**
+ * Get IO plugin's current playback/capture buffer hardware position from
+ * slave one.
+ *
+ * @param io: IO plugin interface.
+ * @return: The hardware buffer positiion in frame, can be negative on error.
+ */
+static snd_pcm_sframes_t amux_slave_pointer(struct snd_pcm_ioplug *io)
+{
+	struct snd_pcm_amux *amx = to_pcm_amux(io);
+	snd_pcm_sframes_t ret, avail;
+	snd_pcm_state_t state;
+	RT_HOT_SECTION(&amx->rt);
+
+	AMUX_DBG("%s: enter PCM(%p)\n", __func__, io);
+	AMUX_STATS_ADD(amx->stats, cb[AMUX_STATS_CB_POINTER], 1);
+	AMUX_TRACE_SCOPE(amx, "pointer");
+	AMUX_PERF_SCOPE(amx, AMUX_STATS_CB_POINTER);
+
+	ret = (snd_pcm_sframes_t)amux_switch(amx);
+	if(ret != 0)
+		return 0;
+
+	/* Rewinds need no slave update while idle */
+	if(amx->idle) {
+		amx->sappl = io->appl_ptr;
+		return amux_idle_hw(amx);
+	}
+
+	state = snd_pcm_state(amx->slave);
+	if(state == SND_PCM_STATE_XRUN) {
+		amux_recover(amx);
+	} else if((state != SND_PCM_STATE_RUNNING) &&
+			(state != SND_PCM_STATE_PAUSED) &&
+			(io->state != SND_PCM_STATE_PAUSED)) {
+		snd_pcm_prepare(amx->slave);
+		/* Capture slave has to be restarted to get data again */
+		if((amx->stream == SND_PCM_STREAM_CAPTURE) &&
+				(io->state == SND_PCM_STATE_RUNNING))
+			snd_pcm_start(amx->slave);
+	}
+
+	amux_appl_sync(amx);
+
+	avail = snd_pcm_avail_update(amx->slave);
+	if(amx->stream == SND_PCM_STREAM_PLAYBACK) {
+		if((snd_pcm_uframes_t)avail > amx->sbuffer_size)
+			avail = amx->sbuffer_size;
+	} else if((snd_pcm_uframes_t)avail > io->buffer_size) {
+		avail = io->buffer_size;
+	}
+	AMUX_PROBE2(pointer_avail, amx->sname, avail);
+
+	/*
+	 * For playback avail is free space so hardware pointer is behind
+	 * application one, for capture avail is captured data so hardware
+	 * pointer is ahead. Slave application pointer is used so that
+	 * hardware one does not jump on master rewind or forward.
+	 */
+	if(amx->stream == SND_PCM_STREAM_PLAYBACK)
+		ret = avail + amx->sappl - amx->sbuffer_size;
+	else
+		ret = amx->sappl + avail;
+	if(ret < 0)
+		ret += amx->boundary;
+	else if((snd_pcm_uframes_t)ret >= amx->boundary)
+		ret -= amx->boundary;
+
+	/* Hold hardware pointer while xrun prefilled silence is played */
+	if(amx->prefilling) {
+		avail = ret - amx->hwmin;
+		if(avail < -(snd_pcm_sframes_t)(amx->boundary / 2))
+			avail += amx->boundary;
+		else if(avail > (snd_pcm_sframes_t)(amx->boundary / 2))
+			avail -= amx->boundary;
+		if(avail < 0)
+			ret = amx->hwmin;
+		else
+			amx->prefilling = 0;
+	}
 
-	return 0;
+	AMUX_TRACE_FRAMES(ret);
+	return ret;
 }
 
 /**
- * Switch slave PCM if configuration changed
+ * Callback to get IO plugin's current playback/capture buffer hardware
+ * position.
  *
- * @param amx: Amux master
- * @return: 0 if slave hasn't changed or switch succeed, negative number
- * otherwise.
+ * @param io: IO plugin interface.
+ * @return: The hardware buffer positiion in frame, can be negative on error.
  */
-static int amux_switch(struct snd_pcm_amux *amx)
+static snd_pcm_sframes_t amux_pointer(struct snd_pcm_ioplug *io)
 {
-	int ret = -1;
-	char card[CARD_NAMESZ];
-
-	AMUX_DBG("%s: enter PCM(%p)\n", __func__, &amx->io);
-
-	lseek(amx->fd, SEEK_SET, 0);
-	ret = flock(amx->fd, LOCK_SH | LOCK_NB);
-	if((ret < 0) && (errno == EWOULDBLOCK)) {
-		ret = 0;
-		goto out;
-	}
-	if(ret < 0)
-		goto out;
-
-	ret = amux_read_pcm(amx, card, sizeof(card));
-	flock(amx->fd, LOCK_UN);
-	if(ret < 0) {
-		perror("Cannot read");
-		goto out;
-	}
+	struct snd_pcm_amux *amx = to_pcm_amux(io);
+	snd_pcm_sframes_t ret;
 
-	ret = 0;
-	if(strcmp(card, amx->sname) == 0)
-		goto out;
+	AMUX_PROBE1(pointer_entry, amx->sname);
+	ret = amux_slave_pointer(io);
+	AMUX_PROBE2(pointer_return, amx->sname, ret);
 
-	ret = amux_cfg_slave(amx, card);
-out:
-	if(amux_disconnected(amx)) {
-		snd_pcm_ioplug_set_state(&amx->io, SND_PCM_STATE_DISCONNECTED);
-		ret = -ENODEV;
-	}
 	return ret;
 }
 
 /**
- * Callback to configure IO plugin PCM hardware params.
+ * Drain callback of IO plugin PCM. Wait for the slave to play all pending
+ * frames, sleeping at most a period at a time so that a slave switch requested
+ * meanwhile is honored (remaining frames are then played as silence on the new
+ * slave).
  *
- * @param io: IO plugin interface.
- * @param params: Hardware param to configure plugin with.
- * @return: 0 on success, negative number otherwise.
+ * @param io: The IO plugin interface to drain.
+ * @return: 0 on success, -EAGAIN if not drained yet in non-blocking mode,
+ * negative number otherwise.
  */
-static int amux_hw_params(struct snd_pcm_ioplug *io,
-		snd_pcm_hw_params_t *params)
+static int amux_drain(struct snd_pcm_ioplug *io)
 {
 	struct snd_pcm_amux *amx = to_pcm_amux(io);
+	snd_pcm_sframes_t delay;
+	snd_pcm_state_t state;
+	int ret, tmo;
 
 	AMUX_DBG("%s: enter PCM(%p)\n", __func__, io);
+	AMUX_STATS_ADD(amx->stats, cb[AMUX_STATS_CB_DRAIN], 1);
+	AMUX_TRACE_SCOPE(amx, "drain");
+	AMUX_PERF_SCOPE(amx, AMUX_STATS_CB_DRAIN);
 
-	if(amux_check_card(amx) != 0)
-		return -EPIPE;
+	if(amx->stream == SND_PCM_STREAM_CAPTURE)
+		return 0;
 
-	return amux_hw_params_refine(amx, params);
+	for(;;) {
+		ret = amux_switch(amx);
+		if(ret != 0)
+			return ret;
+
+		state = snd_pcm_state(amx->slave);
+		if((state != SND_PCM_STATE_RUNNING) &&
+				(state != SND_PCM_STATE_PREPARED))
+			break;
+
+		ret = snd_pcm_delay(amx->slave, &delay);
+		if((ret < 0) || (delay <= 0))
+			break;
+
+		/* Few frames below start threshold or new slave after switch */
+		if(state == SND_PCM_STATE_PREPARED)
+			snd_pcm_start(amx->slave);
+
+		if(io->nonblock)
+			return -EAGAIN;
+
+		delay = MIN(delay, (snd_pcm_sframes_t)io->period_size);
+		tmo = (delay * 1000 + io->rate - 1) / io->rate;
+		poll(NULL, 0, tmo);
+	}
+
+	return 0;
 }
 
 /**
- * Callback to get IO plugin's current playback/capture buffer hardware
- * position.
+ * Callback to get IO plugin PCM delay. The slave delay is forwarded so that
+ * slave hardware and plugin latencies (e.g. bluetooth or USB) are accounted
+ * for.
  *
  * @param io: IO plugin interface.
- * @return: The hardware buffer positiion in frame, can be negative on error.
+ * @param delayp: Filled with delay in frames.
+ * @return: 0 on success, negative number otherwise.
  */
-static snd_pcm_sframes_t amux_pointer(struct snd_pcm_ioplug *io)
+static int amux_delay(snd_pcm_ioplug_t *io, snd_pcm_sframes_t *delayp)
 {
 	struct snd_pcm_amux *amx = to_pcm_amux(io);
-	snd_pcm_sframes_t ret, avail;
+	snd_pcm_sframes_t delay;
+	int ret;
 
 	AMUX_DBG("%s: enter PCM(%p)\n", __func__, io);
+	AMUX_STATS_ADD(amx->stats, cb[AMUX_STATS_CB_DELAY], 1);
+	AMUX_TRACE_SCOPE(amx, "delay");
+	AMUX_PERF_SCOPE(amx, AMUX_STATS_CB_DELAY);
 
-	ret = (snd_pcm_sframes_t)amux_switch(amx);
-	if(ret != 0)
-		return 0;
+	if(amx->slave == NULL)
+		return -ENODEV;
 
-	if(snd_pcm_state(amx->slave) != SND_PCM_STATE_RUNNING)
-		snd_pcm_prepare(amx->slave);
+	if(amx->idle) {
+		*delayp = (snd_pcm_sframes_t)amux_queued(amx);
+		return 0;
+	}
 
-	avail = snd_pcm_avail_update(amx->slave);
-	if((snd_pcm_uframes_t)avail > io->buffer_size)
-		avail = io->buffer_size;
+	ret = snd_pcm_delay(amx->slave, &delay);
+	if(ret == -EPIPE)
+		return ret;
 
-	ret = avail + io->appl_ptr - io->buffer_size;
+	/* Slave cannot report delay (e.g. not started yet), use our buffer */
 	if(ret < 0)
-		ret += amx->boundary;
-	else if((snd_pcm_uframes_t)ret >= amx->boundary)
-		ret -= amx->boundary;
+		delay = (snd_pcm_sframes_t)amux_queued(amx);
 
-	return ret;
+	*delayp = delay;
+	AMUX_TRACE_FRAMES(delay);
+	return 0;
 }
 
 /**
@@ -713,6 +2637,7 @@ static int amux_poll_descriptors_count(snd_pcm_ioplug_t *io)
 	int ret;
 
 	AMUX_DBG("%s: enter PCM(%p)\n", __func__, io);
+	AMUX_TRACE_SCOPE(amx, "poll_descriptors_count");
 
 	ret = poller_descriptors_count(amx->poller);
 	/*
@@ -738,6 +2663,7 @@ static int amux_poll_descriptors(snd_pcm_ioplug_t *io, struct pollfd *pfds,
 	int ret;
 
 	AMUX_DBG("%s: enter PCM(%p)\n", __func__, io);
+	AMUX_TRACE_SCOPE(amx, "poll_descriptors");
 
 	ret = amux_switch(amx);
 	if(ret != 0) {
@@ -746,12 +2672,13 @@ static int amux_poll_descriptors(snd_pcm_ioplug_t *io, struct pollfd *pfds,
 	}
 
 	state = snd_pcm_state(amx->slave);
-	if(state == SND_PCM_STATE_XRUN ||
-			state == SND_PCM_STATE_PREPARED) {
-		/*
-		 * Try to recover an xrun, some programs poll before PCM is
-		 * actually started
-		 */
+	if(amx->idle || state == SND_PCM_STATE_PAUSED ||
+			io->state == SND_PCM_STATE_PAUSED) {
+		/* Nothing to do, poller will report slave readiness */
+	} else if(state == SND_PCM_STATE_XRUN) {
+		amux_recover(amx);
+	} else if(state == SND_PCM_STATE_PREPARED) {
+		/* Some programs poll before PCM is actually started */
 		snd_pcm_prepare(amx->slave);
 		snd_pcm_start(amx->slave);
 	} else if (state != SND_PCM_STATE_RUNNING) {
@@ -769,7 +2696,7 @@ static int amux_poll_descriptors(snd_pcm_ioplug_t *io, struct pollfd *pfds,
 }
 
 /**
- * Callback to handle IO plugin poll descriptors events.
+ * Handle IO plugin poll descriptors events through poller.
  *
  * @param io: IO plugin interface.
  * @param pfds: Poll descriptor array.
@@ -778,13 +2705,17 @@ static int amux_poll_descriptors(snd_pcm_ioplug_t *io, struct pollfd *pfds,
  * @return: 0 on success with revents filled up with appropriate events,
  * negative number otherwise.
  */
-static int amux_poll_revents(snd_pcm_ioplug_t *io, struct pollfd *pfds,
+static int amux_slave_poll_revents(snd_pcm_ioplug_t *io, struct pollfd *pfds,
 		unsigned int nfds, unsigned short *revents)
 {
 	struct snd_pcm_amux *amx = to_pcm_amux(io);
 	int ret;
+	RT_HOT_SECTION(&amx->rt);
 
 	AMUX_DBG("%s: enter PCM(%p)\n", __func__, io);
+	AMUX_STATS_ADD(amx->stats, cb[AMUX_STATS_CB_POLL_REVENTS], 1);
+	AMUX_TRACE_SCOPE(amx, "poll_revents");
+	AMUX_PERF_SCOPE(amx, AMUX_STATS_CB_POLL_REVENTS);
 
 	ret = amux_switch(amx);
 	if(ret != 0) {
@@ -800,7 +2731,51 @@ static int amux_poll_revents(snd_pcm_ioplug_t *io, struct pollfd *pfds,
 }
 
 /**
- * Callback for IO plugin transfer data.
+ * Callback to handle IO plugin poll descriptors events.
+ *
+ * @param io: IO plugin interface.
+ * @param pfds: Poll descriptor array.
+ * @param nfds: Poll descriptor array size.
+ * @param revents: Resulting poll events
+ * @return: 0 on success with revents filled up with appropriate events,
+ * negative number otherwise.
+ */
+static int amux_poll_revents(snd_pcm_ioplug_t *io, struct pollfd *pfds,
+		unsigned int nfds, unsigned short *revents)
+{
+	struct snd_pcm_amux *amx = to_pcm_amux(io);
+	int ret;
+
+	AMUX_PROBE2(poll_revents_entry, amx->sname, nfds);
+	ret = amux_slave_poll_revents(io, pfds, nfds, revents);
+	AMUX_PROBE3(poll_revents_return, amx->sname, ret,
+			(ret == 0) ? *revents : 0);
+
+	return ret;
+}
+
+/**
+ * Transfer silent frames while slave is idle, they are only accounted for the
+ * virtual clock.
+ *
+ * @param amx: Amux master.
+ * @param size: Number of frames to transfer.
+ * @return: Number of transferred frames.
+ */
+static snd_pcm_sframes_t amux_idle_transfer(struct snd_pcm_amux *amx,
+		snd_pcm_uframes_t size)
+{
+	amx->sappl = amx->io.appl_ptr;
+	amux_appl_move(amx, size);
+	amux_idle_arm(amx);
+	poller_transfer(amx->poller);
+	AMUX_STATS_ADD(amx->stats, frames, size);
+
+	return size;
+}
+
+/**
+ * Transfer data between IO plugin and slave.
  *
  * @param io: IO plugin interface.
  * @param areas: Channel frames
@@ -808,7 +2783,7 @@ static int amux_poll_revents(snd_pcm_ioplug_t *io, struct pollfd *pfds,
  * @param size: size of data to transfer
  * @return: the number of transferred frames, can be negative on error.
  */
-static snd_pcm_sframes_t amux_transfer(struct snd_pcm_ioplug *io,
+static snd_pcm_sframes_t amux_slave_transfer(struct snd_pcm_ioplug *io,
 		snd_pcm_channel_area_t const *areas,
 		snd_pcm_uframes_t offset, snd_pcm_uframes_t size)
 {
@@ -816,17 +2791,50 @@ static snd_pcm_sframes_t amux_transfer(struct snd_pcm_ioplug *io,
 	snd_pcm_channel_area_t const *sareas;
 	snd_pcm_uframes_t xfer = 0, soffset;
 	snd_pcm_uframes_t ssize = size;
-	snd_pcm_sframes_t ret, tmp;
+	snd_pcm_sframes_t ret, tmp, skip;
+	struct amux_perf_scope copy;
+	struct amux_slave_stats *st;
 	snd_pcm_state_t state;
+	int silent;
+	RT_HOT_SECTION(&amx->rt);
 
 	AMUX_DBG("%s: enter PCM(%p)\n", __func__, io);
+	AMUX_STATS_ADD(amx->stats, cb[AMUX_STATS_CB_TRANSFER], 1);
+	AMUX_TRACE_SCOPE(amx, "transfer");
+	AMUX_PERF_SCOPE(amx, AMUX_STATS_CB_TRANSFER);
+	AMUX_TRACE_FRAMES(size);
+	AMUX_PERF_FRAMES(size);
 
 	ret = (snd_pcm_sframes_t)amux_switch(amx);
 	if(ret != 0)
 		return ret;
 
+	amux_avail_min_commit(amx);
+	amux_gain_update(amx, 0);
+
+	if(amx->idle_timeout) {
+		silent = dsp_silent(areas, offset, io->channels, io->format,
+				size);
+		if(amx->idle) {
+			if(silent)
+				return amux_idle_transfer(amx, size);
+			amux_idle_leave(amx, 1);
+		}
+		amx->idle_frames = silent ? amx->idle_frames + size : 0;
+	}
+
+	/* Frames slave has already been given (or lost) after a rewind */
+	amux_appl_sync(amx);
+	skip = -amux_appl_diff(amx);
+	if(skip < 0)
+		skip = 0;
+	else if(skip > (snd_pcm_sframes_t)size)
+		skip = size;
+
 	/* Check buffers integrity */
-	if(amx->asound_kludge) {
+	if(amx->stream == SND_PCM_STREAM_CAPTURE) {
+		tmp = 0;
+	} else if(amx->asound_kludge) {
 		tmp = amx->io.appl_ptr - amx->io.hw_ptr;
 		if(tmp < 0)
 			tmp += amx->boundary;
@@ -835,6 +2843,8 @@ static snd_pcm_sframes_t amux_transfer(struct snd_pcm_ioplug *io,
 		tmp = snd_pcm_avail(amx->io.pcm);
 	}
 	ret = snd_pcm_avail_update(amx->slave);
+	if(ret >= 0)
+		ret += skip;
 	if(ret < tmp) {
 		AMUX_ERR("%s: Our buffer is not synchronized with the slave "
 				"one, something bad happened "
@@ -842,16 +2852,32 @@ static snd_pcm_sframes_t amux_transfer(struct snd_pcm_ioplug *io,
 				(long)ret, (long)tmp);
 		return -EPIPE;
 	} else if(ret < (snd_pcm_sframes_t)size) {
-		AMUX_ERR("%s: Write size is bigger than available "
+		AMUX_ERR("%s: Transfer size is bigger than available "
 				"buffer size (%lu/%lu)\n", __func__,
 				(unsigned long)ret, (unsigned long)size);
 		return -EPIPE;
 	}
 
+	if(skip != 0) {
+		if(amx->stream == SND_PCM_STREAM_CAPTURE)
+			snd_pcm_areas_silence(areas, offset, io->channels,
+					skip, io->format);
+		offset += skip;
+		xfer = skip;
+		ssize = size - xfer;
+	}
+
+	/* Read or write directly from or to the slave mmap area */
+	ret = 0;
+	copy = amux_perf_enter(amx->stats, amx->perf, AMUX_STATS_PERF_COPY);
 	while(size > xfer) {
 		snd_pcm_mmap_begin(amx->slave, &sareas, &soffset, &ssize);
-		snd_pcm_areas_copy(sareas, soffset, areas, offset,
-				io->channels, ssize, io->format);
+		if(amx->stream == SND_PCM_STREAM_PLAYBACK)
+			dsp_process(&amx->dsp, sareas, soffset, areas, offset,
+					ssize);
+		else
+			dsp_process(&amx->dsp, areas, offset, sareas, soffset,
+					ssize);
 		ret = snd_pcm_mmap_commit(amx->slave, soffset, ssize);
 		if(ret < 0)
 			break;
@@ -859,6 +2885,8 @@ static snd_pcm_sframes_t amux_transfer(struct snd_pcm_ioplug *io,
 		xfer += ret;
 		ssize = size - xfer;
 	}
+	copy.frames = xfer - skip;
+	amux_perf_exit(&copy);
 
 	state = snd_pcm_state(amx->slave);
 	/* Start slave if not started */
@@ -867,14 +2895,107 @@ static snd_pcm_sframes_t amux_transfer(struct snd_pcm_ioplug *io,
 	else if(state != SND_PCM_STATE_RUNNING)
 		return -EINVAL;
 
+	amux_appl_move(amx, xfer - skip);
 	poller_transfer(amx->poller);
 
-	if(ret > 0)
+	if(amx->idle_timeout && (amx->idle_frames >=
+				(snd_pcm_uframes_t)amx->idle_timeout * io->rate) &&
+			(amux_idle_enter(amx) == 0)) {
+		st = amux_slave_stats(amx);
+		if(st != NULL)
+			++st->idle;
+	}
+
+	if(ret >= 0)
 		ret = xfer;
 
+	AMUX_STATS_ADD(amx->stats, frames, xfer - skip);
+	AMUX_STATS_SET(amx->stats, fill, amux_queued(amx));
+	AMUX_TRACE_COUNTER(amx, "fill", amux_queued(amx));
+
+	return ret;
+}
+
+/**
+ * Callback for IO plugin transfer data.
+ *
+ * @param io: IO plugin interface.
+ * @param areas: Channel frames
+ * @param offset: offset of data in channel frames
+ * @param size: size of data to transfer
+ * @return: the number of transferred frames, can be negative on error.
+ */
+static snd_pcm_sframes_t amux_transfer(struct snd_pcm_ioplug *io,
+		snd_pcm_channel_area_t const *areas,
+		snd_pcm_uframes_t offset, snd_pcm_uframes_t size)
+{
+	struct snd_pcm_amux *amx = to_pcm_amux(io);
+	snd_pcm_sframes_t ret;
+
+	AMUX_PROBE2(transfer_entry, amx->sname, size);
+	ret = amux_slave_transfer(io, areas, offset, size);
+	AMUX_PROBE3(transfer_return, amx->sname, ret, amux_queued(amx));
+
 	return ret;
 }
 
+/**
+ * Dump per-slave statistics.
+ *
+ * @param amx: Amux master.
+ * @param out: Output interface to write into.
+ */
+static void amux_dump_stats(struct snd_pcm_amux *amx, snd_output_t *out)
+{
+	static char const * const phname[] = AMUX_SWITCH_PH_NAMES;
+	struct amux_stats_switch rec;
+	struct amux_slave_stats *st;
+	struct timespec now;
+	double dur;
+	size_t i, j;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	snd_output_printf(out, "Slaves statistics:\n");
+	for(i = 0; i < amx->sstatsnr; ++i) {
+		st = &amx->sstats[i];
+		dur = (now.tv_sec - st->first_ts.tv_sec) +
+			(now.tv_nsec - st->first_ts.tv_nsec) / 1e9;
+		snd_output_printf(out, "  %s: xrun %lu (last at %ld.%09ld)\n",
+				st->sname, st->xrun, (long)st->xrun_ts.tv_sec,
+				(long)st->xrun_ts.tv_nsec);
+		snd_output_printf(out, "    wakeup %lu (spurious %lu), "
+				"avail_min %lu, headroom %lu\n", st->wakeup,
+				st->spurious,
+				(unsigned long)(st->avail_min ? st->avail_min :
+					amx->avail_min),
+				(unsigned long)st->headroom);
+		snd_output_printf(out, "    idle %lu\n", st->idle);
+		if((st->first_ts.tv_sec != 0) && (dur > 0))
+			snd_output_printf(out, "    %.2f wakeups/s\n",
+					st->wakeup / dur);
+		snd_output_printf(out, "    switch (max %luus) ms:",
+				st->switch_max);
+		for(j = 0; j < SWITCH_HIST_NR; ++j)
+			snd_output_printf(out, " %s%u:%lu",
+					(j == SWITCH_HIST_NR - 1) ? ">=" : "<",
+					1U << ((j == SWITCH_HIST_NR - 1) ?
+						j - 1 : j),
+					st->switch_hist[j]);
+		snd_output_printf(out, "\n");
+	}
+
+	snd_output_printf(out, "Last switches:\n");
+	for(i = 0; amux_stats_switch_get(amx->stats, i, &rec) == 0; ++i) {
+		snd_output_printf(out, "  %s: %s", rec.sname,
+				(rec.result == 0) ? "ok" :
+				snd_strerror(rec.result));
+		for(j = 0; j < AMUX_SWITCH_PH_NR; ++j)
+			snd_output_printf(out, ", %s %uus", phname[j],
+					rec.us[j]);
+		snd_output_printf(out, "\n");
+	}
+}
+
 /**
  * Callback to dump IO plugin PCM param informations.
  *
@@ -890,6 +3011,10 @@ static void amux_dump(snd_pcm_ioplug_t *io, snd_output_t *out)
 	snd_pcm_dump_setup(io->pcm, out);
 	snd_output_printf(out, "Slave: ");
 	snd_pcm_dump(amx->slave, out);
+	amux_dump_stats(amx, out);
+	snd_output_printf(out, "Arena: %lu/%lu bytes used at most\n",
+			(unsigned long)amx->arena.peak,
+			(unsigned long)amx->arena.size);
 }
 
 /**
@@ -974,6 +3099,50 @@ SND_DLSYM_BUILD_VERSION(amux_dev_arg_or_empty,
 		SND_CONFIG_DLSYM_VERSION_EVALUATE);
 
 
+/**
+ * Make client use the largest buffer slave can have, so that wakeups are as
+ * rare as possible. Constraint is in bytes so the smallest frame slave supports
+ * is used, clients with bigger frames end up with a slightly smaller buffer.
+ *
+ * @param amx: Amux master IO plugin
+ * @return: 0 on success, negative number otherwise
+ */
+static int amux_set_powersave_constraints(struct snd_pcm_amux *amx)
+{
+	snd_pcm_hw_params_t *shw;
+	snd_pcm_format_mask_t *fmsk;
+	snd_pcm_uframes_t bsz;
+	unsigned int ch;
+	int fmt, width, wmin = 0, ret;
+
+	snd_pcm_hw_params_alloca(&shw);
+	snd_pcm_format_mask_alloca(&fmsk);
+
+	ret = snd_pcm_hw_params_any(amx->slave, shw);
+	if(ret < 0)
+		return ret;
+
+	snd_pcm_hw_params_get_buffer_size_max(shw, &bsz);
+	snd_pcm_hw_params_get_channels_min(shw, &ch);
+	snd_pcm_hw_params_get_format_mask(shw, fmsk);
+	for(fmt = 0; fmt <= SND_PCM_FORMAT_LAST; ++fmt) {
+		if(!snd_pcm_format_mask_test(fmsk, fmt))
+			continue;
+		width = snd_pcm_format_physical_width(fmt);
+		if((width > 0) && ((wmin == 0) || (width < wmin)))
+			wmin = width;
+	}
+	if((wmin == 0) || (ch == 0))
+		return -EINVAL;
+
+	bsz = bsz * ch * wmin / 8;
+	if(bsz > UINT_MAX / 2)
+		bsz = UINT_MAX / 2;
+
+	return snd_pcm_ioplug_set_param_minmax(&amx->io,
+			SND_PCM_IOPLUG_HW_BUFFER_BYTES, bsz, UINT_MAX / 2);
+}
+
 /**
  * Amux IO plugin callbacks
  */
@@ -983,10 +3152,15 @@ static struct snd_pcm_ioplug_callback amux_ops = {
 	.stop = amux_stop,
 	.hw_params = amux_hw_params,
 	.sw_params = amux_sw_params,
+	.get_chmap = amux_get_chmap,
 	.set_chmap = amux_set_chmap,
 	.query_chmaps = amux_query_chmaps,
 	.prepare = amux_prepare,
+	.drain = amux_drain,
+	.pause = amux_pause,
+	.resume = amux_resume,
 	.pointer = amux_pointer,
+	.delay = amux_delay,
 	.transfer = amux_transfer,
 	.poll_revents = amux_poll_revents,
 	.poll_descriptors_count = amux_poll_descriptors_count,
@@ -1001,8 +3175,10 @@ SND_PCM_PLUGIN_DEFINE_FUNC(amux) {
 	struct snd_pcm_amux *amx;
 	char const *pname = NULL, *fpath = NULL;
 	char const *poller_name = POLLER_DEFAULT;
+	snd_config_t *log_conf = NULL, *trace_conf = NULL;
 	snd_config_iterator_t i, next;
 	unsigned noresample_ignore = 1;
+	unsigned stats = 1;
 	int ret = -ENOMEM;
 
 	(void)root;
@@ -1041,6 +3217,87 @@ SND_PCM_PLUGIN_DEFINE_FUNC(amux) {
 			poller_name = pname;
 			continue;
 		}
+		if(strcmp(id, "gain") == 0) {
+			ret = amux_gain_parse(amx, cfg);
+			if(ret < 0)
+				goto out;
+			continue;
+		}
+		if(strcmp(id, "prefill") == 0) {
+			long val;
+			ret = snd_config_get_integer(cfg, &val);
+			if((ret < 0) || (val < 0)) {
+				SNDERR("Invalid value for prefill");
+				ret = -EINVAL;
+				goto out;
+			}
+			amx->prefill = val;
+			continue;
+		}
+		if(strcmp(id, "idle") == 0) {
+			long val;
+			ret = snd_config_get_integer(cfg, &val);
+			if((ret < 0) || (val < 0)) {
+				SNDERR("Invalid value for idle");
+				ret = -EINVAL;
+				goto out;
+			}
+			amx->idle_timeout = val;
+			continue;
+		}
+		if(strcmp(id, "log") == 0) {
+			log_conf = cfg;
+			continue;
+		}
+		if(strcmp(id, "trace") == 0) {
+			trace_conf = cfg;
+			continue;
+		}
+		if(strcmp(id, "realtime") == 0) {
+			ret = amux_rt_parse(amx, cfg);
+			if(ret < 0)
+				goto out;
+			continue;
+		}
+		if(strcmp(id, "powersave") == 0) {
+			ret = amux_powersave_parse(amx, cfg);
+			if(ret < 0)
+				goto out;
+			continue;
+		}
+		if(strcmp(id, "adaptive") == 0) {
+			ret = amux_adapt_parse(amx, cfg);
+			if(ret < 0)
+				goto out;
+			continue;
+		}
+		if(strcmp(id, "dither") == 0) {
+			ret = snd_config_get_bool(cfg);
+			if(ret < 0) {
+				SNDERR("Invalid value for dither");
+				goto out;
+			}
+			amx->dither = ret;
+			continue;
+		}
+		if(strcmp(id, "perf") == 0) {
+			ret = snd_config_get_bool(cfg);
+			if(ret < 0) {
+				SNDERR("Invalid value for perf");
+				goto out;
+			}
+			amx->perf = ret;
+			continue;
+		}
+		if(strcmp(id, "stats") == 0) {
+			ret = snd_config_get_bool(cfg);
+			if(ret < 0) {
+				SNDERR("Invalid value for stats");
+				goto out;
+			}
+			stats = ret;
+			continue;
+		}
 		if(strcmp(id, "noresample_ignore") == 0) {
 			ret = snd_config_get_bool(cfg);
 			if(ret < 0) {
@@ -1061,16 +3318,68 @@ SND_PCM_PLUGIN_DEFINE_FUNC(amux) {
 		goto out;
 	}
 
+	ret = amux_log_parse(amx, log_conf);
+	if(ret < 0)
+		goto out;
+
+	if(trace_conf != NULL) {
+		ret = amux_trace_parse(amx, trace_conf);
+		if(ret < 0)
+			goto out;
+	}
+
+	rt_mlock(&amx->rt, amx, sizeof(*amx));
+
+	ret = amux_arena_init(&amx->arena, amux_arena_size());
+	if(ret < 0)
+		goto out;
+	rt_mlock(&amx->rt, amx->arena.base, amx->arena.size);
+	amx->swp = amux_arena_alloc(&amx->arena, snd_pcm_sw_params_sizeof());
+	AMUX_ASSERT(amx->swp != NULL);
+
+	if(stats)
+		amux_stats_publish(amx, name, stream);
+	amx->stats->perf_enabled = amx->perf;
+
+	if(amx->adapt_file) {
+		ret = amux_adapt_load(amx);
+		if(ret < 0)
+			AMUX_ERR("Cannot load %s\n", amx->adapt_file);
+	}
+
 	ret = amux_poller_init(amx, poller_name);
 	if(ret < 0)
 		goto out;
 
+	/* Idle slave cannot be detected when capturing */
+	if(stream == SND_PCM_STREAM_CAPTURE)
+		amx->idle_timeout = 0;
+	if(amx->idle_timeout && !poller_can_idle(amx->poller)) {
+		AMUX_WARN("Poller cannot be used with idle slave, idle "
+				"detection disabled\n");
+		amx->idle_timeout = 0;
+	}
+	if(amx->idle_timeout) {
+		amx->idle_fd = timerfd_create(CLOCK_MONOTONIC,
+				TFD_NONBLOCK | TFD_CLOEXEC);
+		if(amx->idle_fd < 0) {
+			ret = -errno;
+			goto out;
+		}
+	}
+
 	ret = open(fpath, O_RDONLY | O_CREAT, S_IRUSR | S_IWUSR);
 	if(ret < 0)
 		goto out;
 
 	amx->fd = ret;
 
+	if(amx->rt.enabled) {
+		ret = amux_watch_start(amx, fpath);
+		if(ret < 0)
+			goto out;
+	}
+
 	/* Get configured card */
 	flock(amx->fd, LOCK_SH);
 	ret = amux_read_pcm(amx, amx->sname, sizeof(amx->sname));
@@ -1091,14 +3400,28 @@ SND_PCM_PLUGIN_DEFINE_FUNC(amux) {
 	if(ret != 0)
 		goto out;
 
+	amux_gain_preset(amx);
+	amux_stats_set_slave(amx->stats, amx->sname);
+	AMUX_TRACE_SLAVE_SET(amx, amux_trace_slave(amx->sname));
+
 	amx->io.version = SND_PCM_IOPLUG_VERSION;
 	amx->io.name = "Amux live PCM card multiplexer plugin";
 	amx->io.callback = &amux_ops;
 	amx->stream = stream;
 	amx->mode = mode;
 	amx->io.poll_fd = -1;
-	amx->io.poll_events = POLLOUT;
+	amx->io.poll_events = (stream == SND_PCM_STREAM_PLAYBACK) ? POLLOUT :
+		POLLIN;
 	amx->io.flags = SND_PCM_IOPLUG_FLAG_MONOTONIC;
+	/*
+	 * MMAP clients write into the ioplug buffer which is copied into the
+	 * slave one at each mmap commit through amux_transfer(), this is the
+	 * only copy done. The slave mmap area cannot be exposed directly to the
+	 * client as it changes with each slave switch. Enabling mmap_rw would
+	 * make RW clients write into the ioplug buffer first, thus adding a
+	 * copy.
+	 */
+	amx->io.mmap_rw = 0;
 	amx->noresample_ignore = noresample_ignore;
 	ret = snd_pcm_ioplug_create(&amx->io, name, stream, amx->mode);
 	if(ret != 0)
@@ -1110,6 +3433,9 @@ SND_PCM_PLUGIN_DEFINE_FUNC(amux) {
 
 	*pcmp = amx->io.pcm;
 
+	if(amx->powersave)
+		amux_set_powersave_constraints(amx);
+
 	/* Configure plugin for no resampling */
 	if(mode & SND_PCM_NO_AUTO_RESAMPLE) {
 		snd_pcm_hw_params_t *shw;
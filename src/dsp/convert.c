@@ -0,0 +1,255 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <alsa/asoundlib.h>
+#include <alsa/pcm_external.h>
+
+#include "amux.h"
+#include "dsp/dsp.h"
+
+#define DSP_S16_SCALE 32768.0f
+#define DSP_S24_SCALE 8388608.0f
+#define DSP_S32_SCALE 2147483648.0f
+/* Biggest float that fits in a int32_t */
+#define DSP_S32_MAX 2147483520.0f
+
+/**
+ * Load loop, fast path for contiguous samples
+ */
+#define DSP_LOAD_LOOP(type, conv) do {					\
+	char const *__s = (char const *)src;				\
+	size_t __i;							\
+	if((dstep == 1) && (sstep == sizeof(type))) {			\
+		type const *__in = (type const *)src;			\
+		for(__i = 0; __i < n; ++__i)				\
+			dst[__i] = conv(__in[__i]);			\
+		break;							\
+	}								\
+	for(__i = 0; __i < n; ++__i, __s += sstep)			\
+		dst[__i * dstep] = conv(*(type const *)__s);		\
+} while(0)
+
+/**
+ * Store loop, fast path for contiguous samples
+ */
+#define DSP_STORE_LOOP(type, conv) do {					\
+	char *__d = (char *)dst;					\
+	size_t __i;							\
+	if((sstep == 1) && (dstep == sizeof(type))) {			\
+		type *__out = (type *)dst;				\
+		for(__i = 0; __i < n; ++__i)				\
+			__out[__i] = conv(src[__i]);			\
+		break;							\
+	}								\
+	for(__i = 0; __i < n; ++__i, __d += dstep)			\
+		*(type *)__d = conv(src[__i * sstep]);			\
+} while(0)
+
+/**
+ * Scale, round and saturate a float sample to integer
+ *
+ * @param x: Float sample in [-1.0, 1.0[ range
+ * @param scale: Integer format full scale
+ * @param min: Integer format min value
+ * @param max: Integer format max value
+ * @return: Integer sample
+ */
+static inline int32_t dsp_ftoi(float x, float scale, float min, float max)
+{
+	x *= scale;
+	x += (x < 0.0f) ? -0.5f : 0.5f;
+	if(x > max)
+		x = max;
+	else if(x < min)
+		x = min;
+	return (int32_t)x;
+}
+
+/**
+ * Generate one uniform random value in [-0.5, 0.5[ (xorshift32)
+ *
+ * @param seed: Generator state
+ * @return: Random value
+ */
+static inline float dsp_rand(uint32_t *seed)
+{
+	uint32_t x = *seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*seed = x;
+	return (float)(int32_t)x * (0.5f / DSP_S32_SCALE);
+}
+
+/**
+ * Triangular probability density function dither noise, in LSB unit
+ *
+ * @param seed: Generator state
+ * @return: Dither noise
+ */
+static inline float dsp_tpdf(uint32_t *seed)
+{
+	return dsp_rand(seed) + dsp_rand(seed);
+}
+
+#define S16_TO_F(x) ((float)(x) * (1.0f / DSP_S16_SCALE))
+#define S24_TO_F(x)							\
+	((float)((int32_t)((uint32_t)(x) << 8) >> 8) * (1.0f / DSP_S24_SCALE))
+#define S32_TO_F(x) ((float)(x) * (1.0f / DSP_S32_SCALE))
+#define F_TO_F(x) (x)
+#define F_TO_S16(x)							\
+	((int16_t)dsp_ftoi((x), DSP_S16_SCALE, -32768.0f, 32767.0f))
+#define F_TO_S24(x)							\
+	(dsp_ftoi((x), DSP_S24_SCALE, -8388608.0f, 8388607.0f))
+#define F_TO_S32(x)							\
+	(dsp_ftoi((x), DSP_S32_SCALE, -DSP_S32_SCALE, DSP_S32_MAX))
+#define F_TO_S16_DITHER(x)						\
+	((int16_t)dsp_ftoi((x) + dsp_tpdf(&d->seed) / DSP_S16_SCALE,	\
+			DSP_S16_SCALE, -32768.0f, 32767.0f))
+#define F_TO_S24_DITHER(x)						\
+	(dsp_ftoi((x) + dsp_tpdf(&d->seed) / DSP_S24_SCALE,		\
+			DSP_S24_SCALE, -8388608.0f, 8388607.0f))
+
+DSP_KERNEL
+static void dsp_load_s16(float *dst, size_t dstep, void const *src,
+		size_t sstep, size_t n)
+{
+	DSP_LOAD_LOOP(int16_t, S16_TO_F);
+}
+
+DSP_KERNEL
+static void dsp_load_s24(float *dst, size_t dstep, void const *src,
+		size_t sstep, size_t n)
+{
+	DSP_LOAD_LOOP(int32_t, S24_TO_F);
+}
+
+DSP_KERNEL
+static void dsp_load_s32(float *dst, size_t dstep, void const *src,
+		size_t sstep, size_t n)
+{
+	DSP_LOAD_LOOP(int32_t, S32_TO_F);
+}
+
+DSP_KERNEL
+static void dsp_load_float(float *dst, size_t dstep, void const *src,
+		size_t sstep, size_t n)
+{
+	DSP_LOAD_LOOP(float, F_TO_F);
+}
+
+DSP_KERNEL
+static void dsp_store_s16(struct dsp *d, void *dst, size_t dstep,
+		float const *src, size_t sstep, size_t n)
+{
+	(void)d;
+	DSP_STORE_LOOP(int16_t, F_TO_S16);
+}
+
+static void dsp_store_s16_dither(struct dsp *d, void *dst, size_t dstep,
+		float const *src, size_t sstep, size_t n)
+{
+	DSP_STORE_LOOP(int16_t, F_TO_S16_DITHER);
+}
+
+DSP_KERNEL
+static void dsp_store_s24(struct dsp *d, void *dst, size_t dstep,
+		float const *src, size_t sstep, size_t n)
+{
+	(void)d;
+	DSP_STORE_LOOP(int32_t, F_TO_S24);
+}
+
+static void dsp_store_s24_dither(struct dsp *d, void *dst, size_t dstep,
+		float const *src, size_t sstep, size_t n)
+{
+	DSP_STORE_LOOP(int32_t, F_TO_S24_DITHER);
+}
+
+DSP_KERNEL
+static void dsp_store_s32(struct dsp *d, void *dst, size_t dstep,
+		float const *src, size_t sstep, size_t n)
+{
+	(void)d;
+	DSP_STORE_LOOP(int32_t, F_TO_S32);
+}
+
+DSP_KERNEL
+static void dsp_store_float(struct dsp *d, void *dst, size_t dstep,
+		float const *src, size_t sstep, size_t n)
+{
+	(void)d;
+	DSP_STORE_LOOP(float, F_TO_F);
+}
+
+/**
+ * Supported formats kernels
+ */
+static struct dsp_kernel const dsp_kernels[] = {
+	{
+		.fmt = SND_PCM_FORMAT_S32,
+		.load = dsp_load_s32,
+		.store = dsp_store_s32,
+		.store_dither = NULL,
+		.bits = 32,
+	},
+	{
+		.fmt = SND_PCM_FORMAT_FLOAT,
+		.load = dsp_load_float,
+		.store = dsp_store_float,
+		.store_dither = NULL,
+		.bits = 32,
+	},
+	{
+		.fmt = SND_PCM_FORMAT_S24,
+		.load = dsp_load_s24,
+		.store = dsp_store_s24,
+		.store_dither = dsp_store_s24_dither,
+		.bits = 24,
+	},
+	{
+		.fmt = SND_PCM_FORMAT_S16,
+		.load = dsp_load_s16,
+		.store = dsp_store_s16,
+		.store_dither = dsp_store_s16_dither,
+		.bits = 16,
+	},
+};
+
+/**
+ * Find conversion kernels for a PCM format
+ *
+ * @param fmt: PCM format
+ * @return: Format kernels on success, NULL if format is not supported
+ */
+struct dsp_kernel const *dsp_kernel_find(snd_pcm_format_t fmt)
+{
+	size_t i;
+
+	for(i = 0; i < ARRAY_SIZE(dsp_kernels); ++i) {
+		if(dsp_kernels[i].fmt == fmt)
+			return &dsp_kernels[i];
+	}
+
+	return NULL;
+}
+
+/**
+ * Get the supported format list
+ *
+ * @param nr: Filled with the format list size
+ * @return: Format list ordered by preference
+ */
+snd_pcm_format_t const *dsp_formats(size_t *nr)
+{
+	static snd_pcm_format_t const fmt[] = {
+		SND_PCM_FORMAT_S32,
+		SND_PCM_FORMAT_FLOAT,
+		SND_PCM_FORMAT_S24,
+		SND_PCM_FORMAT_S16,
+	};
+
+	*nr = ARRAY_SIZE(fmt);
+	return fmt;
+}
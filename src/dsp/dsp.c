@@ -0,0 +1,257 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <alsa/asoundlib.h>
+#include <alsa/pcm_external.h>
+
+#include "amux.h"
+#include "dsp/dsp.h"
+
+#define DSP_SEED 0x12345678
+
+/**
+ * Get a channel area sample address
+ *
+ * @param a: Channel area
+ * @param off: Frame offset
+ * @return: Sample address
+ */
+static inline char *dsp_area_addr(snd_pcm_channel_area_t const *a,
+		snd_pcm_uframes_t off)
+{
+	return (char *)a->addr + ((a->first + off * a->step) >> 3);
+}
+
+/**
+ * Check if channel areas describe a contiguous interleaved buffer
+ *
+ * @param a: Channel areas
+ * @param nr: Number of channels
+ * @param width: Sample physical size in bytes
+ * @return: 1 if areas are interleaved, 0 otherwise
+ */
+static inline int dsp_areas_interleaved(snd_pcm_channel_area_t const *a,
+		unsigned int nr, unsigned int width)
+{
+	unsigned int i;
+
+	for(i = 0; i < nr; ++i) {
+		if((a[i].addr != a[0].addr) ||
+				(a[i].first != a[0].first + i * (width << 3)) ||
+				(a[i].step != nr * (width << 3)))
+			return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Initialize a DSP instance
+ *
+ * @param d: DSP instance
+ */
+void dsp_init(struct dsp *d)
+{
+	memset(d, 0, sizeof(*d));
+	d->gain = 1.0f;
+	d->gtarget = 1.0f;
+}
+
+/**
+ * Check if a PCM format can be converted by amux
+ *
+ * @param fmt: PCM format
+ * @return: 1 if format is supported, 0 otherwise
+ */
+int dsp_format_supported(snd_pcm_format_t fmt)
+{
+	return (dsp_kernel_find(fmt) != NULL);
+}
+
+/**
+ * Select transfer processing kernels. This should be called each time
+ * master or slave hardware parameters change. Channels are mapped with ALSA
+ * default layouts until dsp_set_chmap() is called.
+ *
+ * @param d: DSP instance to setup
+ * @param ifmt: Input (source) format
+ * @param ichannels: Number of input channels
+ * @param ofmt: Output (destination) format
+ * @param ochannels: Number of output channels
+ * @param dither: Use TPDF dither when output loses precision
+ * @return: 0 on success, negative number otherwise
+ */
+int dsp_setup(struct dsp *d, snd_pcm_format_t ifmt, unsigned int ichannels,
+		snd_pcm_format_t ofmt, unsigned int ochannels, int dither)
+{
+	d->ifmt = ifmt;
+	d->ofmt = ofmt;
+	d->ichannels = ichannels;
+	d->ochannels = ochannels;
+	d->seed = DSP_SEED;
+	d->store = NULL;
+
+	if((ichannels == 0) || (ichannels > DSP_BLOCK_SAMPLES))
+		return -EINVAL;
+
+	d->in = dsp_kernel_find(ifmt);
+	d->out = dsp_kernel_find(ofmt);
+	if((d->in != NULL) && (d->out != NULL)) {
+		d->iwidth = snd_pcm_format_physical_width(ifmt) >> 3;
+		d->owidth = snd_pcm_format_physical_width(ofmt) >> 3;
+		d->store = d->out->store;
+		if(dither && (d->out->store_dither != NULL) &&
+				(d->in->bits > d->out->bits))
+			d->store = d->out->store_dither;
+	} else if((ifmt != ofmt) || (ichannels != ochannels)) {
+		/* Only plain copy can be done without kernels */
+		AMUX_ERR("%s: Cannot convert format %d to %d\n", __func__,
+				(int)ifmt, (int)ofmt);
+		return -EINVAL;
+	}
+
+	return dsp_set_chmap(d, NULL, NULL);
+}
+
+/**
+ * Copy and mix frames from source areas to destination areas. Samples go
+ * through planar float blocks so that mixing can be vectorized.
+ *
+ * @param d: DSP instance
+ * @param dst: Destination channel areas
+ * @param doff: Destination frame offset
+ * @param src: Source channel areas
+ * @param soff: Source frame offset
+ * @param frames: Number of frames to process
+ */
+static void dsp_process_mix(struct dsp *d, snd_pcm_channel_area_t const *dst,
+		snd_pcm_uframes_t doff, snd_pcm_channel_area_t const *src,
+		snd_pcm_uframes_t soff, snd_pcm_uframes_t frames)
+{
+	float iblk[DSP_BLOCK_SAMPLES], oblk[DSP_BLOCK_SAMPLES];
+	unsigned int c, ich = d->ichannels, och = d->ochannels;
+	size_t nr, bfr;
+
+	bfr = DSP_BLOCK_SAMPLES / ((ich > och) ? ich : och);
+	while(frames != 0) {
+		nr = (frames < bfr) ? frames : bfr;
+		for(c = 0; c < ich; ++c)
+			d->in->load(iblk + c * bfr, 1,
+					dsp_area_addr(&src[c], soff),
+					src[c].step >> 3, nr);
+		dsp_mix(oblk, iblk, d->matrix, ich, och, nr, bfr);
+		if(!dsp_gain_unity(d))
+			dsp_gain(d, oblk, nr, 1, bfr, och);
+		for(c = 0; c < och; ++c)
+			d->store(d, dsp_area_addr(&dst[c], doff),
+					dst[c].step >> 3, oblk + c * bfr, 1,
+					nr);
+		soff += nr;
+		doff += nr;
+		frames -= nr;
+	}
+}
+
+/**
+ * Copy frames from source areas to destination areas, converting and mixing
+ * them on the fly. This is done in a single pass through small on-stack
+ * blocks.
+ *
+ * @param d: DSP instance
+ * @param dst: Destination channel areas
+ * @param doff: Destination frame offset
+ * @param src: Source channel areas
+ * @param soff: Source frame offset
+ * @param frames: Number of frames to process
+ */
+void dsp_process(struct dsp *d, snd_pcm_channel_area_t const *dst,
+		snd_pcm_uframes_t doff, snd_pcm_channel_area_t const *src,
+		snd_pcm_uframes_t soff, snd_pcm_uframes_t frames)
+{
+	float blk[DSP_BLOCK_SAMPLES];
+	char const *s;
+	char *o;
+	size_t nr, bfr;
+	unsigned int c, ch = d->ichannels;
+
+	if(d->passthrough && (dsp_gain_unity(d) || (d->in == NULL))) {
+		snd_pcm_areas_copy(dst, doff, src, soff, ch, frames, d->ifmt);
+		return;
+	}
+
+	if(d->mix) {
+		dsp_process_mix(d, dst, doff, src, soff, frames);
+		return;
+	}
+
+	if(dsp_areas_interleaved(src, ch, d->iwidth) &&
+			dsp_areas_interleaved(dst, ch, d->owidth)) {
+		s = dsp_area_addr(src, soff);
+		o = dsp_area_addr(dst, doff);
+		bfr = (DSP_BLOCK_SAMPLES / ch) * ch;
+		frames *= ch;
+		while(frames != 0) {
+			nr = (frames < bfr) ? frames : bfr;
+			d->in->load(blk, 1, s, d->iwidth, nr);
+			if(!dsp_gain_unity(d))
+				dsp_gain(d, blk, nr / ch, ch, 1, ch);
+			d->store(d, o, d->owidth, blk, 1, nr);
+			s += nr * d->iwidth;
+			o += nr * d->owidth;
+			frames -= nr;
+		}
+		return;
+	}
+
+	bfr = DSP_BLOCK_SAMPLES / ch;
+	while(frames != 0) {
+		nr = (frames < bfr) ? frames : bfr;
+		for(c = 0; c < ch; ++c)
+			d->in->load(blk + c, ch, dsp_area_addr(&src[c], soff),
+					src[c].step >> 3, nr);
+		if(!dsp_gain_unity(d))
+			dsp_gain(d, blk, nr, ch, 1, ch);
+		for(c = 0; c < ch; ++c)
+			d->store(d, dsp_area_addr(&dst[c], doff),
+					dst[c].step >> 3, blk + c, ch, nr);
+		soff += nr;
+		doff += nr;
+		frames -= nr;
+	}
+}
+
+/**
+ * Check if frames are digital silence. Only formats whose silence is all zero
+ * bits (i.e. signed and float ones) can be detected.
+ *
+ * @param a: Channel areas
+ * @param off: Offset of first frame in areas
+ * @param ch: Number of channels
+ * @param fmt: Sample format
+ * @param frames: Number of frames to check
+ * @return: 1 if all frames are silent, 0 otherwise
+ */
+int dsp_silent(snd_pcm_channel_area_t const *a, snd_pcm_uframes_t off,
+		unsigned int ch, snd_pcm_format_t fmt, snd_pcm_uframes_t frames)
+{
+	int width = snd_pcm_format_physical_width(fmt) >> 3;
+	unsigned int c;
+
+	if((width <= 0) || (snd_pcm_format_silence_64(fmt) != 0))
+		return 0;
+
+	if(dsp_areas_interleaved(a, ch, width))
+		return dsp_zero(dsp_area_addr(a, off), frames * ch * width);
+
+	for(c = 0; c < ch; ++c) {
+		/* Only planar buffers can be scanned at once */
+		if(a[c].step != (unsigned int)(width << 3))
+			return 0;
+		if(!dsp_zero(dsp_area_addr(&a[c], off), frames * width))
+			return 0;
+	}
+
+	return 1;
+}
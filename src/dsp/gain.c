@@ -0,0 +1,91 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <alsa/asoundlib.h>
+#include <alsa/pcm_external.h>
+
+#include "amux.h"
+#include "dsp/dsp.h"
+
+/**
+ * Set the gain to ramp to. Ramping starts on next processed frames.
+ *
+ * @param d: DSP instance
+ * @param gain: Linear target gain (0 is mute)
+ * @return: 0 on success, negative number if gain cannot be applied on current
+ * formats
+ */
+int dsp_set_gain(struct dsp *d, float gain)
+{
+	if(gain == d->gtarget)
+		return 0;
+
+	d->gtarget = gain;
+	d->gramp = DSP_RAMP_FRAMES;
+	d->gstep = (gain - d->gain) / DSP_RAMP_FRAMES;
+
+	if((d->in == NULL) || (d->out == NULL)) {
+		/* Cannot process samples, gain would be ignored */
+		d->gain = gain;
+		d->gramp = 0;
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/**
+ * Apply constant gain on contiguous float samples
+ *
+ * @param buf: Samples
+ * @param n: Number of samples
+ * @param g: Linear gain
+ */
+DSP_KERNEL
+static void dsp_gain_const(float *buf, size_t n, float g)
+{
+	size_t i;
+
+	for(i = 0; i < n; ++i)
+		buf[i] *= g;
+}
+
+/**
+ * Apply gain stage on a float block. Samples are saturated later by the output
+ * store kernel.
+ *
+ * @param d: DSP instance
+ * @param buf: Float samples
+ * @param frames: Number of frames
+ * @param fstep: Distance between two frames (in samples)
+ * @param cstep: Distance between two channels (in samples)
+ * @param ch: Number of channels
+ */
+void dsp_gain(struct dsp *d, float *buf, size_t frames, size_t fstep,
+		size_t cstep, unsigned int ch)
+{
+	size_t f;
+	unsigned int c;
+
+	/* Per-frame ramp */
+	for(f = 0; (f < frames) && (d->gramp != 0); ++f) {
+		d->gain += d->gstep;
+		if(--d->gramp == 0)
+			d->gain = d->gtarget;
+		for(c = 0; c < ch; ++c)
+			buf[f * fstep + c * cstep] *= d->gain;
+	}
+
+	if((f == frames) || (d->gain == 1.0f))
+		return;
+
+	/* Interleaved samples */
+	if(fstep == ch) {
+		dsp_gain_const(buf + f * fstep, (frames - f) * ch, d->gain);
+		return;
+	}
+
+	/* Planar samples */
+	for(c = 0; c < ch; ++c)
+		dsp_gain_const(buf + c * cstep + f, frames - f, d->gain);
+}
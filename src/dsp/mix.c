@@ -0,0 +1,352 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <alsa/asoundlib.h>
+#include <alsa/pcm_external.h>
+
+#include "amux.h"
+#include "dsp/dsp.h"
+
+#define DSP_M3DB 0.70710678f
+
+/**
+ * Coarse speaker placement, used to mix channels that do not exist on both
+ * sides.
+ */
+enum dsp_side {
+	DS_NONE,
+	DS_LEFT,
+	DS_RIGHT,
+	DS_CENTER,
+	DS_LFE,
+};
+
+/**
+ * Default ALSA channel layouts, indexed by number of channels
+ */
+static unsigned int const dsp_dft_pos[DSP_CHANNELS_MAX + 1][DSP_CHANNELS_MAX] = {
+	[1] = {SND_CHMAP_MONO},
+	[2] = {SND_CHMAP_FL, SND_CHMAP_FR},
+	[3] = {SND_CHMAP_FL, SND_CHMAP_FR, SND_CHMAP_LFE},
+	[4] = {SND_CHMAP_FL, SND_CHMAP_FR, SND_CHMAP_RL, SND_CHMAP_RR},
+	[5] = {SND_CHMAP_FL, SND_CHMAP_FR, SND_CHMAP_RL, SND_CHMAP_RR,
+		SND_CHMAP_FC},
+	[6] = {SND_CHMAP_FL, SND_CHMAP_FR, SND_CHMAP_RL, SND_CHMAP_RR,
+		SND_CHMAP_FC, SND_CHMAP_LFE},
+	[7] = {SND_CHMAP_FL, SND_CHMAP_FR, SND_CHMAP_RL, SND_CHMAP_RR,
+		SND_CHMAP_FC, SND_CHMAP_LFE, SND_CHMAP_RC},
+	[8] = {SND_CHMAP_FL, SND_CHMAP_FR, SND_CHMAP_RL, SND_CHMAP_RR,
+		SND_CHMAP_FC, SND_CHMAP_LFE, SND_CHMAP_SL, SND_CHMAP_SR},
+};
+
+/**
+ * Get speaker placement of a channel position
+ *
+ * @param pos: ALSA channel position
+ * @return: Speaker side
+ */
+static enum dsp_side dsp_pos_side(unsigned int pos)
+{
+	switch(pos & SND_CHMAP_POSITION_MASK) {
+	case SND_CHMAP_FL:
+	case SND_CHMAP_RL:
+	case SND_CHMAP_SL:
+	case SND_CHMAP_FLC:
+	case SND_CHMAP_RLC:
+	case SND_CHMAP_FLW:
+	case SND_CHMAP_FLH:
+	case SND_CHMAP_TFL:
+	case SND_CHMAP_TRL:
+	case SND_CHMAP_TFLC:
+	case SND_CHMAP_TSL:
+	case SND_CHMAP_BLC:
+		return DS_LEFT;
+	case SND_CHMAP_FR:
+	case SND_CHMAP_RR:
+	case SND_CHMAP_SR:
+	case SND_CHMAP_FRC:
+	case SND_CHMAP_RRC:
+	case SND_CHMAP_FRW:
+	case SND_CHMAP_FRH:
+	case SND_CHMAP_TFR:
+	case SND_CHMAP_TRR:
+	case SND_CHMAP_TFRC:
+	case SND_CHMAP_TSR:
+	case SND_CHMAP_BRC:
+		return DS_RIGHT;
+	case SND_CHMAP_MONO:
+	case SND_CHMAP_FC:
+	case SND_CHMAP_RC:
+	case SND_CHMAP_FCH:
+	case SND_CHMAP_TC:
+	case SND_CHMAP_TFC:
+	case SND_CHMAP_TRC:
+	case SND_CHMAP_BC:
+		return DS_CENTER;
+	case SND_CHMAP_LFE:
+	case SND_CHMAP_LLFE:
+	case SND_CHMAP_RLFE:
+		return DS_LFE;
+	default:
+		return DS_NONE;
+	}
+}
+
+/**
+ * Get a channel layout position list, falling back to default ALSA layout
+ *
+ * @param map: Channel map, can be NULL
+ * @param nr: Number of channels
+ * @param pos: Filled with channel positions
+ */
+static void dsp_chmap_pos(snd_pcm_chmap_t const *map, unsigned int nr,
+		unsigned int *pos)
+{
+	unsigned int i;
+
+	if((map != NULL) && (map->channels == nr)) {
+		for(i = 0; i < nr; ++i)
+			pos[i] = map->pos[i] & SND_CHMAP_POSITION_MASK;
+		return;
+	}
+
+	for(i = 0; i < nr; ++i)
+		pos[i] = dsp_dft_pos[nr][i];
+}
+
+/**
+ * Find a channel with a given position
+ *
+ * @param pos: Channel positions
+ * @param nr: Number of channels
+ * @param p: Position to look for
+ * @return: Channel index on success, -1 if not found
+ */
+static int dsp_chmap_find(unsigned int const *pos, unsigned int nr,
+		unsigned int p)
+{
+	unsigned int i;
+
+	for(i = 0; i < nr; ++i) {
+		if(pos[i] == p)
+			return (int)i;
+	}
+
+	return -1;
+}
+
+/**
+ * Find the main channel for a speaker side (front one or mono)
+ *
+ * @param pos: Channel positions
+ * @param nr: Number of channels
+ * @param side: Speaker side
+ * @return: Channel index on success, -1 if not found
+ */
+static int dsp_chmap_main(unsigned int const *pos, unsigned int nr,
+		enum dsp_side side)
+{
+	int ret;
+
+	switch(side) {
+	case DS_LEFT:
+		ret = dsp_chmap_find(pos, nr, SND_CHMAP_FL);
+		break;
+	case DS_RIGHT:
+		ret = dsp_chmap_find(pos, nr, SND_CHMAP_FR);
+		break;
+	case DS_CENTER:
+		ret = dsp_chmap_find(pos, nr, SND_CHMAP_FC);
+		break;
+	case DS_LFE:
+		ret = dsp_chmap_find(pos, nr, SND_CHMAP_LFE);
+		break;
+	default:
+		return -1;
+	}
+
+	if((ret < 0) && (side != DS_LFE))
+		ret = dsp_chmap_find(pos, nr, SND_CHMAP_MONO);
+
+	return ret;
+}
+
+/**
+ * Build the channel mixing matrix from master and slave channel layouts.
+ * Channels present on both sides are copied, the remaining input channels are
+ * downmixed to the closest output speakers and output speakers that are still
+ * silent are upmixed from the front input channels.
+ *
+ * @param d: DSP instance
+ * @param imap: Input channel map, NULL for ALSA default layout
+ * @param omap: Output channel map, NULL for ALSA default layout
+ * @return: 0 on success, negative number otherwise
+ */
+int dsp_set_chmap(struct dsp *d, snd_pcm_chmap_t const *imap,
+		snd_pcm_chmap_t const *omap)
+{
+	unsigned int ipos[DSP_CHANNELS_MAX], opos[DSP_CHANNELS_MAX];
+	unsigned int ich = d->ichannels, och = d->ochannels, i, o;
+	unsigned char used[DSP_CHANNELS_MAX] = {0};
+	float *m = d->matrix, sum, w;
+	int l, r, c;
+
+	d->mix = 0;
+	d->passthrough = (d->ifmt == d->ofmt);
+
+	if((ich > DSP_CHANNELS_MAX) || (och > DSP_CHANNELS_MAX)) {
+		if(ich == och)
+			return 0;
+		AMUX_ERR("%s: Cannot mix %u channels into %u\n", __func__,
+				ich, och);
+		return -EINVAL;
+	}
+
+	memset(m, 0, sizeof(d->matrix));
+	dsp_chmap_pos(imap, ich, ipos);
+	dsp_chmap_pos(omap, och, opos);
+
+	/* Copy channels that exist on both sides */
+	for(o = 0; o < och; ++o) {
+		c = dsp_chmap_find(ipos, ich, opos[o]);
+		if(c < 0)
+			continue;
+		m[o * DSP_CHANNELS_MAX + c] = 1.0f;
+		used[c] = 1;
+	}
+
+	/* Downmix input channels that have no output */
+	for(i = 0; i < ich; ++i) {
+		if(used[i])
+			continue;
+		switch(dsp_pos_side(ipos[i])) {
+		case DS_LEFT:
+		case DS_RIGHT:
+			c = dsp_chmap_main(opos, och, dsp_pos_side(ipos[i]));
+			w = ((ipos[i] == SND_CHMAP_FL) ||
+					(ipos[i] == SND_CHMAP_FR)) ?
+				1.0f : DSP_M3DB;
+			if(c >= 0)
+				m[c * DSP_CHANNELS_MAX + i] += w;
+			break;
+		case DS_CENTER:
+			w = (ipos[i] == SND_CHMAP_MONO) ? 1.0f : DSP_M3DB;
+			c = dsp_chmap_find(opos, och, SND_CHMAP_FC);
+			if(c < 0)
+				c = dsp_chmap_find(opos, och, SND_CHMAP_MONO);
+			if(c >= 0) {
+				m[c * DSP_CHANNELS_MAX + i] += 1.0f;
+				break;
+			}
+			l = dsp_chmap_find(opos, och, SND_CHMAP_FL);
+			r = dsp_chmap_find(opos, och, SND_CHMAP_FR);
+			if(l >= 0)
+				m[l * DSP_CHANNELS_MAX + i] += w;
+			if(r >= 0)
+				m[r * DSP_CHANNELS_MAX + i] += w;
+			break;
+		default:
+			/* LFE and unknown channels are dropped */
+			break;
+		}
+	}
+
+	/* Upmix front channels to silent outputs */
+	for(o = 0; o < och; ++o) {
+		for(i = 0, sum = 0.0f; i < ich; ++i)
+			sum += m[o * DSP_CHANNELS_MAX + i];
+		if(sum != 0.0f)
+			continue;
+
+		switch(dsp_pos_side(opos[o])) {
+		case DS_LEFT:
+		case DS_RIGHT:
+			c = dsp_chmap_main(ipos, ich, dsp_pos_side(opos[o]));
+			if(c >= 0)
+				m[o * DSP_CHANNELS_MAX + c] = 1.0f;
+			break;
+		case DS_CENTER:
+			l = dsp_chmap_find(ipos, ich, SND_CHMAP_FL);
+			r = dsp_chmap_find(ipos, ich, SND_CHMAP_FR);
+			if((l >= 0) && (r >= 0)) {
+				m[o * DSP_CHANNELS_MAX + l] = 0.5f;
+				m[o * DSP_CHANNELS_MAX + r] = 0.5f;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	/* Normalize downmixed outputs so they cannot clip */
+	for(o = 0; o < och; ++o) {
+		for(i = 0, sum = 0.0f; i < ich; ++i)
+			sum += m[o * DSP_CHANNELS_MAX + i];
+		if(sum <= 1.0f)
+			continue;
+		for(i = 0; i < ich; ++i)
+			m[o * DSP_CHANNELS_MAX + i] /= sum;
+	}
+
+	/* Check if mixing is actually needed */
+	if(ich == och) {
+		for(o = 0; o < och; ++o) {
+			for(i = 0; i < ich; ++i) {
+				w = (i == o) ? 1.0f : 0.0f;
+				if(m[o * DSP_CHANNELS_MAX + i] != w)
+					d->mix = 1;
+			}
+		}
+	} else {
+		d->mix = 1;
+	}
+
+	if(!d->mix)
+		return 0;
+
+	if((d->in == NULL) || (d->out == NULL)) {
+		AMUX_ERR("%s: Cannot remap channels of format %d\n", __func__,
+				(int)d->ifmt);
+		d->mix = 0;
+		return -EINVAL;
+	}
+
+	d->passthrough = 0;
+	return 0;
+}
+
+/**
+ * Apply channel mixing matrix on planar float samples
+ *
+ * @param dst: Output planes, och planes of stride samples
+ * @param src: Input planes, ich planes of stride samples
+ * @param matrix: Mixing matrix
+ * @param ich: Number of input channels
+ * @param och: Number of output channels
+ * @param n: Number of frames to mix
+ * @param stride: Distance between two planes (in samples)
+ */
+DSP_KERNEL
+void dsp_mix(float *dst, float const *src, float const *matrix,
+		unsigned int ich, unsigned int och, size_t n, size_t stride)
+{
+	float const *in;
+	float *out, g;
+	unsigned int i, o;
+	size_t f;
+
+	for(o = 0; o < och; ++o) {
+		out = dst + o * stride;
+		for(f = 0; f < n; ++f)
+			out[f] = 0.0f;
+		for(i = 0; i < ich; ++i) {
+			g = matrix[o * DSP_CHANNELS_MAX + i];
+			if(g == 0.0f)
+				continue;
+			in = src + i * stride;
+			for(f = 0; f < n; ++f)
+				out[f] += g * in[f];
+		}
+	}
+}
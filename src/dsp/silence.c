@@ -0,0 +1,46 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <alsa/asoundlib.h>
+#include <alsa/pcm_external.h>
+
+#include "amux.h"
+#include "dsp/dsp.h"
+
+/**
+ * Number of bytes or-ed together before checking for non zero data, so that
+ * non silent buffers are detected early.
+ */
+#define DSP_ZERO_BLOCK 256
+
+/**
+ * Check if a buffer only contains zero bits.
+ *
+ * @param buf: Buffer to check
+ * @param len: Buffer size in bytes
+ * @return: 1 if buffer is all zero, 0 otherwise
+ */
+DSP_KERNEL int dsp_zero(void const *buf, size_t len)
+{
+	unsigned char const *p = buf;
+	uint64_t acc, w;
+	size_t i;
+
+	for(; len >= DSP_ZERO_BLOCK; len -= DSP_ZERO_BLOCK) {
+		acc = 0;
+		for(i = 0; i < DSP_ZERO_BLOCK; i += sizeof(w)) {
+			memcpy(&w, p + i, sizeof(w));
+			acc |= w;
+		}
+		if(acc != 0)
+			return 0;
+		p += DSP_ZERO_BLOCK;
+	}
+
+	acc = 0;
+	for(i = 0; i < len; ++i)
+		acc |= p[i];
+
+	return (acc == 0);
+}
@@ -0,0 +1,350 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <syslog.h>
+
+#include <alsa/asoundlib.h>
+#include <alsa/pcm_external.h>
+
+#include "amux.h"
+#include "log.h"
+
+/* Number of messages the ring can hold, power of 2 */
+#define AMUX_LOG_SLOTS 64
+/* Maximum message size, longer ones are truncated */
+#define AMUX_LOG_MSGSZ 256
+/* Messages logged per call site and per second before suppressing */
+#define AMUX_LOG_BURST 5
+/* Flusher wakeup period in milliseconds */
+#define AMUX_LOG_PERIOD 100
+
+/**
+ * Log ring message slot
+ */
+struct amux_log_slot {
+	/**
+	 * Slot sequence number, tells whether slot is free or filled for a
+	 * given ring position
+	 */
+	unsigned int seq;
+	/**
+	 * Message log level
+	 */
+	int level;
+	/**
+	 * Formatted message
+	 */
+	char msg[AMUX_LOG_MSGSZ];
+};
+
+/**
+ * Process wide logger, shared by all amux PCMs
+ */
+static struct amux_logger {
+	/**
+	 * Message ring, written by any thread and read by the flusher only
+	 */
+	struct amux_log_slot slot[AMUX_LOG_SLOTS];
+	/**
+	 * Next ring position to write
+	 */
+	unsigned int head;
+	/**
+	 * Next ring position to flush
+	 */
+	unsigned int tail;
+	/**
+	 * Messages dropped because ring was full
+	 */
+	unsigned int dropped;
+	/**
+	 * Highest level logged
+	 */
+	int level;
+	/**
+	 * Sink file, NULL for syslog
+	 */
+	FILE *sink;
+	/**
+	 * Flusher thread
+	 */
+	pthread_t flusher;
+	/**
+	 * Number of PCMs using the logger
+	 */
+	unsigned int users;
+	/**
+	 * Flusher is running, messages go through the ring
+	 */
+	unsigned char running;
+	/**
+	 * Serialize logger start and stop
+	 */
+	pthread_mutex_t lock;
+} logger = {
+	.level = AMUX_LOG_WARN,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * Write a message to the sink.
+ *
+ * @param level: Message log level.
+ * @param msg: Message to write.
+ */
+static void amux_log_write(int level, char const *msg)
+{
+	if(logger.sink == NULL) {
+		syslog((level == AMUX_LOG_ERR) ? LOG_ERR : LOG_WARNING, "%s",
+				msg);
+		return;
+	}
+
+	fputs(msg, logger.sink);
+}
+
+/**
+ * Push a message into the ring. Never blocks, message is dropped if ring is
+ * full.
+ *
+ * @param level: Message log level.
+ * @param fmt: Message format.
+ * @param ap: Message format arguments.
+ */
+static void amux_log_push(int level, char const *fmt, va_list ap)
+{
+	struct amux_log_slot *s;
+	unsigned int pos, seq;
+
+	pos = __atomic_load_n(&logger.head, __ATOMIC_RELAXED);
+	for(;;) {
+		s = &logger.slot[pos % AMUX_LOG_SLOTS];
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if((int)(seq - pos) < 0) {
+			__atomic_add_fetch(&logger.dropped, 1,
+					__ATOMIC_RELAXED);
+			return;
+		}
+		if((seq == pos) && __atomic_compare_exchange_n(&logger.head,
+					&pos, pos + 1, 1, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+			break;
+		if(seq != pos)
+			pos = __atomic_load_n(&logger.head, __ATOMIC_RELAXED);
+	}
+
+	s->level = level;
+	vsnprintf(s->msg, sizeof(s->msg), fmt, ap);
+	__atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Push a message into the ring.
+ *
+ * @param level: Message log level.
+ * @param fmt: Message format.
+ */
+static void amux_log_pushf(int level, char const *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+static void amux_log_pushf(int level, char const *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	amux_log_push(level, fmt, ap);
+	va_end(ap);
+}
+
+/**
+ * Write all ring messages to the sink.
+ */
+static void amux_log_flush(void)
+{
+	struct amux_log_slot *s;
+	unsigned int pos = logger.tail, dropped;
+
+	for(;;) {
+		s = &logger.slot[pos % AMUX_LOG_SLOTS];
+		if(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != pos + 1)
+			break;
+		amux_log_write(s->level, s->msg);
+		__atomic_store_n(&s->seq, pos + AMUX_LOG_SLOTS,
+				__ATOMIC_RELEASE);
+		++pos;
+	}
+	logger.tail = pos;
+
+	dropped = __atomic_exchange_n(&logger.dropped, 0, __ATOMIC_RELAXED);
+	if(dropped != 0) {
+		char msg[64];
+		snprintf(msg, sizeof(msg), "amux: %u log messages dropped\n",
+				dropped);
+		amux_log_write(AMUX_LOG_WARN, msg);
+	}
+
+	if(logger.sink != NULL)
+		fflush(logger.sink);
+}
+
+/**
+ * Thread periodically writing ring messages to the sink.
+ */
+static void *amux_log_flusher(void *arg)
+{
+	struct timespec ts = {
+		.tv_sec = 0,
+		.tv_nsec = AMUX_LOG_PERIOD * 1000000L,
+	};
+	(void)arg;
+
+	while(__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE)) {
+		amux_log_flush();
+		nanosleep(&ts, NULL);
+	}
+	amux_log_flush();
+
+	return NULL;
+}
+
+/**
+ * Log a message. It is formatted into the log ring and written later by the
+ * flusher thread, or directly if flusher is not started (i.e. while opening
+ * PCM). Each call site logs at most AMUX_LOG_BURST messages per second, the
+ * number of suppressed ones is reported afterwards.
+ *
+ * @param site: Call site rate limiting state.
+ * @param level: Message log level.
+ * @param fmt: Message format.
+ */
+void amux_log(struct amux_log_site *site, int level, char const *fmt, ...)
+{
+	struct timespec now;
+	unsigned int suppressed;
+	va_list ap;
+
+	if(level > __atomic_load_n(&logger.level, __ATOMIC_RELAXED))
+		return;
+
+	va_start(ap, fmt);
+	if(!__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE)) {
+		vfprintf(stderr, fmt, ap);
+		va_end(ap);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	if(site->window != now.tv_sec) {
+		suppressed = site->suppressed;
+		site->window = now.tv_sec;
+		site->count = 0;
+		site->suppressed = 0;
+		if(suppressed != 0)
+			amux_log_pushf(level, "amux: %u similar messages "
+					"suppressed\n", suppressed);
+	}
+
+	if(site->count >= AMUX_LOG_BURST) {
+		++site->suppressed;
+	} else {
+		++site->count;
+		amux_log_push(level, fmt, ap);
+	}
+	va_end(ap);
+}
+
+/**
+ * Parse a log level name.
+ *
+ * @param str: Log level name ("none", "error" or "warning").
+ * @return: Log level on success, AMUX_LOG_NONE - 1 otherwise.
+ */
+int amux_log_level(char const *str)
+{
+	if(strcmp(str, "none") == 0)
+		return AMUX_LOG_NONE;
+	if(strcmp(str, "error") == 0)
+		return AMUX_LOG_ERR;
+	if(strcmp(str, "warning") == 0)
+		return AMUX_LOG_WARN;
+	return AMUX_LOG_NONE - 1;
+}
+
+/**
+ * Start using asynchronous logging. The first PCM to start the logger opens
+ * the sink and starts the flusher thread, following ones only update level.
+ *
+ * @param level: Highest level to log.
+ * @param sink: "stderr", "stdout", "syslog" or a file path to append to.
+ * @return: 0 on success, negative number otherwise.
+ */
+int amux_log_start(int level, char const *sink)
+{
+	unsigned int i;
+	int ret = 0;
+
+	pthread_mutex_lock(&logger.lock);
+	__atomic_store_n(&logger.level, level, __ATOMIC_RELAXED);
+	if(logger.users++ != 0)
+		goto out;
+
+	if(strcmp(sink, "stderr") == 0) {
+		logger.sink = stderr;
+	} else if(strcmp(sink, "stdout") == 0) {
+		logger.sink = stdout;
+	} else if(strcmp(sink, "syslog") == 0) {
+		logger.sink = NULL;
+		openlog("amux", LOG_PID, LOG_USER);
+	} else {
+		logger.sink = fopen(sink, "ae");
+		if(logger.sink == NULL) {
+			ret = -errno;
+			goto err;
+		}
+	}
+
+	for(i = 0; i < AMUX_LOG_SLOTS; ++i)
+		logger.slot[i].seq = i;
+	logger.head = 0;
+	logger.tail = 0;
+	logger.dropped = 0;
+
+	__atomic_store_n(&logger.running, 1, __ATOMIC_RELEASE);
+	ret = -pthread_create(&logger.flusher, NULL, amux_log_flusher, NULL);
+	if(ret == 0)
+		goto out;
+
+	__atomic_store_n(&logger.running, 0, __ATOMIC_RELEASE);
+	if((logger.sink != stderr) && (logger.sink != stdout) &&
+			(logger.sink != NULL))
+		fclose(logger.sink);
+err:
+	--logger.users;
+out:
+	pthread_mutex_unlock(&logger.lock);
+	return ret;
+}
+
+/**
+ * Stop using asynchronous logging, last PCM flushes pending messages and
+ * stops the flusher.
+ */
+void amux_log_stop(void)
+{
+	pthread_mutex_lock(&logger.lock);
+	if((logger.users == 0) || (--logger.users != 0))
+		goto out;
+
+	__atomic_store_n(&logger.running, 0, __ATOMIC_RELEASE);
+	pthread_join(logger.flusher, NULL);
+
+	if(logger.sink == NULL)
+		closelog();
+	else if((logger.sink != stderr) && (logger.sink != stdout))
+		fclose(logger.sink);
+out:
+	pthread_mutex_unlock(&logger.lock);
+}
@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <alsa/asoundlib.h>
+#include <alsa/pcm_external.h>
+
+#include "amux.h"
+#include "perf.h"
+
+/**
+ * Performance counters of a thread, read with a single group read
+ */
+struct amux_perf_thread {
+	/**
+	 * Group leader descriptor, -1 if counters cannot be opened
+	 */
+	int fd;
+	/**
+	 * Group member descriptors, -1 if counter is not available
+	 */
+	int mfd[AMUX_STATS_PERF_NR];
+	/**
+	 * Position of each counter in group read, -1 if not available
+	 */
+	int idx[AMUX_STATS_PERF_NR];
+	/**
+	 * Number of counters in group
+	 */
+	unsigned int nr;
+	/**
+	 * PCMs holding counters of this thread
+	 */
+	unsigned int ref;
+	/**
+	 * Counters have been opened for this thread
+	 */
+	unsigned char init;
+};
+
+static __thread struct amux_perf_thread perf_thr;
+static pthread_key_t perf_key;
+static pthread_once_t perf_once = PTHREAD_ONCE_INIT;
+
+/* Counters description, indexed by enum amux_stats_perf */
+static struct {
+	uint32_t type;
+	uint64_t config;
+} const perf_desc[AMUX_STATS_PERF_NR] = {
+	[AMUX_STATS_PERF_TASK_CLOCK] = {
+		PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK,
+	},
+	[AMUX_STATS_PERF_CYCLES] = {
+		PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,
+	},
+	[AMUX_STATS_PERF_INSTRUCTIONS] = {
+		PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,
+	},
+	[AMUX_STATS_PERF_CACHE_MISSES] = {
+		PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,
+	},
+	[AMUX_STATS_PERF_CTX_SWITCHES] = {
+		PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES,
+	},
+};
+
+/**
+ * Close thread counters, when last PCM holding them releases them or at thread
+ * exit.
+ */
+static void amux_perf_thread_close(void *arg)
+{
+	struct amux_perf_thread *pt = arg;
+	size_t i;
+
+	/* Group members are only opened once task clock leads the group */
+	for(i = 0; (pt->fd >= 0) && (i < AMUX_STATS_PERF_NR); ++i)
+		if(pt->mfd[i] >= 0)
+			close(pt->mfd[i]);
+	pt->fd = -1;
+	pt->init = 0;
+}
+
+static void amux_perf_key_create(void)
+{
+	pthread_key_create(&perf_key, amux_perf_thread_close);
+}
+
+/**
+ * Open calling thread counters. Task clock leads the group as it is always
+ * available, hardware counters missing (e.g. in virtual machines) are only
+ * reported as zero.
+ *
+ * @param pt: Thread counters to open.
+ */
+static void amux_perf_thread_open(struct amux_perf_thread *pt)
+{
+	struct perf_event_attr attr;
+	size_t i;
+	int fd;
+
+	pt->init = 1;
+	pt->fd = -1;
+	pt->nr = 0;
+	for(i = 0; i < AMUX_STATS_PERF_NR; ++i) {
+		pt->mfd[i] = -1;
+		pt->idx[i] = -1;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = perf_desc[i].type;
+		attr.config = perf_desc[i].config;
+		attr.read_format = PERF_FORMAT_GROUP;
+		/* Only user space is allowed with default perf_event_paranoid */
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, pt->fd, 0);
+		if(fd < 0) {
+			if(i == AMUX_STATS_PERF_TASK_CLOCK) {
+				AMUX_WARN("Cannot open performance counters: "
+						"%s\n", strerror(errno));
+				return;
+			}
+			continue;
+		}
+
+		if(pt->fd < 0)
+			pt->fd = fd;
+		pt->mfd[i] = fd;
+		pt->idx[i] = pt->nr++;
+	}
+
+	pthread_once(&perf_once, amux_perf_key_create);
+	pthread_setspecific(perf_key, pt);
+}
+
+/**
+ * Hold calling thread performance counters, opening them on first hold. This
+ * makes several syscalls and may warn, so it must only be called from cold
+ * callbacks.
+ *
+ * @return: 0 on success, negative number if counters cannot be opened (they
+ * are held anyway and must be released).
+ */
+int amux_perf_get(void)
+{
+	struct amux_perf_thread *pt = &perf_thr;
+
+	RT_ASSERT_COLD();
+	if(pt->ref++ == 0)
+		amux_perf_thread_open(pt);
+	return (pt->fd < 0) ? -ENODEV : 0;
+}
+
+/**
+ * Release calling thread performance counters, closing them on last release.
+ */
+void amux_perf_put(void)
+{
+	struct amux_perf_thread *pt = &perf_thr;
+
+	RT_ASSERT_COLD();
+	if((pt->ref == 0) || (--pt->ref != 0))
+		return;
+
+	amux_perf_thread_close(pt);
+	pthread_once(&perf_once, amux_perf_key_create);
+	pthread_setspecific(perf_key, NULL);
+}
+
+/**
+ * Read calling thread performance counters, they must be held by the calling
+ * thread (see amux_perf_get()) and are reported unavailable otherwise.
+ *
+ * @param val: Resulting counters value, unavailable ones are zero.
+ * @return: 0 on success, negative number otherwise.
+ */
+int amux_perf_read(uint64_t val[AMUX_STATS_PERF_NR])
+{
+	struct amux_perf_thread *pt = &perf_thr;
+	uint64_t buf[AMUX_STATS_PERF_NR + 1];
+	ssize_t len;
+	size_t i;
+
+	if(!pt->init || (pt->fd < 0))
+		return -ENODEV;
+
+	len = read(pt->fd, buf, (pt->nr + 1) * sizeof(*buf));
+	if(len != (ssize_t)((pt->nr + 1) * sizeof(*buf)))
+		return -EIO;
+
+	for(i = 0; i < AMUX_STATS_PERF_NR; ++i)
+		val[i] = (pt->idx[i] < 0) ? 0 : buf[pt->idx[i] + 1];
+
+	return 0;
+}
@@ -170,9 +170,9 @@ static int dupfd_poll_revents(struct poller *p, struct pollfd *pfd, size_t nr,
 	if (avail < 0)
 		return avail;
 
-	/* We woke up to soon, playback is not ready */
-	if((avail < (snd_pcm_sframes_t)p->amx->io.period_size))
-		*revents &= ~POLLOUT;
+	/* We woke up to soon, slave is not ready */
+	if(!poller_ready(p, avail))
+		*revents &= ~poller_event(p);
 
 	return 0;
 }
@@ -238,17 +238,19 @@ out:
  * Create a new dupfd poller instance.
  *
  * @param p: Resulting poller instance
+ * @param arena: Arena to allocate instance from
  * @param args: dupfd arguments
  * @return: 0 on success, negative number otherwise.
  */
-static int dupfd_create(struct poller **p, void *args)
+static int dupfd_create(struct poller **p, struct amux_arena *arena,
+		void *args)
 {
 	struct dupfd *d;
 	(void)args;
 
 	AMUX_DBG("%s: enter\n", __func__);
 
-	d = malloc(sizeof(*d));
+	d = amux_arena_alloc(arena, sizeof(*d));
 	if(d == NULL)
 		return -ENOMEM;
 
@@ -269,7 +271,6 @@ static void dupfd_destroy(struct poller *p)
 
 	AMUX_DBG("%s: enter\n", __func__);
 	dupfd_cleanup(d);
-	free(d);
 }
 
 static struct poller_ops const dupfd_ops = {
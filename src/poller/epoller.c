@@ -24,10 +24,18 @@ struct epoller {
 	 * List of slave pollable file desc
 	 */
 	struct pollfd *sfd;
+	/**
+	 * Spare slave pollable file desc list, filled on slave switch
+	 */
+	struct pollfd *nfd;
 	/**
 	 * Number of slave pollable file desc
 	 */
 	size_t snr;
+	/**
+	 * Idle slave virtual clock file desc, -1 if slave is not idle
+	 */
+	int ifd;
 };
 #define to_epoller(poller) (container_of(poller, struct epoller, p))
 
@@ -35,19 +43,25 @@ struct epoller {
  * Initialize an epoller structure
  *
  * @param e: epoller to initialize
+ * @param arena: Arena to allocate slave file desc lists from
  * @return: 0 on success, negative number otherwise
  */
-static inline int epoller_init(struct epoller *e)
+static inline int epoller_init(struct epoller *e, struct amux_arena *arena)
 {
 	int ret;
 
+	e->sfd = amux_arena_alloc(arena, sizeof(*e->sfd) * POLLER_POLLFD_MAX);
+	e->nfd = amux_arena_alloc(arena, sizeof(*e->nfd) * POLLER_POLLFD_MAX);
+	if((e->sfd == NULL) || (e->nfd == NULL))
+		return -ENOMEM;
+
 	ret = epoll_create(1);
 	if(ret < 0)
 		return -errno;
 
 	e->epoll_fd = ret;
-	e->sfd =  NULL;
 	e->snr = 0;
+	e->ifd = -1;
 
 	return 0;
 }
@@ -60,8 +74,6 @@ static inline int epoller_init(struct epoller *e)
 static inline void epoller_cleanup(struct epoller *e)
 {
 	close(e->epoll_fd);
-	if(e->sfd)
-		free(e->sfd);
 }
 
 /**
@@ -116,6 +128,9 @@ static int epoller_poll_revents(struct poller *p, struct pollfd *pfd,
 	(void)pfd;
 	(void)nr;
 
+	if(e->ifd >= 0)
+		return poller_idle_revents(p, revents);
+
 	ret = poll(e->sfd, e->snr, 0);
 	if(ret < 0) {
 		AMUX_ERR("%s: poll() error\n", __func__);
@@ -128,13 +143,59 @@ static int epoller_poll_revents(struct poller *p, struct pollfd *pfd,
 	if(avail < 0)
 		return avail;
 
-	/* We woke up to soon, playback is not ready */
-	if((avail < (snd_pcm_sframes_t)p->amx->io.period_size))
-		*revents &= ~POLLOUT;
+	/* We woke up to soon, slave is not ready */
+	if(!poller_ready(p, avail))
+		*revents &= ~poller_event(p);
 
 	return 0;
 }
 
+/**
+ * Register slave poll descriptors in epoll set
+ *
+ * @param e: epoller instance
+ * @param sfd: Slave poll descriptors
+ * @param snr: Number of slave poll descriptors
+ * @return: 0 on success, negative number otherwise
+ */
+static int epoller_add(struct epoller *e, struct pollfd *sfd, size_t snr)
+{
+	struct epoll_event ev;
+	size_t i;
+
+	ev.data.ptr = NULL;
+	for(i = 0; i < snr; ++i) {
+		ev.events = 0;
+		if(sfd[i].events & POLLOUT)
+			ev.events |= EPOLLOUT;
+		if(sfd[i].events & POLLIN)
+			ev.events |= EPOLLIN;
+		if(epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, sfd[i].fd, &ev) != 0)
+			goto err;
+	}
+
+	return 0;
+err:
+	for(; i != 0; --i)
+		epoll_ctl(e->epoll_fd, EPOLL_CTL_DEL, sfd[i - 1].fd, NULL);
+	return -errno;
+}
+
+/**
+ * Unregister slave poll descriptors from epoll set
+ *
+ * @param e: epoller instance
+ * @param sfd: Slave poll descriptors
+ * @param snr: Number of slave poll descriptors
+ */
+static void epoller_del(struct epoller *e, struct pollfd *sfd, size_t snr)
+{
+	size_t i;
+
+	for(i = 0; i < snr; ++i)
+		epoll_ctl(e->epoll_fd, EPOLL_CTL_DEL, sfd[i].fd, NULL);
+}
+
 /**
  * Update epoller current slave
  *
@@ -144,73 +205,96 @@ static int epoller_poll_revents(struct poller *p, struct pollfd *pfd,
 static int epoller_set_slave(struct poller *p)
 {
 	struct epoller *e = to_epoller(p);
-	struct pollfd *sfd;
-	size_t snr, i = 0;
-	struct epoll_event ev;
+	struct pollfd *sfd = e->nfd;
+	size_t snr;
 	int ret;
 
-	ret = -ENOMEM;
 	snr = snd_pcm_poll_descriptors_count(p->amx->slave);
-	sfd = malloc(sizeof(*sfd) * snr);
-	if(sfd == NULL) {
-		AMUX_ERR("%s: No memory\n", __func__);
-		goto err;
+	if(snr > POLLER_POLLFD_MAX) {
+		AMUX_ERR("%s: Slave PCM has too many poll fd\n", __func__);
+		return -EINVAL;
 	}
 
 	ret = snd_pcm_poll_descriptors(p->amx->slave, sfd, snr);
 	if(ret < 0) {
 		AMUX_ERR("Can't get poll descriptor\n");
-		goto err;
+		return ret;
 	}
 
-	ev.data.ptr = NULL;
-	for(i = 0; i < snr; ++i) {
-		ev.events = 0;
-		if(sfd[i].events & POLLOUT)
-			ev.events |= EPOLLOUT;
-		if(sfd[i].events & POLLIN)
-			ev.events |= EPOLLIN;
-		ret = epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, sfd[i].fd, &ev);
-		if(ret != 0) {
-			ret = -errno;
-			goto err;
-		}
+	/* Idle slave descriptors are registered when it wakes up */
+	if(e->ifd < 0) {
+		ret = epoller_add(e, sfd, snr);
+		if(ret != 0)
+			return ret;
+		epoller_del(e, e->sfd, e->snr);
 	}
 
-	for(i = 0; i < e->snr; ++i)
-		epoll_ctl(e->epoll_fd, EPOLL_CTL_DEL, e->sfd[i].fd, NULL);
-	if(e->sfd != NULL)
-		free(e->sfd);
-
+	e->nfd = e->sfd;
 	e->sfd = sfd;
 	e->snr = snr;
 	return 0;
-err:
-	for(; i != 0; --i)
-		epoll_ctl(e->epoll_fd, EPOLL_CTL_DEL, sfd[i - 1].fd, NULL);
-	free(sfd);
-	return ret;
+}
+
+/**
+ * Poll idle slave virtual clock instead of slave descriptors, or the opposite
+ *
+ * @param p: Common poller for epoller instance
+ * @param fd: Virtual clock file descriptor, negative to restore slave ones
+ * @return: 0 on success, negative number otherwise
+ */
+static int epoller_idle(struct poller *p, int fd)
+{
+	struct epoller *e = to_epoller(p);
+	struct epoll_event ev;
+	int ret;
+
+	if((fd >= 0) == (e->ifd >= 0))
+		return 0;
+
+	if(fd < 0) {
+		ret = epoller_add(e, e->sfd, e->snr);
+		if(ret != 0)
+			return ret;
+		epoll_ctl(e->epoll_fd, EPOLL_CTL_DEL, e->ifd, NULL);
+		e->ifd = -1;
+		return 0;
+	}
+
+	ev.data.ptr = NULL;
+	ev.events = EPOLLIN;
+	if(epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+		return -errno;
+	epoller_del(e, e->sfd, e->snr);
+	e->ifd = fd;
+
+	return 0;
 }
 
 /**
  * Create a new epoller instance
  *
  * @param p: Created common poller instance
+ * @param arena: Arena to allocate instance from
  * @params args: epoller arguments
  * @return: 0 on success, negative number otherwise
  */
-static int epoller_create(struct poller **p, void *args)
+static int epoller_create(struct poller **p, struct amux_arena *arena,
+		void *args)
 {
 	struct epoller *e;
+	int ret;
 	(void)args;
 
 	AMUX_DBG("%s: enter\n", __func__);
 
-	e = malloc(sizeof(*e));
+	e = amux_arena_alloc(arena, sizeof(*e));
 	if(e == NULL)
 		return -ENOMEM;
 
-	epoller_init(e);
+	ret = epoller_init(e, arena);
+	if(ret != 0)
+		return ret;
+
 	*p = &e->p;
 	return 0;
 }
@@ -226,7 +310,6 @@ static void epoller_destroy(struct poller *p)
 
 	AMUX_DBG("%s: enter\n", __func__);
 	epoller_cleanup(e);
-	free(e);
 }
 
 static struct poller_ops const epoller_ops = {
@@ -236,6 +319,7 @@ static struct poller_ops const epoller_ops = {
 	.descriptors_count = epoller_descriptors_count,
 	.descriptors = epoller_descriptors,
 	.poll_revents = epoller_poll_revents,
+	.idle = epoller_idle,
 };
 
 static struct poller_desc const epoller_desc = {
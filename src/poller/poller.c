@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 
 #include <poll.h>
 #include <alsa/asoundlib.h>
@@ -57,7 +58,7 @@ struct poller *poller_create(struct snd_pcm_amux *amx, char const *name,
 
 	AMUX_ASSERT(desc->ops->create);
 
-	err = desc->ops->create(&ret, args);
+	err = desc->ops->create(&ret, &amx->arena, args);
 	if(err != 0) {
 		ret = NULL;
 		AMUX_ERR("%s: Poller creation error\n", __func__);
@@ -65,7 +66,10 @@ struct poller *poller_create(struct snd_pcm_amux *amx, char const *name,
 	}
 
 	ret->desc = desc;
-	ret->amx = amx;
+	/* Thread poller binds its master before starting its thread */
+	if(ret->amx == NULL)
+		ret->amx = amx;
+	AMUX_ASSERT(ret->amx == amx);
 out:
 	return ret;
 }
@@ -92,6 +96,7 @@ void poller_destroy(struct poller *p)
 int poller_set_slave(struct poller *p)
 {
 	AMUX_DBG("%s: enter\n", __func__);
+	AMUX_TRACE_SCOPE(p->amx, "poller_set_slave");
 	AMUX_ASSERT(p->desc->ops->set_slave != NULL);
 	return p->desc->ops->set_slave(p);
 }
@@ -105,6 +110,7 @@ int poller_set_slave(struct poller *p)
 int poller_descriptors_count(struct poller *p)
 {
 	AMUX_DBG("%s: enter\n", __func__);
+	AMUX_TRACE_SCOPE(p->amx, "poller_descriptors_count");
 	AMUX_ASSERT(p->desc->ops->descriptors_count != NULL);
 	return p->desc->ops->descriptors_count(p);
 }
@@ -120,6 +126,7 @@ int poller_descriptors_count(struct poller *p)
 int poller_descriptors(struct poller *p, struct pollfd *pfd, size_t nr)
 {
 	AMUX_DBG("%s: enter\n", __func__);
+	AMUX_TRACE_SCOPE(p->amx, "poller_descriptors");
 	AMUX_ASSERT(p->desc->ops->descriptors != NULL);
 	return p->desc->ops->descriptors(p, pfd, nr);
 }
@@ -137,6 +144,7 @@ int poller_poll_revents(struct poller *p, struct pollfd *pfd, size_t nr,
 		unsigned short *revents)
 {
 	AMUX_DBG("%s: enter\n", __func__);
+	AMUX_TRACE_SCOPE(p->amx, "poller_poll_revents");
 	AMUX_ASSERT(p->desc->ops->poll_revents != NULL);
 	return p->desc->ops->poll_revents(p, pfd, nr, revents);
 }
@@ -149,6 +157,63 @@ int poller_poll_revents(struct poller *p, struct pollfd *pfd, size_t nr,
 void poller_transfer(struct poller *p)
 {
 	AMUX_DBG("%s: enter\n", __func__);
+	AMUX_TRACE_SCOPE(p->amx, "poller_transfer");
 	if(p->desc->ops->transfer != NULL)
 		p->desc->ops->transfer(p);
 }
+
+/**
+ * Check if slave is ready after a wakeup. Wakeups are accounted so that the
+ * slave wakeup threshold can be adapted to avoid spurious ones.
+ *
+ * @param p: poller instance
+ * @param avail: Slave available frames
+ * @return: 1 if slave is ready, 0 if we woke up too soon
+ */
+int poller_ready(struct poller *p, snd_pcm_sframes_t avail)
+{
+	AMUX_DBG("%s: enter\n", __func__);
+	return amux_wakeup(p->amx, avail);
+}
+
+/**
+ * Switch poller from slave descriptors to idle virtual clock one or back
+ *
+ * @param p: poller instance
+ * @param fd: Virtual clock file descriptor, negative to use slave ones again
+ * @return: 0 on success, negative number otherwise
+ */
+int poller_idle(struct poller *p, int fd)
+{
+	AMUX_DBG("%s: enter\n", __func__);
+	AMUX_TRACE_SCOPE(p->amx, "poller_idle");
+	if(p->desc->ops->idle == NULL)
+		return -ENOSYS;
+	return p->desc->ops->idle(p, fd);
+}
+
+/**
+ * Get poll events while slave is idle, from the virtual clock
+ *
+ * @param p: poller instance
+ * @param revents: Resulting poll events
+ * @return: 0 on success, negative number otherwise
+ */
+int poller_idle_revents(struct poller *p, unsigned short *revents)
+{
+	snd_pcm_sframes_t avail;
+
+	AMUX_DBG("%s: enter\n", __func__);
+
+	*revents = 0;
+	avail = amux_avail(p->amx);
+	if(avail < 0)
+		return avail;
+
+	if(poller_ready(p, avail))
+		*revents = poller_event(p);
+	else
+		amux_idle_arm(p->amx);
+
+	return 0;
+}
@@ -9,9 +9,10 @@
 #include <alsa/pcm_external.h>
 
 #include "amux.h"
+#include "rt.h"
+#include "probe.h"
 #include "poller/poller.h"
-
-#define POLLTHR_POLLFD_MAX 16 /* Alsa lib max poll fd */
+#include "poller/thread.h"
 
 /**
  * thread poller structure
@@ -25,7 +26,7 @@ struct pollthr {
 	 * File descriptor array to poll (one fd is reserved for thread
 	 * communication).
 	 */
-	struct pollfd pfd[POLLTHR_POLLFD_MAX + 1];
+	struct pollfd pfd[POLLER_POLLFD_MAX + 1];
 	/**
 	 * Number of file descritor in pfd array
 	 */
@@ -38,6 +39,10 @@ struct pollthr {
 	 * Lock for poll fd array
 	 */
 	pthread_mutex_t lock;
+	/**
+	 * Realtime parameters, NULL if not in realtime mode
+	 */
+	struct amux_rt const *rt;
 	/**
 	 * Polling thread handle
 	 */
@@ -105,6 +110,23 @@ static inline void pollthr_user_block(struct pollthr *pth)
 	(void)discard;
 }
 
+/**
+ * Lock poll fd array. In realtime mode audio path never waits for the polling
+ * thread, it only tries to take the lock.
+ *
+ * @param pth: thread poller instance
+ * @return: 0 if locked, -EBUSY otherwise
+ */
+static inline int pollthr_lock(struct pollthr *pth)
+{
+	if((pth->rt != NULL) && pth->rt->enabled)
+		return -pthread_mutex_trylock(&pth->lock);
+
+	RT_ASSERT_COLD();
+	pthread_mutex_lock(&pth->lock);
+	return 0;
+}
+
 /**
  * Initialize a pollthr structure
  *
@@ -216,7 +238,9 @@ static int pollthr_poll_revents(struct poller *p, struct pollfd *pfd,
 	if(pfd[0].revents != POLLIN)
 		goto out;
 
-	pthread_mutex_lock(&pth->lock);
+	/* Polling thread is updating, user will poll again */
+	if(pollthr_lock(pth) != 0)
+		goto out;
 	if(strcmp(pth->sname, p->amx->sname) != 0) {
 		pthread_mutex_unlock(&pth->lock);
 		goto out;
@@ -231,13 +255,13 @@ static int pollthr_poll_revents(struct poller *p, struct pollfd *pfd,
 		pthread_mutex_unlock(&pth->lock);
 		return avail;
 	}
-	if (avail < (snd_pcm_sframes_t)p->amx->io.period_size) {
-		/* We woke up to soon, playback is not ready */
+	if (!poller_ready(p, avail)) {
+		/* We woke up to soon, slave is not ready */
 		if(pth->pfdnr == 1)
 			pollthr_user_block(pth);
 		pth->pfdnr = snd_pcm_poll_descriptors_count(p->amx->slave) + 1;
 		pollthr_wake(pth);
-		*revents &= ~POLLOUT;
+		*revents &= ~poller_event(p);
 	}
 	pthread_mutex_unlock(&pth->lock);
 
@@ -254,7 +278,7 @@ out:
 static int pollthr_set_slave(struct poller *p)
 {
 	struct pollthr *pth = to_pollthr(p);
-	struct pollfd sfd[POLLTHR_POLLFD_MAX];
+	struct pollfd sfd[POLLER_POLLFD_MAX];
 	size_t snr;
 	int ret;
 
@@ -277,8 +301,7 @@ static int pollthr_set_slave(struct poller *p)
 		return -errno;
 	}
 	pthread_mutex_lock(&pth->lock);
-	if(snd_pcm_avail_update(p->amx->slave) <
-			(snd_pcm_sframes_t)p->amx->io.period_size) {
+	if(snd_pcm_avail_update(p->amx->slave) < poller_threshold(p)) {
 		if(pth->pfdnr == 1)
 			pollthr_user_block(pth);
 		pth->pfdnr = snr + 1;
@@ -305,9 +328,10 @@ static void pollthr_transfer(struct poller *p)
 
 	AMUX_DBG("%s: enter\n", __func__);
 
-	if(snd_pcm_avail_update(p->amx->slave) <
-			(snd_pcm_sframes_t)p->amx->io.period_size) {
-		pthread_mutex_lock(&pth->lock);
+	if(snd_pcm_avail_update(p->amx->slave) < poller_threshold(p)) {
+		/* Polling thread is updating, readiness checked at next poll */
+		if(pollthr_lock(pth) != 0)
+			return;
 		if(pth->pfdnr == 1)
 			pollthr_user_block(pth);
 		pth->pfdnr = snd_pcm_poll_descriptors_count(p->amx->slave) + 1;
@@ -323,11 +347,12 @@ static void pollthr_transfer(struct poller *p)
 static void *pollthr_thread(void *arg)
 {
 	struct pollthr *pth = (struct pollthr *)arg;
-	struct pollfd pfd[POLLTHR_POLLFD_MAX + 1];
+	struct pollfd pfd[POLLER_POLLFD_MAX + 1];
 	size_t nr;
 	int ret;
 	char sname[CARD_NAMESZ];
 
+	amux_trace_thread_name("amux poller");
 	while(!pth->stop) {
 		pthread_mutex_lock(&pth->lock);
 		nr = pth->pfdnr;
@@ -340,6 +365,7 @@ static void *pollthr_thread(void *arg)
 			AMUX_ERR("Poll error\n");
 			break;
 		}
+		AMUX_TRACE_INSTANT(pth->p.amx, "poll_wakeup", 0);
 		if(pfd[0].revents != 0) {
 			pollthr_ack(pth);
 			if(ret == 1)
@@ -355,6 +381,7 @@ static void *pollthr_thread(void *arg)
 		}
 		memcpy(pth->pfd, pfd, nr * sizeof(*pfd));
 		pth->pfdnr = 1;
+		AMUX_PROBE2(pollthr_ready, sname, ret);
 		pollthr_user_unblock(pth);
 		pthread_mutex_unlock(&pth->lock);
 	}
@@ -366,32 +393,36 @@ static void *pollthr_thread(void *arg)
  * Create a new poll thread poller instance.
  *
  * @param p: Resulting poller instance
+ * @param arena: Arena to allocate instance from
  * @param args: poll thread arguments
  * @return: 0 on success, negative number otherwise.
  */
-static int pollthr_create(struct poller **p, void *args)
+static int pollthr_create(struct poller **p, struct amux_arena *arena,
+		void *args)
 {
+	struct pollthr_args *pa = (struct pollthr_args *)args;
 	struct pollthr *pth;
 	int ret;
-	(void)args;
 
 	AMUX_DBG("%s: enter\n", __func__);
 
-	pth = malloc(sizeof(*pth));
+	pth = amux_arena_alloc(arena, sizeof(*pth));
 	if(pth == NULL)
 		return -ENOMEM;
 
 	ret = pollthr_init(pth);
 	if(ret != 0) {
 		AMUX_ERR("%s: Cannot init pollthr\n", __func__);
-		free(pth);
 		return ret;
 	}
 
-	ret = pthread_create(&pth->pollth, NULL, pollthr_thread, (void *)pth);
+	pth->p.amx = (pa != NULL) ? pa->amx : NULL;
+	pth->rt = (pa != NULL) ? pa->rt : NULL;
+	ret = rt_thread_create(pth->rt, &pth->pollth, pollthr_thread,
+			(void *)pth);
 	if(ret != 0) {
 		AMUX_ERR("%s: Cannot create poll thread\n", __func__);
-		free(pth);
+		pollthr_cleanup(pth);
 		return ret;
 	}
 
@@ -414,7 +445,6 @@ static void pollthr_destroy(struct poller *p)
 	pollthr_wake(pth);
 	pthread_join(pth->pollth, NULL);
 	pollthr_cleanup(pth);
-	free(pth);
 }
 
 static struct poller_ops const pollthr_ops = {
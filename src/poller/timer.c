@@ -0,0 +1,251 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/timerfd.h>
+
+#include <alsa/asoundlib.h>
+#include <alsa/pcm_external.h>
+
+#include "amux.h"
+#include "poller/poller.h"
+#include "poller/timer.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_USEC 1000ULL
+
+/**
+ * Timer poller structure. Instead of being woken up by slave at each period,
+ * user polls a timerfd armed at the time slave buffer is expected to be almost
+ * empty (or full for capture), so that transfers are batched in as few wakeups
+ * as possible.
+ */
+struct timerpoll {
+	/**
+	 * poller common structure
+	 */
+	struct poller p;
+	/**
+	 * Timer file descriptor (CLOCK_MONOTONIC)
+	 */
+	int tfd;
+	/**
+	 * Wakeup alignment in nanoseconds
+	 */
+	unsigned long long slack;
+};
+#define to_timerpoll(poller) (container_of(poller, struct timerpoll, p))
+
+/**
+ * Arm timer for next wakeup. Timer fires right away if slave is already ready,
+ * otherwise when slave is expected to have enough available frames to be
+ * worth a wakeup, rounded up to the next slack boundary.
+ *
+ * @param t: timer poller instance
+ * @param avail: Slave current available frames
+ * @return: 0 on success, negative number otherwise
+ */
+static int timerpoll_arm(struct timerpoll *t, snd_pcm_sframes_t avail)
+{
+	struct snd_pcm_amux *amx = t->p.amx;
+	struct itimerspec its = {};
+	struct timespec now;
+	snd_pcm_sframes_t target, margin;
+	unsigned long long ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+
+	if((avail < poller_threshold(&t->p)) && (amx->io.rate != 0)) {
+		/* Leave a period and the slack worth of frames to refill */
+		margin = amx->io.period_size + t->slack * amx->io.rate /
+			NSEC_PER_SEC;
+		target = amx->io.buffer_size - margin;
+		if(target < poller_threshold(&t->p))
+			target = poller_threshold(&t->p);
+		ns += (target - avail) * NSEC_PER_SEC / amx->io.rate;
+		if(t->slack)
+			ns = (ns + t->slack - 1) / t->slack * t->slack;
+	}
+
+	its.it_value.tv_sec = ns / NSEC_PER_SEC;
+	its.it_value.tv_nsec = ns % NSEC_PER_SEC;
+	if(timerfd_settime(t->tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		AMUX_ERR("%s: Cannot arm timer\n", __func__);
+		return -errno;
+	}
+
+	return 0;
+}
+
+/**
+ * Return the number of file descriptor to poll.
+ *
+ * @param p: Common poller for timer poller instance
+ * @return: the number of file descriptors (i.e. always 1)
+ */
+static int timerpoll_descriptors_count(struct poller *p)
+{
+	(void)p;
+	return 1;
+}
+
+/**
+ * Fillup a pollfd array with file descriptors to poll
+ *
+ * @param p: Common poller for timer poller instance
+ * @param pfd: Array to fill
+ * @param nr: Size of array
+ * @return: the number of fd on success, negative number otherwise
+ */
+static int timerpoll_descriptors(struct poller *p, struct pollfd *pfd,
+		size_t nr)
+{
+	struct timerpoll *t = to_timerpoll(p);
+
+	if(nr != 1)
+		return -EINVAL;
+
+	pfd[0].fd = t->tfd;
+	pfd[0].events = POLLIN;
+
+	return 1;
+}
+
+/**
+ * Fetch actual poll result events. Timer is kept expired while slave is ready
+ * so that user keeps being woken up until it transfers.
+ *
+ * @param p: Common poller for timer poller instance
+ * @param pfd: Array of pollfd to get event from
+ * @param nr: Size of array
+ * @param revents: Actual poll result
+ * @return: 0 on success, negative number otherwise
+ */
+static int timerpoll_poll_revents(struct poller *p, struct pollfd *pfd,
+		size_t nr, unsigned short *revents)
+{
+	struct timerpoll *t = to_timerpoll(p);
+	snd_pcm_sframes_t avail;
+
+	*revents = 0;
+	if((nr != 1) || !(pfd[0].revents & POLLIN))
+		return 0;
+
+	avail = amux_avail(p->amx);
+	if(avail < 0)
+		return avail;
+
+	/* We woke up to soon, slave is not ready */
+	if(!poller_ready(p, avail))
+		return timerpoll_arm(t, avail);
+
+	*revents = poller_event(p);
+	return 0;
+}
+
+/**
+ * Update timer poller current slave, user is woken up to reevaluate it.
+ *
+ * @param p: Common poller for timer poller instance
+ * @return: 0 on success, negative number otherwise
+ */
+static int timerpoll_set_slave(struct poller *p)
+{
+	struct timerpoll *t = to_timerpoll(p);
+
+	return timerpoll_arm(t, poller_threshold(p));
+}
+
+/**
+ * A new data transfer has been done, schedule next wakeup
+ *
+ * @param p: Common poller for timer poller instance
+ */
+static void timerpoll_transfer(struct poller *p)
+{
+	struct timerpoll *t = to_timerpoll(p);
+	snd_pcm_sframes_t avail;
+
+	avail = amux_avail(p->amx);
+	if(avail < 0)
+		avail = poller_threshold(p);
+
+	timerpoll_arm(t, avail);
+}
+
+/**
+ * Slave is idle, nothing to do as wakeups are computed from amux_avail() that
+ * follows the virtual clock.
+ *
+ * @param p: Common poller for timer poller instance
+ * @param fd: Virtual clock file descriptor
+ * @return: Always 0
+ */
+static int timerpoll_idle(struct poller *p, int fd)
+{
+	(void)p;
+	(void)fd;
+	return 0;
+}
+
+/**
+ * Create a new timer poller instance
+ *
+ * @param p: Created common poller instance
+ * @param arena: Arena to allocate instance from
+ * @params args: timer poller arguments (struct timer_args), can be NULL
+ * @return: 0 on success, negative number otherwise
+ */
+static int timerpoll_create(struct poller **p, struct amux_arena *arena,
+		void *args)
+{
+	struct timer_args *ta = args;
+	struct timerpoll *t;
+
+	AMUX_DBG("%s: enter\n", __func__);
+
+	t = amux_arena_alloc(arena, sizeof(*t));
+	if(t == NULL)
+		return -ENOMEM;
+
+	t->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(t->tfd < 0)
+		return -errno;
+
+	t->slack = (ta != NULL) ? ta->slack * NSEC_PER_USEC : 0;
+	*p = &t->p;
+	return 0;
+}
+
+/**
+ * Destroy a timer poller instance.
+ *
+ * @param p: common poller instance to destroy
+ */
+static void timerpoll_destroy(struct poller *p)
+{
+	struct timerpoll *t = to_timerpoll(p);
+
+	AMUX_DBG("%s: enter\n", __func__);
+	close(t->tfd);
+}
+
+static struct poller_ops const timerpoll_ops = {
+	.create = timerpoll_create,
+	.destroy = timerpoll_destroy,
+	.set_slave = timerpoll_set_slave,
+	.descriptors_count = timerpoll_descriptors_count,
+	.descriptors = timerpoll_descriptors,
+	.poll_revents = timerpoll_poll_revents,
+	.transfer = timerpoll_transfer,
+	.idle = timerpoll_idle,
+};
+
+static struct poller_desc const timerpoll_desc = {
+	.name = "timer",
+	.ops = &timerpoll_ops,
+};
+
+POLLER_REGISTER(timerpoll_desc);
@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <alsa/asoundlib.h>
+#include <alsa/pcm_external.h>
+
+#include "amux.h"
+#include "rt.h"
+
+#ifdef DEBUG
+__thread unsigned char rt_hot;
+#endif
+
+/**
+ * Create a thread with realtime scheduling policy, priority and CPU affinity.
+ * If realtime scheduling is not permitted the thread is created with inherited
+ * scheduling instead.
+ *
+ * @param rt: Realtime parameters, NULL or disabled for default attributes.
+ * @param th: Resulting thread handle.
+ * @param fn: Thread function.
+ * @param arg: Thread function argument.
+ * @return: 0 on success, negative number otherwise.
+ */
+int rt_thread_create(struct amux_rt const *rt, pthread_t *th,
+		void *(*fn)(void *), void *arg)
+{
+	struct sched_param sp;
+	pthread_attr_t attr;
+	cpu_set_t set;
+	size_t i;
+	int ret;
+
+	if((rt == NULL) || !rt->enabled)
+		return -pthread_create(th, NULL, fn, arg);
+
+	pthread_attr_init(&attr);
+
+	if(rt->cpus != 0) {
+		CPU_ZERO(&set);
+		for(i = 0; i < 64; ++i)
+			if(rt->cpus & (1ULL << i))
+				CPU_SET(i, &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	}
+
+	sp.sched_priority = rt->priority;
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, rt->policy);
+	pthread_attr_setschedparam(&attr, &sp);
+
+	ret = pthread_create(th, &attr, fn, arg);
+	if(ret == EPERM) {
+		AMUX_WARN("Realtime scheduling not permitted, using inherited "
+				"one\n");
+		pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+		ret = pthread_create(th, &attr, fn, arg);
+	}
+
+	pthread_attr_destroy(&attr);
+
+	return -ret;
+}
+
+/**
+ * Lock memory range so that it is never paged out from under the hot path.
+ *
+ * @param rt: Realtime parameters.
+ * @param addr: Start of memory to lock.
+ * @param len: Size of memory to lock.
+ */
+void rt_mlock(struct amux_rt const *rt, void const *addr, size_t len)
+{
+	if(!rt->enabled || !rt->mlock)
+		return;
+
+	if(mlock(addr, len) != 0)
+		AMUX_WARN("Cannot lock memory, check RLIMIT_MEMLOCK\n");
+}
+
+/**
+ * Unlock memory range locked by rt_mlock().
+ *
+ * @param rt: Realtime parameters.
+ * @param addr: Start of memory to unlock.
+ * @param len: Size of memory to unlock.
+ */
+void rt_munlock(struct amux_rt const *rt, void const *addr, size_t len)
+{
+	if(!rt->enabled || !rt->mlock)
+		return;
+
+	munlock(addr, len);
+}
+
+/**
+ * Parse a CPU list (e.g. "0,2-3") into an affinity mask.
+ *
+ * @param str: CPU list to parse.
+ * @param cpus: Resulting CPU mask.
+ * @return: 0 on success, negative number otherwise.
+ */
+int rt_parse_cpus(char const *str, uint64_t *cpus)
+{
+	unsigned long first, last;
+	char *end;
+
+	*cpus = 0;
+	while(*str != '\0') {
+		first = strtoul(str, &end, 10);
+		if(end == str)
+			return -EINVAL;
+		last = first;
+		str = end;
+		if(*str == '-') {
+			++str;
+			last = strtoul(str, &end, 10);
+			if(end == str)
+				return -EINVAL;
+			str = end;
+		}
+		if((first > last) || (last >= 64))
+			return -EINVAL;
+		for(; first <= last; ++first)
+			*cpus |= 1ULL << first;
+		if(*str == ',')
+			++str;
+		else if(*str != '\0')
+			return -EINVAL;
+	}
+
+	return 0;
+}
@@ -0,0 +1,514 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/syscall.h>
+
+#include <alsa/asoundlib.h>
+#include <alsa/pcm_external.h>
+
+#include "amux.h"
+#include "trace.h"
+
+/* Maximum number of traced threads per process */
+#define AMUX_TRACE_THREADS 32
+/* Maximum number of distinct slave names traced */
+#define AMUX_TRACE_SLAVES 32
+/* Minimum number of records per thread */
+#define AMUX_TRACE_EVENTS_MIN 1024
+/* Signal requesting a trace dump */
+#define AMUX_TRACE_SIGNAL SIGUSR2
+
+/**
+ * Trace record
+ */
+struct amux_trace_rec {
+	/**
+	 * Event time (CLOCK_MONOTONIC nanoseconds)
+	 */
+	uint64_t ts;
+	/**
+	 * Event name
+	 */
+	char const *name;
+	/**
+	 * Frames (transferred, available, queued...) reported with event
+	 */
+	long frames;
+	/**
+	 * Slave id
+	 */
+	unsigned short slave;
+	/**
+	 * Chrome trace event phase ('B', 'E', 'i' or 'C')
+	 */
+	char ph;
+};
+
+/**
+ * Per thread trace ring, only written by its owner thread. Oldest records are
+ * overwritten when full, so that the last moments before a dump are kept.
+ */
+struct amux_trace_buf {
+	/**
+	 * Number of records written
+	 */
+	unsigned long head;
+	/**
+	 * Owner thread kernel id
+	 */
+	pid_t tid;
+	/**
+	 * Owner thread name, NULL if not named
+	 */
+	char const *tname;
+	/**
+	 * Record ring
+	 */
+	struct amux_trace_rec *rec;
+	/**
+	 * Ring has been claimed and initialized by its owner
+	 */
+	unsigned char ready;
+};
+
+/**
+ * Process wide tracer, shared by all amux PCMs
+ */
+static struct amux_tracer {
+	/**
+	 * Per thread rings
+	 */
+	struct amux_trace_buf buf[AMUX_TRACE_THREADS];
+	/**
+	 * Number of claimed rings
+	 */
+	unsigned int nbuf;
+	/**
+	 * Records memory of all rings
+	 */
+	struct amux_trace_rec *mem;
+	/**
+	 * Number of records per ring, power of 2
+	 */
+	unsigned long events;
+	/**
+	 * Slave names indexed by slave id
+	 */
+	char slave[AMUX_TRACE_SLAVES][CARD_NAMESZ];
+	/**
+	 * Number of slave names
+	 */
+	unsigned int nslave;
+	/**
+	 * Trace file path
+	 */
+	char path[256];
+	/**
+	 * Signal action replaced by dump request one
+	 */
+	struct sigaction oldsa;
+	/**
+	 * Posted to request a dump
+	 */
+	sem_t dump;
+	/**
+	 * Thread dumping trace on signal
+	 */
+	pthread_t dumper;
+	/**
+	 * Tracing session generation, thread rings of older sessions are stale
+	 */
+	unsigned int gen;
+	/**
+	 * Number of PCMs using the tracer
+	 */
+	unsigned int users;
+	/**
+	 * Dumper thread should exit
+	 */
+	unsigned char stopping;
+	/**
+	 * Dump request signal handler is installed
+	 */
+	unsigned char sig;
+	/**
+	 * Serialize tracer start and stop
+	 */
+	pthread_mutex_t lock;
+	/**
+	 * Serialize dumps
+	 */
+	pthread_mutex_t dlock;
+} tracer = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.dlock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+unsigned char amux_tracing;
+
+static __thread struct amux_trace_buf *trace_buf;
+static __thread unsigned int trace_gen;
+
+/**
+ * Get calling thread trace ring, claiming one at first use.
+ *
+ * @return: Thread ring, NULL if all rings are used.
+ */
+static struct amux_trace_buf *amux_trace_buf_get(void)
+{
+	unsigned int gen = __atomic_load_n(&tracer.gen, __ATOMIC_ACQUIRE);
+	struct amux_trace_buf *b;
+	unsigned int idx;
+
+	if(trace_gen == gen)
+		return trace_buf;
+
+	trace_gen = gen;
+	trace_buf = NULL;
+	idx = __atomic_fetch_add(&tracer.nbuf, 1, __ATOMIC_RELAXED);
+	if(idx >= AMUX_TRACE_THREADS)
+		return NULL;
+
+	b = &tracer.buf[idx];
+	b->tid = syscall(SYS_gettid);
+	b->rec = tracer.mem + idx * tracer.events;
+	__atomic_store_n(&b->ready, 1, __ATOMIC_RELEASE);
+	trace_buf = b;
+
+	return b;
+}
+
+/**
+ * Record a trace event in calling thread ring. Never blocks nor allocates.
+ *
+ * @param ph: Chrome trace event phase.
+ * @param name: Event name, must be a string literal.
+ * @param slave: Slave id.
+ * @param frames: Frames reported with event.
+ */
+void amux_trace_event(char ph, char const *name, unsigned short slave,
+		long frames)
+{
+	struct amux_trace_buf *b;
+	struct amux_trace_rec *r;
+	struct timespec ts;
+	unsigned long h;
+
+	b = amux_trace_buf_get();
+	if(b == NULL)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	h = b->head;
+	r = &b->rec[h & (tracer.events - 1)];
+	r->ts = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	r->name = name;
+	r->frames = frames;
+	r->slave = slave;
+	r->ph = ph;
+	__atomic_store_n(&b->head, h + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Name calling thread in trace timeline.
+ *
+ * @param name: Thread name, must be a string literal.
+ */
+void amux_trace_thread_name(char const *name)
+{
+	struct amux_trace_buf *b;
+
+	if(!AMUX_TRACING())
+		return;
+
+	b = amux_trace_buf_get();
+	if(b != NULL)
+		b->tname = name;
+}
+
+/**
+ * Get trace id of a slave name.
+ *
+ * @param sname: Slave name.
+ * @return: Slave id, AMUX_TRACE_NOSLAVE if not tracing or too many slaves.
+ */
+unsigned short amux_trace_slave(char const *sname)
+{
+	unsigned short ret = AMUX_TRACE_NOSLAVE;
+	unsigned int i;
+
+	if(!AMUX_TRACING())
+		return ret;
+
+	pthread_mutex_lock(&tracer.lock);
+	for(i = 0; i < tracer.nslave; ++i) {
+		if(strcmp(tracer.slave[i], sname) == 0) {
+			ret = i;
+			goto out;
+		}
+	}
+
+	if(tracer.nslave == AMUX_TRACE_SLAVES)
+		goto out;
+
+	strncpy(tracer.slave[i], sname, sizeof(tracer.slave[i]) - 1);
+	__atomic_store_n(&tracer.nslave, i + 1, __ATOMIC_RELEASE);
+	ret = i;
+out:
+	pthread_mutex_unlock(&tracer.lock);
+	return ret;
+}
+
+/**
+ * Write a JSON string.
+ *
+ * @param f: File to write to.
+ * @param str: String to write.
+ */
+static void amux_trace_json_str(FILE *f, char const *str)
+{
+	fputc('"', f);
+	for(; *str != '\0'; ++str) {
+		if((*str == '"') || (*str == '\\'))
+			fputc('\\', f);
+		if((unsigned char)*str >= 0x20)
+			fputc(*str, f);
+	}
+	fputc('"', f);
+}
+
+/**
+ * Write a trace record as a Chrome trace event.
+ *
+ * @param f: File to write to.
+ * @param tid: Thread that recorded event.
+ * @param r: Trace record.
+ */
+static void amux_trace_json_rec(FILE *f, pid_t tid,
+		struct amux_trace_rec const *r)
+{
+	unsigned int nslave = __atomic_load_n(&tracer.nslave,
+			__ATOMIC_ACQUIRE);
+	char const *sname = (r->slave < nslave) ? tracer.slave[r->slave] : "";
+
+	fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"amux\",\"ph\":\"%c\","
+			"\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%d,", r->name,
+			r->ph, (unsigned long long)(r->ts / 1000),
+			(unsigned long long)(r->ts % 1000), (int)getpid(),
+			(int)tid);
+
+	switch(r->ph) {
+	case 'B':
+		fprintf(f, "\"args\":{\"slave\":");
+		amux_trace_json_str(f, sname);
+		fprintf(f, "}}");
+		break;
+	case 'i':
+		fprintf(f, "\"s\":\"t\",\"args\":{\"frames\":%ld,\"slave\":",
+				r->frames);
+		amux_trace_json_str(f, sname);
+		fprintf(f, "}}");
+		break;
+	default:
+		fprintf(f, "\"args\":{\"frames\":%ld}}", r->frames);
+		break;
+	}
+}
+
+/**
+ * Dump all thread rings to trace file, in Chrome trace event JSON format
+ * (loadable in chrome://tracing or Perfetto UI). Records overwritten while
+ * dumping are skipped.
+ *
+ * @return: 0 on success, negative number otherwise.
+ */
+static int amux_trace_dump(void)
+{
+	struct amux_trace_buf *b;
+	struct amux_trace_rec r;
+	unsigned long head, i;
+	unsigned int nbuf, n;
+	FILE *f;
+	int ret = 0;
+
+	pthread_mutex_lock(&tracer.dlock);
+	f = fopen(tracer.path, "we");
+	if(f == NULL) {
+		ret = -errno;
+		AMUX_ERR("Cannot write trace to %s: %s\n", tracer.path,
+				strerror(errno));
+		goto out;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+			"\"args\":{\"name\":\"amux\"}}", (int)getpid());
+
+	nbuf = __atomic_load_n(&tracer.nbuf, __ATOMIC_RELAXED);
+	if(nbuf > AMUX_TRACE_THREADS)
+		nbuf = AMUX_TRACE_THREADS;
+
+	for(n = 0; n < nbuf; ++n) {
+		b = &tracer.buf[n];
+		if(!__atomic_load_n(&b->ready, __ATOMIC_ACQUIRE))
+			continue;
+
+		if(b->tname != NULL)
+			fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\","
+					"\"pid\":%d,\"tid\":%d,\"args\":"
+					"{\"name\":\"%s\"}}", (int)getpid(),
+					(int)b->tid, b->tname);
+
+		head = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+		i = (head > tracer.events) ? head - tracer.events : 0;
+		for(; i < head; ++i) {
+			r = b->rec[i & (tracer.events - 1)];
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			/* Owner may be overwriting this record */
+			if(__atomic_load_n(&b->head, __ATOMIC_RELAXED) - i >=
+					tracer.events)
+				continue;
+			amux_trace_json_rec(f, b->tid, &r);
+		}
+	}
+
+	fprintf(f, "\n]}\n");
+	if(fclose(f) != 0)
+		ret = -errno;
+out:
+	pthread_mutex_unlock(&tracer.dlock);
+	return ret;
+}
+
+/**
+ * Dump request signal handler, only wakes up dumper thread.
+ */
+static void amux_trace_sig(int sig)
+{
+	(void)sig;
+	sem_post(&tracer.dump);
+}
+
+/**
+ * Thread dumping trace when requested by signal.
+ */
+static void *amux_trace_dumper(void *arg)
+{
+	(void)arg;
+
+	for(;;) {
+		if(sem_wait(&tracer.dump) != 0)
+			continue;
+		if(__atomic_load_n(&tracer.stopping, __ATOMIC_ACQUIRE))
+			break;
+		amux_trace_dump();
+	}
+
+	return NULL;
+}
+
+/**
+ * Start tracing callbacks and poller operations. The first PCM to start the
+ * tracer allocates thread rings and installs the dump request signal handler,
+ * following ones share it.
+ *
+ * @param path: Trace file path.
+ * @param events: Number of records kept per thread.
+ * @return: 0 on success, negative number otherwise.
+ */
+int amux_trace_start(char const *path, unsigned long events)
+{
+	struct sigaction sa;
+	unsigned long nr = AMUX_TRACE_EVENTS_MIN;
+	int ret = 0;
+
+	pthread_mutex_lock(&tracer.lock);
+	if(tracer.users++ != 0)
+		goto out;
+
+	while(nr < events)
+		nr <<= 1;
+
+	/* Touch every page now, not from the audio path */
+	tracer.mem = malloc(AMUX_TRACE_THREADS * nr * sizeof(*tracer.mem));
+	if(tracer.mem == NULL) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	memset(tracer.mem, 0, AMUX_TRACE_THREADS * nr * sizeof(*tracer.mem));
+
+	memset(tracer.buf, 0, sizeof(tracer.buf));
+	tracer.nbuf = 0;
+	tracer.events = nr;
+	tracer.stopping = 0;
+	strncpy(tracer.path, path, sizeof(tracer.path) - 1);
+
+	sem_init(&tracer.dump, 0, 0);
+	ret = -pthread_create(&tracer.dumper, NULL, amux_trace_dumper, NULL);
+	if(ret != 0) {
+		sem_destroy(&tracer.dump);
+		free(tracer.mem);
+		goto err;
+	}
+
+	/* Do not steal the signal from the application */
+	tracer.sig = 0;
+	if((sigaction(AMUX_TRACE_SIGNAL, NULL, &tracer.oldsa) == 0) &&
+			(tracer.oldsa.sa_handler == SIG_DFL)) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = amux_trace_sig;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		tracer.sig = (sigaction(AMUX_TRACE_SIGNAL, &sa, NULL) == 0);
+	}
+	if(!tracer.sig)
+		AMUX_WARN("SIGUSR2 is used by application, trace is only "
+				"dumped on close\n");
+
+	__atomic_add_fetch(&tracer.gen, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&amux_tracing, 1, __ATOMIC_RELEASE);
+	goto out;
+
+err:
+	--tracer.users;
+out:
+	pthread_mutex_unlock(&tracer.lock);
+	return ret;
+}
+
+/**
+ * Stop using tracer. Trace is dumped at each PCM close, last PCM releases
+ * the tracer.
+ */
+void amux_trace_stop(void)
+{
+	pthread_mutex_lock(&tracer.lock);
+	if(tracer.users == 0)
+		goto out;
+
+	amux_trace_dump();
+	if(--tracer.users != 0)
+		goto out;
+
+	__atomic_store_n(&amux_tracing, 0, __ATOMIC_RELEASE);
+	if(tracer.sig)
+		sigaction(AMUX_TRACE_SIGNAL, &tracer.oldsa, NULL);
+
+	__atomic_store_n(&tracer.stopping, 1, __ATOMIC_RELEASE);
+	sem_post(&tracer.dump);
+	pthread_join(tracer.dumper, NULL);
+	sem_destroy(&tracer.dump);
+
+	free(tracer.mem);
+	tracer.mem = NULL;
+out:
+	pthread_mutex_unlock(&tracer.lock);
+}
@@ -0,0 +1,366 @@
+/*
+ * Allocation-free steady state test: interpose malloc and friends, play a
+ * stream through an amux PCM and fail if anything is allocated or freed once
+ * warmed up.
+ *
+ * Usage: allocfree [-n cycles] [-s switches] [-c control_file]
+ *		[-S slave,slave] pcm
+ *
+ * Steady state: after warm-up, cycles of poll_revents, pointer (avail update)
+ * and transfer (period write) must not allocate nor free at all, from any
+ * thread of the process.
+ *
+ * Spurious wakeups: same cycles, but poll events are evaluated again right
+ * after each write, while the buffer is still full, so that amux sees early
+ * wakeups and raises slave avail_min. This must not allocate either.
+ *
+ * Switches (if a control file and two slaves are given): every slave is opened
+ * once first to warm libasound configuration up, then the slave is switched
+ * back and forth. Opening a slave allocates inside libasound (snd_pcm_open),
+ * those allocations are only reported, but amux code itself must not allocate
+ * nor free on a switch.
+ *
+ * Exits with 1 if an unexpected allocation happened.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <link.h>
+
+#include <alsa/asoundlib.h>
+
+#include "bench.h"
+
+#define AF_WARMUP 64
+#define AF_SWITCH_CYCLES 32
+#define AF_BUFFER_US 4000
+#define AF_SPURIOUS 4
+#define AF_AMUX_LIB "libasound_pcm_amux"
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void __libc_free(void *ptr);
+
+/* Allocations are counted while set */
+static int af_counting;
+/* Allocations and frees, total and called from amux code */
+static unsigned long af_nr;
+static unsigned long af_amux_nr;
+/* Amux plugin code address range */
+static uintptr_t af_amux_start;
+static uintptr_t af_amux_end;
+
+static inline void af_count(void const *caller)
+{
+	uintptr_t pc = (uintptr_t)caller;
+
+	if(!__atomic_load_n(&af_counting, __ATOMIC_RELAXED))
+		return;
+
+	__atomic_add_fetch(&af_nr, 1, __ATOMIC_RELAXED);
+	if((pc >= af_amux_start) && (pc < af_amux_end))
+		__atomic_add_fetch(&af_amux_nr, 1, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+	af_count(__builtin_return_address(0));
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	af_count(__builtin_return_address(0));
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	af_count(__builtin_return_address(0));
+	return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t align, size_t size)
+{
+	af_count(__builtin_return_address(0));
+	*ptr = __libc_memalign(align, size);
+	return (*ptr == NULL) ? ENOMEM : 0;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+	af_count(__builtin_return_address(0));
+	return __libc_memalign(align, size);
+}
+
+void free(void *ptr)
+{
+	if(ptr != NULL)
+		af_count(__builtin_return_address(0));
+	__libc_free(ptr);
+}
+
+static void af_start(void)
+{
+	__atomic_store_n(&af_nr, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&af_amux_nr, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&af_counting, 1, __ATOMIC_SEQ_CST);
+}
+
+static void af_stop(void)
+{
+	__atomic_store_n(&af_counting, 0, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Find amux plugin code range, once it has been loaded by libasound.
+ */
+static int af_amux_range(struct dl_phdr_info *info, size_t size, void *data)
+{
+	ElfW(Phdr) const *ph;
+	uintptr_t start, end;
+	int i;
+
+	(void)size;
+	(void)data;
+
+	if(strstr(info->dlpi_name, AF_AMUX_LIB) == NULL)
+		return 0;
+
+	for(i = 0; i < info->dlpi_phnum; ++i) {
+		ph = &info->dlpi_phdr[i];
+		if((ph->p_type != PT_LOAD) || !(ph->p_flags & PF_X))
+			continue;
+		start = info->dlpi_addr + ph->p_vaddr;
+		end = start + ph->p_memsz;
+		if((af_amux_start == 0) || (start < af_amux_start))
+			af_amux_start = start;
+		if(end > af_amux_end)
+			af_amux_end = end;
+	}
+	return 1;
+}
+
+/**
+ * Run a transfer/pointer/poll cycle: wait for the PCM the way applications do,
+ * update avail and write a period. Poll events are then evaluated spurious
+ * more times, without polling, each one being an early wakeup for amux.
+ *
+ * @return: 0 on success, negative number otherwise.
+ */
+static int af_cycle(snd_pcm_t *pcm, struct pollfd *pfd, int nr,
+		int16_t const *buf, snd_pcm_uframes_t psize,
+		unsigned int spurious)
+{
+	unsigned short revents;
+	snd_pcm_sframes_t ret;
+	unsigned int i;
+	int err;
+
+	for(;;) {
+		err = poll(pfd, nr, 1000);
+		if(err < 0)
+			return -errno;
+		if(err == 0)
+			return -ETIMEDOUT;
+		err = snd_pcm_poll_descriptors_revents(pcm, pfd, nr, &revents);
+		if(err < 0)
+			return err;
+		if(revents & (POLLERR | POLLNVAL))
+			return -EPIPE;
+		if(revents & POLLOUT)
+			break;
+	}
+
+	ret = snd_pcm_avail_update(pcm);
+	if(ret >= 0)
+		ret = snd_pcm_writei(pcm, buf, psize);
+	if((ret < 0) && (ret != -EAGAIN))
+		return ret;
+
+	for(i = 0; i < spurious; ++i) {
+		err = snd_pcm_poll_descriptors_revents(pcm, pfd, nr, &revents);
+		if(err < 0)
+			return err;
+	}
+	return 0;
+}
+
+/**
+ * Run cycles, recovering from xruns (which are not steady state).
+ *
+ * @return: Number of xruns on success, negative number otherwise.
+ */
+static int af_run(snd_pcm_t *pcm, struct pollfd *pfd, int nr,
+		int16_t const *buf, snd_pcm_uframes_t psize, unsigned int cycles,
+		unsigned int spurious)
+{
+	unsigned int i;
+	int err, xruns = 0;
+
+	for(i = 0; i < cycles; ++i) {
+		err = af_cycle(pcm, pfd, nr, buf, psize, spurious);
+		if((err == -EPIPE) || (err == -ESTRPIPE)) {
+			++xruns;
+			err = snd_pcm_recover(pcm, err, 1);
+		}
+		if(err < 0) {
+			fprintf(stderr, "Cycle error: %s\n", snd_strerror(err));
+			return err;
+		}
+	}
+	return xruns;
+}
+
+int main(int argc, char *argv[])
+{
+	char const *ctl = NULL, *slaves[2] = {};
+	unsigned int cycles = 10000, switches = 20, nslaves = 0, i;
+	unsigned long nr, amux_nr;
+	snd_pcm_uframes_t psize, bsize;
+	struct pollfd pfd[16];
+	int16_t *buf = NULL;
+	snd_pcm_t *pcm;
+	int opt, npfd, err, ret = 0;
+	char *s;
+
+	while((opt = getopt(argc, argv, "n:s:c:S:")) != -1) {
+		switch(opt) {
+		case 'n':
+			cycles = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			switches = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			ctl = optarg;
+			break;
+		case 'S':
+			for(s = strtok(optarg, ","); (s != NULL) &&
+					(nslaves < ARRAY_SIZE(slaves));
+					s = strtok(NULL, ","))
+				slaves[nslaves++] = s;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if(optind != argc - 1)
+		goto usage;
+	if((ctl != NULL) && (nslaves != 2)) {
+		fprintf(stderr, "Switching needs two slaves\n");
+		goto usage;
+	}
+
+	if((ctl != NULL) && (bench_ctl_set(ctl, slaves[0]) < 0)) {
+		perror(ctl);
+		return 1;
+	}
+
+	err = snd_pcm_open(&pcm, argv[optind], SND_PCM_STREAM_PLAYBACK,
+			SND_PCM_NONBLOCK);
+	if(err < 0) {
+		fprintf(stderr, "Cannot open %s: %s\n", argv[optind],
+				snd_strerror(err));
+		return 1;
+	}
+
+	err = snd_pcm_set_params(pcm, SND_PCM_FORMAT_S16_LE,
+			SND_PCM_ACCESS_RW_INTERLEAVED, 2, 48000, 1,
+			AF_BUFFER_US);
+	if(err == 0)
+		err = snd_pcm_get_params(pcm, &bsize, &psize);
+	if(err < 0) {
+		fprintf(stderr, "Cannot configure %s: %s\n", argv[optind],
+				snd_strerror(err));
+		goto close;
+	}
+
+	dl_iterate_phdr(af_amux_range, NULL);
+	if(af_amux_end == 0)
+		fprintf(stderr, "%s not loaded, amux allocations cannot be "
+				"told apart\n", AF_AMUX_LIB);
+
+	npfd = snd_pcm_poll_descriptors(pcm, pfd, ARRAY_SIZE(pfd));
+	buf = calloc(psize, 2 * sizeof(*buf));
+	if((npfd <= 0) || (buf == NULL)) {
+		err = -EINVAL;
+		goto close;
+	}
+
+	err = af_run(pcm, pfd, npfd, buf, psize, AF_WARMUP, 0);
+	if(err < 0)
+		goto close;
+
+	af_start();
+	err = af_run(pcm, pfd, npfd, buf, psize, cycles, 0);
+	af_stop();
+	if(err < 0)
+		goto close;
+
+	printf("steady state: %u cycles, %lu allocations (%d xruns)\n", cycles,
+			af_nr, err);
+	if(af_nr != 0)
+		ret = 1;
+
+	af_start();
+	err = af_run(pcm, pfd, npfd, buf, psize, cycles, AF_SPURIOUS);
+	af_stop();
+	if(err < 0)
+		goto close;
+
+	printf("spurious wakeups: %u cycles, %lu allocations (%d xruns)\n",
+			cycles, af_nr, err);
+	if(af_nr != 0)
+		ret = 1;
+
+	if(ctl == NULL)
+		goto close;
+
+	/* Warm both slaves up */
+	for(i = 1; i <= 2; ++i) {
+		bench_ctl_set(ctl, slaves[i % 2]);
+		err = af_run(pcm, pfd, npfd, buf, psize, AF_SWITCH_CYCLES, 0);
+		if(err < 0)
+			goto close;
+	}
+
+	nr = amux_nr = 0;
+	for(i = 1; i <= switches; ++i) {
+		bench_ctl_set(ctl, slaves[i % 2]);
+		af_start();
+		err = af_run(pcm, pfd, npfd, buf, psize, AF_SWITCH_CYCLES, 0);
+		af_stop();
+		if(err < 0)
+			goto close;
+		nr += af_nr;
+		amux_nr += af_amux_nr;
+	}
+
+	printf("switches: %u switches, %lu allocations by amux, %.1f by "
+			"libasound per switch\n", switches, amux_nr,
+			switches ? (double)(nr - amux_nr) / switches : 0.);
+	if(amux_nr != 0)
+		ret = 1;
+
+close:
+	snd_pcm_close(pcm);
+	free(buf);
+	if(err < 0)
+		return 1;
+	if(ret != 0)
+		printf("FAIL %s: unexpected allocations\n", argv[optind]);
+	return ret;
+
+usage:
+	fprintf(stderr, "Usage: %s [-n cycles] [-s switches] [-c control_file] "
+			"[-S slave,slave] pcm\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,73 @@
+#!/bin/sh
+# Check that amux steady state does not allocate, and that amux itself does not
+# allocate on switches, for each poller with and without realtime mode. Run
+# "make" first.
+#
+# Usage: allocfree.sh [-n cycles] [poller...]
+
+CURDIR=$(dirname $(realpath ${0}))
+BUILDDIR=${CURDIR}/../build
+TMPDIR=$(mktemp -d)
+CYCLES=10000
+POLLERS="dupfd thread epoller timer"
+
+trap 'rm -rf ${TMPDIR}' EXIT
+
+if [ "${1}" = "-n" ]; then
+	CYCLES=${2}
+	shift 2
+fi
+[ $# -ne 0 ] && POLLERS="$@"
+
+gcc -W -Wall -O2 -o ${TMPDIR}/allocfree ${CURDIR}/allocfree.c -lasound || \
+	exit 1
+
+cat > ${TMPDIR}/asoundrc << ASOUNDRC
+</usr/share/alsa/alsa.conf>
+
+pcm_type.!amux {
+	lib "${BUILDDIR}/libasound_pcm_amux.so"
+}
+
+# Slave writing every frame, through write() syscalls, to /dev/null
+pcm.mock {
+	type file
+	slave.pcm "null"
+	file "/dev/null"
+	format "raw"
+}
+ASOUNDRC
+
+for p in ${POLLERS}; do
+	cat >> ${TMPDIR}/asoundrc << ASOUNDRC
+
+pcm.amux_${p} {
+	type amux
+	file "${TMPDIR}/ctl"
+	poller "${p}"
+	stats false
+}
+
+pcm.amux_${p}_rt {
+	type amux
+	file "${TMPDIR}/ctl"
+	poller "${p}"
+	stats false
+	realtime {
+		mlock true
+	}
+}
+ASOUNDRC
+done
+
+ret=0
+for p in ${POLLERS}; do
+	for pcm in amux_${p} amux_${p}_rt; do
+		echo "${pcm}:"
+		ALSA_CONFIG_PATH=${TMPDIR}/asoundrc \
+		${TMPDIR}/allocfree -n ${CYCLES} -c ${TMPDIR}/ctl \
+			-S null,mock ${pcm} || ret=1
+	done
+done
+
+exit ${ret}
@@ -0,0 +1,236 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+/*
+ * Helpers shared by the amux benchmarks: clock, latency histogram, control
+ * file update and process resources counting.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(*(a)))
+
+/*
+ * Latency histogram with 16 linear buckets per power of two, values up to 2^31
+ * (in any time unit) are kept with a 6% precision.
+ */
+#define BENCH_HIST_SUB 16
+#define BENCH_HIST_NR ((31 - 3) * BENCH_HIST_SUB)
+
+struct bench_hist {
+	uint64_t cnt[BENCH_HIST_NR];
+	uint64_t nr;
+	uint64_t max;
+};
+
+/**
+ * Get monotonic time.
+ *
+ * @return: Current monotonic time in nanoseconds.
+ */
+static inline uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Get monotonic time.
+ *
+ * @return: Current monotonic time in microseconds.
+ */
+static inline uint64_t bench_now_us(void)
+{
+	return bench_now_ns() / 1000;
+}
+
+/**
+ * Sleep until a monotonic time.
+ *
+ * @param us: Monotonic time to wake up at, in microseconds.
+ */
+static inline void bench_sleep_until(uint64_t us)
+{
+	struct timespec ts = {
+		.tv_sec = us / 1000000,
+		.tv_nsec = (us % 1000000) * 1000,
+	};
+
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+			EINTR)
+		;
+}
+
+static inline unsigned int bench_hist_idx(uint64_t v)
+{
+	unsigned int e;
+
+	if(v < BENCH_HIST_SUB)
+		return v;
+	if(v >= (1ULL << 31))
+		return BENCH_HIST_NR - 1;
+
+	e = 63 - __builtin_clzll(v);
+	return (e - 3) * BENCH_HIST_SUB + (v >> (e - 4)) - BENCH_HIST_SUB;
+}
+
+static inline uint64_t bench_hist_val(unsigned int idx)
+{
+	unsigned int e;
+
+	if(idx < BENCH_HIST_SUB)
+		return idx;
+
+	e = idx / BENCH_HIST_SUB + 3;
+	return (uint64_t)(idx % BENCH_HIST_SUB + BENCH_HIST_SUB) << (e - 4);
+}
+
+/**
+ * Account a latency sample.
+ *
+ * @param h: Histogram to account sample in.
+ * @param v: Latency.
+ */
+static inline void bench_hist_add(struct bench_hist *h, uint64_t v)
+{
+	++h->cnt[bench_hist_idx(v)];
+	++h->nr;
+	if(v > h->max)
+		h->max = v;
+}
+
+/**
+ * Merge a latency histogram into another.
+ *
+ * @param dst: Histogram to merge into.
+ * @param src: Histogram to merge.
+ */
+static inline void bench_hist_merge(struct bench_hist *dst,
+		struct bench_hist const *src)
+{
+	size_t i;
+
+	for(i = 0; i < BENCH_HIST_NR; ++i)
+		dst->cnt[i] += src->cnt[i];
+	dst->nr += src->nr;
+	if(src->max > dst->max)
+		dst->max = src->max;
+}
+
+/**
+ * Get a latency percentile.
+ *
+ * @param h: Histogram to get percentile from.
+ * @param pct: Percentile (e.g. 99.9).
+ * @return: Lower bound of the bucket holding the percentile.
+ */
+static inline uint64_t bench_hist_pct(struct bench_hist const *h, double pct)
+{
+	uint64_t rank, cur = 0;
+	size_t i;
+
+	if(h->nr == 0)
+		return 0;
+
+	rank = (uint64_t)(h->nr * pct / 100.);
+	for(i = 0; i < BENCH_HIST_NR; ++i) {
+		cur += h->cnt[i];
+		if(cur > rank)
+			return bench_hist_val(i);
+	}
+	return h->max;
+}
+
+/**
+ * Configure amux slave the way amuxctl does, under an exclusive lock.
+ *
+ * @param path: Amux control file.
+ * @param pcm: Slave PCM name.
+ * @return: 0 on success, negative number otherwise.
+ */
+static inline int bench_ctl_set(char const *path, char const *pcm)
+{
+	size_t len = strlen(pcm), cur = 0;
+	ssize_t sz;
+	int fd, ret = 0;
+
+	fd = open(path, O_WRONLY | O_CREAT, 0600);
+	if(fd < 0)
+		return -errno;
+
+	flock(fd, LOCK_EX);
+	while(cur < len) {
+		sz = write(fd, pcm + cur, len - cur);
+		if((sz < 0) && (errno == EINTR))
+			continue;
+		if(sz < 0) {
+			ret = -errno;
+			goto unlock;
+		}
+		cur += (size_t)sz;
+	}
+	if(ftruncate(fd, len) < 0)
+		ret = -errno;
+unlock:
+	flock(fd, LOCK_UN);
+	close(fd);
+	return ret;
+}
+
+/**
+ * Count file descriptors opened by calling process.
+ *
+ * @return: Number of opened file descriptors, negative number on error.
+ */
+static inline int bench_fd_count(void)
+{
+	struct dirent *d;
+	DIR *dir;
+	int nr = 0;
+
+	dir = opendir("/proc/self/fd");
+	if(dir == NULL)
+		return -errno;
+
+	while((d = readdir(dir)) != NULL)
+		if(d->d_name[0] != '.')
+			++nr;
+	closedir(dir);
+
+	/* Do not count the descriptor used to read directory */
+	return nr - 1;
+}
+
+/**
+ * Count threads of calling process.
+ *
+ * @return: Number of threads, negative number on error.
+ */
+static inline int bench_thread_count(void)
+{
+	char line[128];
+	FILE *f;
+	int nr = -ENOENT;
+
+	f = fopen("/proc/self/status", "r");
+	if(f == NULL)
+		return -errno;
+
+	while(fgets(line, sizeof(line), f) != NULL)
+		if(sscanf(line, "Threads: %d", &nr) == 1)
+			break;
+	fclose(f);
+
+	return nr;
+}
+
+#endif
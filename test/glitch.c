@@ -0,0 +1,484 @@
+/*
+ * Switch latency and glitch benchmark: play a known signal through an amux PCM
+ * while toggling its control file between slaves at a fixed rate.
+ *
+ * Usage: glitch [-d seconds] [-r switch_hz] [-T stall_us] [-t tag]
+ *		-S slave=fifo,slave=fifo... control_file pcm
+ *
+ * Every slave must write what it plays to a FIFO (e.g. a file plugin over the
+ * real or null slave), which is read and timestamped here. The signal carries
+ * the index of each frame (low and high 16 bits in left and right channel,
+ * zero being silence) so that captured frames are correlated exactly against
+ * the reference, provided the path is bit exact (same format, unity gain).
+ *
+ * Reported:
+ *  - Switch latency, from control file write to first frame and first signal
+ *    frame played by the new slave. Switches that never reached their slave
+ *    (e.g. coalesced by a too fast rate) are counted as missed.
+ *  - Frames lost (never played) and duplicated (played more than once).
+ *  - Xruns seen by the client.
+ *  - Client callbacks (poll_revents and period write) latency, callbacks
+ *    longer than the stall threshold and longest time between two period
+ *    writes.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <alsa/asoundlib.h>
+
+#include "bench.h"
+
+#define GL_RATE 48000
+#define GL_BUFFER_US 40000
+#define GL_SLAVES_MAX 8
+#define GL_SESSIONS_MAX 4096
+
+/**
+ * Slave playing period, from its opening to its closing by amux
+ */
+struct gl_session {
+	/**
+	 * Opening, first frame and first signal frame monotonic time in us, 0
+	 * if none
+	 */
+	uint64_t open;
+	uint64_t first;
+	uint64_t signal;
+	/**
+	 * Number of frames played
+	 */
+	uint64_t frames;
+};
+
+/**
+ * Slave captured through a FIFO
+ */
+struct gl_slave {
+	char const *name;
+	char const *fifo;
+	pthread_t thr;
+	struct gl_session sess[GL_SESSIONS_MAX];
+	unsigned int nsess;
+	/**
+	 * Capture thread has ended
+	 */
+	int done;
+};
+
+/**
+ * Control file write
+ */
+struct gl_switch {
+	uint64_t ts;
+	unsigned int slave;
+};
+
+static struct gl_slave gl_slaves[GL_SLAVES_MAX];
+static unsigned int gl_nslaves;
+/* Number of times each signal frame has been played */
+static uint16_t *gl_played;
+static uint64_t gl_nframes;
+static uint64_t gl_silence;
+static uint64_t gl_bad;
+static int gl_stop;
+
+/**
+ * Capture thread: timestamp and decode frames played by a slave, a session
+ * starts each time amux opens the slave (i.e. the FIFO writer).
+ */
+static void *gl_capture(void *arg)
+{
+	struct gl_slave *sl = arg;
+	struct gl_session *se;
+	uint16_t buf[4096];
+	size_t len = 0, i;
+	uint64_t ts;
+	uint32_t code;
+	ssize_t sz;
+	int fd;
+
+	while(!__atomic_load_n(&gl_stop, __ATOMIC_ACQUIRE)) {
+		fd = open(sl->fifo, O_RDONLY);
+		if(fd < 0) {
+			perror(sl->fifo);
+			break;
+		}
+
+		se = &sl->sess[(sl->nsess < GL_SESSIONS_MAX) ? sl->nsess++ :
+			GL_SESSIONS_MAX - 1];
+		memset(se, 0, sizeof(*se));
+		se->open = bench_now_us();
+		len = 0;
+
+		while((sz = read(fd, (char *)buf + len,
+						sizeof(buf) - len)) > 0) {
+			ts = bench_now_us();
+			len += (size_t)sz;
+			for(i = 0; i + 1 < len / sizeof(*buf); i += 2) {
+				if(se->first == 0)
+					se->first = ts;
+				++se->frames;
+				code = buf[i] | ((uint32_t)buf[i + 1] << 16);
+				if(code == 0) {
+					__atomic_add_fetch(&gl_silence, 1,
+							__ATOMIC_RELAXED);
+					continue;
+				}
+				if(se->signal == 0)
+					se->signal = ts;
+				if(code > gl_nframes) {
+					__atomic_add_fetch(&gl_bad, 1,
+							__ATOMIC_RELAXED);
+					continue;
+				}
+				__atomic_add_fetch(&gl_played[code - 1], 1,
+						__ATOMIC_RELAXED);
+			}
+			/* Keep partial frame for next read */
+			memmove(buf, buf + i, len - i * sizeof(*buf));
+			len -= i * sizeof(*buf);
+		}
+		close(fd);
+	}
+
+	__atomic_store_n(&sl->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/**
+ * Wake capture threads up and wait for them.
+ */
+static void gl_capture_stop(void)
+{
+	unsigned int i;
+	int fd;
+
+	__atomic_store_n(&gl_stop, 1, __ATOMIC_RELEASE);
+	for(i = 0; i < gl_nslaves; ++i) {
+		/* Unblock reader waiting in open(), once it is in there */
+		while(!__atomic_load_n(&gl_slaves[i].done, __ATOMIC_ACQUIRE)) {
+			fd = open(gl_slaves[i].fifo, O_WRONLY | O_NONBLOCK);
+			if(fd >= 0)
+				close(fd);
+			usleep(1000);
+		}
+		pthread_join(gl_slaves[i].thr, NULL);
+	}
+}
+
+/**
+ * Wait for PCM to be ready the way applications do, through PCM poll
+ * descriptors and poll_revents, accounting callbacks latency.
+ *
+ * @return: 0 if PCM is ready, 1 on xrun, negative number on error.
+ */
+static int gl_wait(snd_pcm_t *pcm, struct bench_hist *cb)
+{
+	struct pollfd pfd[16];
+	unsigned short revents;
+	uint64_t start;
+	int nr, ret;
+
+	nr = snd_pcm_poll_descriptors(pcm, pfd, ARRAY_SIZE(pfd));
+	if(nr < 0)
+		return nr;
+
+	for(;;) {
+		ret = poll(pfd, nr, 1000);
+		if(ret < 0)
+			return -errno;
+		if(ret == 0)
+			return -ETIMEDOUT;
+		start = bench_now_ns();
+		ret = snd_pcm_poll_descriptors_revents(pcm, pfd, nr, &revents);
+		bench_hist_add(cb, bench_now_ns() - start);
+		if(ret < 0)
+			return ret;
+		if(revents & (POLLERR | POLLNVAL))
+			return 1;
+		if(revents & POLLOUT)
+			return 0;
+	}
+}
+
+/**
+ * Switch thread arguments and result
+ */
+struct gl_switcher {
+	char const *ctl;
+	double rate;
+	uint64_t end;
+	struct gl_switch *sw;
+	unsigned int nsw;
+};
+
+static void *gl_switcher(void *arg)
+{
+	struct gl_switcher *s = arg;
+	uint64_t start = bench_now_us(), next;
+	unsigned int i;
+
+	for(next = start + 1e6 / s->rate; next < s->end;
+			next = start + (s->nsw + 1) * 1e6 / s->rate) {
+		bench_sleep_until(next);
+		i = (s->nsw + 1) % gl_nslaves;
+		s->sw[s->nsw].ts = bench_now_us();
+		s->sw[s->nsw].slave = i;
+		if(bench_ctl_set(s->ctl, gl_slaves[i].name) < 0)
+			break;
+		++s->nsw;
+	}
+
+	return NULL;
+}
+
+/**
+ * Play signal on PCM until the end of the run or until all signal frames have
+ * been written.
+ */
+static int gl_play(char const *name, uint64_t end, struct bench_hist *cb,
+		uint64_t *xruns, uint64_t *maxgap, uint64_t *written)
+{
+	snd_pcm_uframes_t psize, bsize, i;
+	snd_pcm_sframes_t ret;
+	uint64_t start, last = 0;
+	uint32_t code = 1;
+	snd_pcm_t *pcm;
+	uint16_t *buf;
+	int err;
+
+	err = snd_pcm_open(&pcm, name, SND_PCM_STREAM_PLAYBACK, 0);
+	if(err < 0) {
+		fprintf(stderr, "Cannot open %s: %s\n", name,
+				snd_strerror(err));
+		return err;
+	}
+
+	err = snd_pcm_set_params(pcm, SND_PCM_FORMAT_S16_LE,
+			SND_PCM_ACCESS_RW_INTERLEAVED, 2, GL_RATE, 0,
+			GL_BUFFER_US);
+	if(err == 0)
+		err = snd_pcm_get_params(pcm, &bsize, &psize);
+	if(err < 0) {
+		fprintf(stderr, "Cannot configure %s: %s\n", name,
+				snd_strerror(err));
+		goto close;
+	}
+
+	buf = calloc(psize, 2 * sizeof(*buf));
+	if(buf == NULL) {
+		err = -ENOMEM;
+		goto close;
+	}
+
+	while((bench_now_us() < end) && (code + psize - 1 <= gl_nframes)) {
+		err = gl_wait(pcm, cb);
+		if(err < 0) {
+			fprintf(stderr, "Wait error: %s\n", snd_strerror(err));
+			break;
+		}
+		if(err == 1) {
+			++*xruns;
+			snd_pcm_prepare(pcm);
+			continue;
+		}
+
+		for(i = 0; i < psize; ++i, ++code) {
+			buf[2 * i] = code & 0xffff;
+			buf[2 * i + 1] = code >> 16;
+		}
+
+		start = bench_now_ns();
+		ret = snd_pcm_writei(pcm, buf, psize);
+		bench_hist_add(cb, bench_now_ns() - start);
+		if((ret == -EPIPE) || (ret == -ESTRPIPE)) {
+			++*xruns;
+			ret = snd_pcm_recover(pcm, ret, 1);
+			/* Frames of this period are lost, as seen by slave */
+			continue;
+		}
+		if(ret < 0) {
+			err = ret;
+			fprintf(stderr, "Write error: %s\n", snd_strerror(err));
+			break;
+		}
+		/* Short write, rewind signal to the first unwritten frame */
+		code -= psize - ret;
+
+		start = bench_now_us();
+		if((last != 0) && (start - last > *maxgap))
+			*maxgap = start - last;
+		last = start;
+	}
+	*written = code - 1;
+
+	if(err >= 0)
+		snd_pcm_drain(pcm);
+	free(buf);
+close:
+	snd_pcm_close(pcm);
+	return (err < 0) ? err : 0;
+}
+
+/**
+ * Find session started by a switch.
+ *
+ * @return: Session of switched to slave opened after switch and before next
+ * switch, NULL if there is none.
+ */
+static struct gl_session const *gl_session_find(struct gl_switch const *sw,
+		uint64_t next)
+{
+	struct gl_slave const *sl = &gl_slaves[sw->slave];
+	unsigned int i;
+
+	for(i = 0; i < sl->nsess; ++i)
+		if((sl->sess[i].open >= sw->ts) && (sl->sess[i].open < next))
+			return &sl->sess[i];
+	return NULL;
+}
+
+static void gl_print_hist(char const *what, struct bench_hist const *h)
+{
+	printf("  %s: p50 %llu, p90 %llu, p99 %llu, max %llu\n", what,
+			(unsigned long long)bench_hist_pct(h, 50.),
+			(unsigned long long)bench_hist_pct(h, 90.),
+			(unsigned long long)bench_hist_pct(h, 99.),
+			(unsigned long long)h->max);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_hist *first, *signal, *cb;
+	struct gl_switcher s = {};
+	struct gl_session const *se;
+	char const *tag = NULL;
+	uint64_t xruns = 0, maxgap = 0, written = 0, lost = 0, dup = 0;
+	uint64_t stall = 2000, stalls = 0, i, next;
+	unsigned int missed = 0;
+	pthread_t swthr;
+	double dur = 10.;
+	char *p, *e;
+	int opt, ret;
+
+	s.rate = 1.;
+	while((opt = getopt(argc, argv, "d:r:T:S:t:")) != -1) {
+		switch(opt) {
+		case 'd':
+			dur = strtod(optarg, NULL);
+			break;
+		case 'r':
+			s.rate = strtod(optarg, NULL);
+			break;
+		case 'T':
+			stall = strtoull(optarg, NULL, 10);
+			break;
+		case 'S':
+			for(p = strtok(optarg, ","); (p != NULL) &&
+					(gl_nslaves < GL_SLAVES_MAX);
+					p = strtok(NULL, ",")) {
+				e = strchr(p, '=');
+				if(e == NULL)
+					goto usage;
+				*e = '\0';
+				gl_slaves[gl_nslaves].name = p;
+				gl_slaves[gl_nslaves++].fifo = e + 1;
+			}
+			break;
+		case 't':
+			tag = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if((optind != argc - 2) || (gl_nslaves < 2) || (dur <= 0.) ||
+			(s.rate <= 0.))
+		goto usage;
+	s.ctl = argv[optind];
+	if(tag == NULL)
+		tag = argv[optind + 1];
+
+	gl_nframes = (uint64_t)(dur * GL_RATE) + GL_RATE;
+	gl_played = calloc(gl_nframes, sizeof(*gl_played));
+	s.sw = calloc(dur * s.rate + 1, sizeof(*s.sw));
+	first = calloc(1, sizeof(*first));
+	signal = calloc(1, sizeof(*signal));
+	cb = calloc(1, sizeof(*cb));
+	if((gl_played == NULL) || (s.sw == NULL) || (first == NULL) ||
+			(signal == NULL) || (cb == NULL))
+		return 1;
+
+	for(i = 0; i < gl_nslaves; ++i)
+		pthread_create(&gl_slaves[i].thr, NULL, gl_capture,
+				&gl_slaves[i]);
+
+	if(bench_ctl_set(s.ctl, gl_slaves[0].name) < 0) {
+		perror(s.ctl);
+		return 1;
+	}
+
+	s.end = bench_now_us() + (uint64_t)(dur * 1e6);
+	pthread_create(&swthr, NULL, gl_switcher, &s);
+	ret = gl_play(argv[optind + 1], s.end, cb, &xruns, &maxgap, &written);
+	pthread_join(swthr, NULL);
+	gl_capture_stop();
+	if(ret < 0)
+		return 1;
+
+	for(i = 0; i < s.nsw; ++i) {
+		next = (i + 1 < s.nsw) ? s.sw[i + 1].ts : UINT64_MAX;
+		se = gl_session_find(&s.sw[i], next);
+		if((se == NULL) || (se->first == 0)) {
+			++missed;
+			continue;
+		}
+		bench_hist_add(first, se->first - s.sw[i].ts);
+		if(se->signal != 0)
+			bench_hist_add(signal, se->signal - s.sw[i].ts);
+	}
+
+	for(i = 0; i < written; ++i) {
+		if(gl_played[i] == 0)
+			++lost;
+		else
+			dup += gl_played[i] - 1;
+	}
+	for(i = 0; i < BENCH_HIST_NR; ++i)
+		if(bench_hist_val(i) >= stall * 1000)
+			stalls += cb->cnt[i];
+
+	printf("%s: %u switches (%u missed) at %.2fHz, %.1fs\n", tag, s.nsw,
+			missed, s.rate, dur);
+	gl_print_hist("switch to first frame us", first);
+	gl_print_hist("switch to first signal frame us", signal);
+	printf("  frames: %llu written, %llu lost, %llu duplicated, "
+			"%llu silence, %llu unknown\n",
+			(unsigned long long)written, (unsigned long long)lost,
+			(unsigned long long)dup,
+			(unsigned long long)gl_silence,
+			(unsigned long long)gl_bad);
+	if(s.nsw != 0)
+		printf("  per switch: %.1f lost, %.1f duplicated\n",
+				(double)lost / s.nsw, (double)dup / s.nsw);
+	printf("  xruns %llu\n", (unsigned long long)xruns);
+	gl_print_hist("callback ns", cb);
+	printf("  callbacks over %lluus: %llu, longest write interval %lluus\n",
+			(unsigned long long)stall, (unsigned long long)stalls,
+			(unsigned long long)maxgap);
+
+	return 0;
+
+usage:
+	fprintf(stderr, "Usage: %s [-d seconds] [-r switch_hz] [-T stall_us] "
+			"[-t tag] -S slave=fifo,slave=fifo... control_file "
+			"pcm\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,79 @@
+#!/bin/sh
+# Measure switch latency and glitches for each poller and switch rate, toggling
+# between two slaves that capture what they play. Run "make" first.
+#
+# Usage: glitch.sh [-d seconds] [-r "switch_hz..."] [-s slave_pcm] [poller...]
+#
+# Slaves are file plugins over slave_pcm ("null" by default, a real card such as
+# "hw:0" may be used) writing frames to a FIFO read by the benchmark.
+
+CURDIR=$(dirname $(realpath ${0}))
+BUILDDIR=${CURDIR}/../build
+TMPDIR=$(mktemp -d)
+DURATION=10
+RATES="0.5 2 10"
+SLAVE=null
+POLLERS="dupfd thread epoller timer"
+MOCKS="mock0 mock1"
+
+trap 'rm -rf ${TMPDIR}' EXIT
+
+while [ $# -ne 0 ]; do
+	case ${1} in
+	-d) DURATION=${2}; shift 2;;
+	-r) RATES=${2}; shift 2;;
+	-s) SLAVE=${2}; shift 2;;
+	*) break;;
+	esac
+done
+[ $# -ne 0 ] && POLLERS="$@"
+
+gcc -W -Wall -O2 -o ${TMPDIR}/glitch ${CURDIR}/glitch.c -lasound -lpthread || \
+	exit 1
+
+cat > ${TMPDIR}/asoundrc << ASOUNDRC
+</usr/share/alsa/alsa.conf>
+
+pcm_type.!amux {
+	lib "${BUILDDIR}/libasound_pcm_amux.so"
+}
+ASOUNDRC
+
+SLAVES=""
+for m in ${MOCKS}; do
+	mkfifo ${TMPDIR}/${m}.fifo || exit 1
+	SLAVES="${SLAVES}${SLAVES:+,}${m}=${TMPDIR}/${m}.fifo"
+	cat >> ${TMPDIR}/asoundrc << ASOUNDRC
+
+# Slave capturing every frame it plays
+pcm.${m} {
+	type file
+	slave.pcm "${SLAVE}"
+	file "${TMPDIR}/${m}.fifo"
+	format "raw"
+}
+ASOUNDRC
+done
+
+for p in ${POLLERS}; do
+	cat >> ${TMPDIR}/asoundrc << ASOUNDRC
+
+pcm.amux_${p} {
+	type amux
+	file "${TMPDIR}/ctl"
+	poller "${p}"
+	stats false
+}
+ASOUNDRC
+done
+
+ret=0
+for p in ${POLLERS}; do
+	for r in ${RATES}; do
+		ALSA_CONFIG_PATH=${TMPDIR}/asoundrc \
+		${TMPDIR}/glitch -d ${DURATION} -r ${r} -S ${SLAVES} \
+			-t ${p} ${TMPDIR}/ctl amux_${p} || ret=1
+	done
+done
+
+exit ${ret}
@@ -0,0 +1,474 @@
+/*
+ * Multi-stream scalability benchmark: play concurrent streams through an amux
+ * PCM, from one or several processes, while switching slave through the
+ * control file at a fixed rate.
+ *
+ * Usage: scale [-s streams] [-p processes] [-d seconds] [-r switch_hz]
+ *		[-c control_file] [-S slave,slave...] [-t tag] pcm
+ *
+ * Each process serves its streams from a single thread, the way a sound server
+ * would, waiting on all PCM poll descriptors at once. A callback is a wakeup
+ * of a stream: poll_revents and, if the stream is ready, one period write.
+ * Reported CPU is the one used by the processes (all threads, including amux
+ * poller ones) while streams are running, fds and threads are the ones created
+ * per opened stream.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <alsa/asoundlib.h>
+
+#include "bench.h"
+
+#define SCALE_BUFFER_US 40000
+#define SCALE_SLAVES_MAX 8
+
+/**
+ * A stream served by a benchmark process
+ */
+struct scale_stream {
+	snd_pcm_t *pcm;
+	/**
+	 * Stream poll descriptors position in process pollfd array
+	 */
+	unsigned int pfd_off;
+	unsigned int pfd_nr;
+	/**
+	 * Callbacks latency in nanoseconds
+	 */
+	struct bench_hist h;
+};
+
+/**
+ * Benchmark process result, sent to parent through a pipe
+ */
+struct scale_result {
+	int err;
+	/**
+	 * Descriptors and threads created by opening streams
+	 */
+	int fds;
+	int threads;
+	uint64_t cpu_us;
+	uint64_t periods;
+	uint64_t xruns;
+	/**
+	 * Wakeups without the stream being ready
+	 */
+	uint64_t spurious;
+	/**
+	 * Callbacks latency of all streams
+	 */
+	struct bench_hist h;
+	/**
+	 * Callbacks latency 99th percentile of each stream
+	 */
+	struct bench_hist p99;
+};
+
+static uint64_t scale_cpu_us(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+		ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static int scale_write_all(int fd, void const *buf, size_t len)
+{
+	size_t cur = 0;
+	ssize_t sz;
+
+	while(cur < len) {
+		sz = write(fd, (char const *)buf + cur, len - cur);
+		if((sz < 0) && (errno == EINTR))
+			continue;
+		if(sz <= 0)
+			return -1;
+		cur += (size_t)sz;
+	}
+	return 0;
+}
+
+static int scale_read_all(int fd, void *buf, size_t len)
+{
+	size_t cur = 0;
+	ssize_t sz;
+
+	while(cur < len) {
+		sz = read(fd, (char *)buf + cur, len - cur);
+		if((sz < 0) && (errno == EINTR))
+			continue;
+		if(sz <= 0)
+			return -1;
+		cur += (size_t)sz;
+	}
+	return 0;
+}
+
+/**
+ * Open a non blocking playback stream.
+ *
+ * @return: 0 on success, negative number otherwise.
+ */
+static int scale_open(struct scale_stream *st, char const *name,
+		snd_pcm_uframes_t *psize)
+{
+	snd_pcm_uframes_t bsize;
+	int err;
+
+	err = snd_pcm_open(&st->pcm, name, SND_PCM_STREAM_PLAYBACK,
+			SND_PCM_NONBLOCK);
+	if(err < 0) {
+		fprintf(stderr, "Cannot open %s: %s\n", name,
+				snd_strerror(err));
+		st->pcm = NULL;
+		return err;
+	}
+
+	err = snd_pcm_set_params(st->pcm, SND_PCM_FORMAT_S16_LE,
+			SND_PCM_ACCESS_RW_INTERLEAVED, 2, 48000, 1,
+			SCALE_BUFFER_US);
+	if(err == 0)
+		err = snd_pcm_get_params(st->pcm, &bsize, psize);
+	if(err < 0)
+		fprintf(stderr, "Cannot configure %s: %s\n", name,
+				snd_strerror(err));
+	return err;
+}
+
+/**
+ * Serve a stream wakeup.
+ *
+ * @return: 0 on success, negative number on unrecoverable error.
+ */
+static int scale_serve(struct scale_stream *st, struct pollfd *pfd,
+		int16_t const *buf, snd_pcm_uframes_t psize,
+		struct scale_result *res)
+{
+	unsigned short revents;
+	snd_pcm_sframes_t ret;
+	uint64_t start;
+	int err;
+
+	start = bench_now_ns();
+
+	err = snd_pcm_poll_descriptors_revents(st->pcm, pfd + st->pfd_off,
+			st->pfd_nr, &revents);
+	if(err < 0)
+		return err;
+
+	if(revents & (POLLERR | POLLNVAL)) {
+		++res->xruns;
+		err = snd_pcm_prepare(st->pcm);
+		if(err < 0)
+			return err;
+	} else if(revents & POLLOUT) {
+		ret = snd_pcm_writei(st->pcm, buf, psize);
+		if((ret == -EPIPE) || (ret == -ESTRPIPE)) {
+			++res->xruns;
+			ret = snd_pcm_recover(st->pcm, ret, 1);
+		}
+		if(ret == -EAGAIN)
+			++res->spurious;
+		else if(ret < 0)
+			return ret;
+		else
+			++res->periods;
+	} else {
+		++res->spurious;
+	}
+
+	bench_hist_add(&st->h, bench_now_ns() - start);
+	return 0;
+}
+
+/**
+ * Benchmark process: open streams, wait for parent to start and serve them
+ * until the end of the run.
+ *
+ * @param rfd: Pipe to send readiness and result to parent into.
+ * @param gofd: Pipe closed by parent to start the run.
+ */
+static void scale_child(char const *name, unsigned int nr, uint64_t dur,
+		int rfd, int gofd)
+{
+	struct scale_result *res;
+	struct scale_stream *st;
+	struct pollfd *pfd = NULL;
+	snd_pcm_uframes_t psize = 0;
+	struct rlimit rl;
+	unsigned int i, j, pnr = 0;
+	int16_t *buf = NULL;
+	uint64_t end, cpu;
+	int fd0, thr0, ready = 0, err = 0;
+	char c = 0;
+
+	res = calloc(1, sizeof(*res));
+	st = calloc(nr, sizeof(*st));
+	if((res == NULL) || (st == NULL))
+		exit(1);
+
+	/* Dupfd poller uses about ten descriptors per stream */
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	fd0 = bench_fd_count();
+	thr0 = bench_thread_count();
+
+	for(i = 0; i < nr; ++i) {
+		err = scale_open(&st[i], name, &psize);
+		if(err < 0)
+			goto close;
+		err = snd_pcm_poll_descriptors_count(st[i].pcm);
+		if(err <= 0) {
+			err = (err < 0) ? err : -EINVAL;
+			goto close;
+		}
+		st[i].pfd_off = pnr;
+		st[i].pfd_nr = err;
+		pnr += err;
+	}
+
+	res->fds = bench_fd_count() - fd0;
+	res->threads = bench_thread_count() - thr0;
+
+	pfd = calloc(pnr, sizeof(*pfd));
+	buf = calloc(psize, 2 * sizeof(*buf));
+	if((pfd == NULL) || (buf == NULL)) {
+		err = -ENOMEM;
+		goto close;
+	}
+	for(i = 0; i < nr; ++i)
+		snd_pcm_poll_descriptors(st[i].pcm, pfd + st[i].pfd_off,
+				st[i].pfd_nr);
+
+	/* Notify readiness and wait for all processes to be ready */
+	if(scale_write_all(rfd, &c, 1) < 0)
+		exit(1);
+	ready = 1;
+	while(read(gofd, &c, 1) > 0)
+		;
+
+	cpu = scale_cpu_us();
+	end = bench_now_us() + dur;
+	while(bench_now_us() < end) {
+		err = poll(pfd, pnr, 100);
+		if(err < 0) {
+			err = -errno;
+			if(err == -EINTR)
+				continue;
+			goto close;
+		}
+		for(i = 0; i < nr; ++i) {
+			for(j = 0; j < st[i].pfd_nr; ++j)
+				if(pfd[st[i].pfd_off + j].revents)
+					break;
+			if(j == st[i].pfd_nr)
+				continue;
+			err = scale_serve(&st[i], pfd, buf, psize, res);
+			if(err < 0) {
+				fprintf(stderr, "Stream %u error: %s\n", i,
+						snd_strerror(err));
+				goto close;
+			}
+		}
+	}
+	res->cpu_us = scale_cpu_us() - cpu;
+	err = 0;
+
+	for(i = 0; i < nr; ++i) {
+		bench_hist_merge(&res->h, &st[i].h);
+		bench_hist_add(&res->p99, bench_hist_pct(&st[i].h, 99.));
+	}
+
+close:
+	for(i = 0; i < nr; ++i)
+		if(st[i].pcm != NULL)
+			snd_pcm_close(st[i].pcm);
+
+	res->err = err;
+	if(!ready)
+		scale_write_all(rfd, &c, 1);
+	scale_write_all(rfd, res, sizeof(*res));
+	free(buf);
+	free(pfd);
+	free(st);
+	free(res);
+	exit(0);
+}
+
+static void scale_print(char const *tag, unsigned int streams,
+		unsigned int procs, uint64_t wall, unsigned int switches,
+		struct scale_result const *res)
+{
+	printf("%s: %u streams in %u process(es), %.1fs, %u switches\n", tag,
+			streams, procs, wall / 1e6, switches);
+	printf("  cpu %.2f%% (%.3f%% per stream)\n",
+			100. * res->cpu_us / wall,
+			100. * res->cpu_us / wall / streams);
+	printf("  callback ns: p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, "
+			"max %llu\n",
+			(unsigned long long)bench_hist_pct(&res->h, 50.),
+			(unsigned long long)bench_hist_pct(&res->h, 90.),
+			(unsigned long long)bench_hist_pct(&res->h, 99.),
+			(unsigned long long)bench_hist_pct(&res->h, 99.9),
+			(unsigned long long)res->h.max);
+	printf("  stream p99 ns: median %llu, worst %llu\n",
+			(unsigned long long)bench_hist_pct(&res->p99, 50.),
+			(unsigned long long)res->p99.max);
+	printf("  per stream: %.1f fds, %.2f threads\n",
+			(double)res->fds / streams,
+			(double)res->threads / streams);
+	printf("  periods %llu, xruns %llu, spurious wakeups %llu\n",
+			(unsigned long long)res->periods,
+			(unsigned long long)res->xruns,
+			(unsigned long long)res->spurious);
+}
+
+int main(int argc, char *argv[])
+{
+	char const *ctl = NULL, *tag = NULL, *slaves[SCALE_SLAVES_MAX];
+	unsigned int streams = 1, procs = 1, nslaves = 0, switches = 0, i;
+	struct scale_result *res, tot = { .err = 0 };
+	double dur = 10., rate = 0.;
+	uint64_t start, end, next;
+	int go[2], *rfd, opt, ret = 0;
+	char *s, c;
+	pid_t pid;
+
+	while((opt = getopt(argc, argv, "s:p:d:r:c:S:t:")) != -1) {
+		switch(opt) {
+		case 's':
+			streams = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			procs = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			dur = strtod(optarg, NULL);
+			break;
+		case 'r':
+			rate = strtod(optarg, NULL);
+			break;
+		case 'c':
+			ctl = optarg;
+			break;
+		case 'S':
+			for(s = strtok(optarg, ","); (s != NULL) &&
+					(nslaves < SCALE_SLAVES_MAX);
+					s = strtok(NULL, ","))
+				slaves[nslaves++] = s;
+			break;
+		case 't':
+			tag = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if((optind != argc - 1) || (streams == 0) || (procs == 0) ||
+			(procs > streams) || (dur <= 0.))
+		goto usage;
+	if((rate > 0.) && ((ctl == NULL) || (nslaves < 2))) {
+		fprintf(stderr, "Switching needs a control file and at least "
+				"two slaves\n");
+		goto usage;
+	}
+	if(tag == NULL)
+		tag = argv[optind];
+
+	if((ctl != NULL) && (nslaves != 0) &&
+			(bench_ctl_set(ctl, slaves[0]) < 0)) {
+		perror(ctl);
+		return 1;
+	}
+
+	res = calloc(1, sizeof(*res));
+	rfd = calloc(procs, sizeof(*rfd));
+	if((res == NULL) || (rfd == NULL) || (pipe(go) < 0))
+		return 1;
+
+	for(i = 0; i < procs; ++i) {
+		int p[2];
+
+		if(pipe(p) < 0) {
+			perror("pipe");
+			return 1;
+		}
+		pid = fork();
+		if(pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		if(pid == 0) {
+			close(go[1]);
+			close(p[0]);
+			scale_child(argv[optind], streams / procs +
+					(i < streams % procs),
+					(uint64_t)(dur * 1e6), p[1], go[0]);
+		}
+		close(p[1]);
+		rfd[i] = p[0];
+	}
+	close(go[0]);
+
+	/* Start all processes once every stream is opened */
+	for(i = 0; i < procs; ++i)
+		if(scale_read_all(rfd[i], &c, 1) < 0)
+			ret = 1;
+	close(go[1]);
+
+	start = bench_now_us();
+	end = start + (uint64_t)(dur * 1e6);
+	if(rate > 0.) {
+		for(next = start + 1e6 / rate; next < end;
+				next = start + (switches + 1) * 1e6 / rate) {
+			bench_sleep_until(next);
+			bench_ctl_set(ctl, slaves[++switches % nslaves]);
+		}
+	}
+
+	for(i = 0; i < procs; ++i) {
+		if(scale_read_all(rfd[i], res, sizeof(*res)) < 0 ||
+				(res->err < 0)) {
+			ret = 1;
+			continue;
+		}
+		tot.fds += res->fds;
+		tot.threads += res->threads;
+		tot.cpu_us += res->cpu_us;
+		tot.periods += res->periods;
+		tot.xruns += res->xruns;
+		tot.spurious += res->spurious;
+		bench_hist_merge(&tot.h, &res->h);
+		bench_hist_merge(&tot.p99, &res->p99);
+	}
+	while(wait(NULL) > 0)
+		;
+
+	if(ret != 0) {
+		fprintf(stderr, "%s: benchmark failed\n", tag);
+		return ret;
+	}
+
+	scale_print(tag, streams, procs, end - start, switches, &tot);
+	return 0;
+
+usage:
+	fprintf(stderr, "Usage: %s [-s streams] [-p processes] [-d seconds] "
+			"[-r switch_hz] [-c control_file] "
+			"[-S slave,slave...] [-t tag] pcm\n", argv[0]);
+	return 1;
+}
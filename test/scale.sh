@@ -0,0 +1,70 @@
+#!/bin/sh
+# Run the multi-stream scalability benchmark for each poller, with 1, 8, 64 and
+# 256 streams served by a single process then by one process per stream, while
+# switching between the null and the mock slave. Run "make" first.
+#
+# Usage: scale.sh [-d seconds] [-r switch_hz] [poller...]
+
+CURDIR=$(dirname $(realpath ${0}))
+BUILDDIR=${CURDIR}/../build
+TMPDIR=$(mktemp -d)
+DURATION=10
+RATE=1
+POLLERS="dupfd thread epoller timer"
+STREAMS="1 8 64 256"
+
+trap 'rm -rf ${TMPDIR}' EXIT
+
+while [ $# -ne 0 ]; do
+	case ${1} in
+	-d) DURATION=${2}; shift 2;;
+	-r) RATE=${2}; shift 2;;
+	*) break;;
+	esac
+done
+[ $# -ne 0 ] && POLLERS="$@"
+
+gcc -W -Wall -O2 -o ${TMPDIR}/scale ${CURDIR}/scale.c -lasound || exit 1
+
+cat > ${TMPDIR}/asoundrc << ASOUNDRC
+</usr/share/alsa/alsa.conf>
+
+pcm_type.!amux {
+	lib "${BUILDDIR}/libasound_pcm_amux.so"
+}
+
+# Slave writing every frame, through write() syscalls, to /dev/null
+pcm.mock {
+	type file
+	slave.pcm "null"
+	file "/dev/null"
+	format "raw"
+}
+ASOUNDRC
+
+for p in ${POLLERS}; do
+	cat >> ${TMPDIR}/asoundrc << ASOUNDRC
+
+pcm.amux_${p} {
+	type amux
+	file "${TMPDIR}/ctl"
+	poller "${p}"
+	stats false
+}
+ASOUNDRC
+done
+
+ret=0
+for p in ${POLLERS}; do
+	for n in ${STREAMS}; do
+		for procs in 1 ${n}; do
+			ALSA_CONFIG_PATH=${TMPDIR}/asoundrc \
+			${TMPDIR}/scale -s ${n} -p ${procs} -d ${DURATION} \
+				-r ${RATE} -c ${TMPDIR}/ctl -S null,mock \
+				-t ${p} amux_${p} || ret=1
+			[ ${n} -eq 1 ] && break
+		done
+	done
+done
+
+exit ${ret}
@@ -0,0 +1,385 @@
+/*
+ * Syscall budget harness: play a stream through an amux PCM while counting
+ * every syscall made by the process threads with ptrace, then report the
+ * syscalls made per period by type and check them against a budget.
+ *
+ * Usage: sysbudget [-n periods] [-b budget_file] [-t tag] pcm
+ *
+ * Budget file lines are "<tag> total <max>" or "<tag> <syscall> <max>", max
+ * being the number of syscalls allowed per period and tag a shell pattern
+ * matched against the run tag (PCM name by default), "#" starts a comment.
+ * Exits with 1 if a budget is exceeded.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include <alsa/asoundlib.h>
+
+#define SB_MAGIC 0x616d7578 /* "amux" */
+#define SB_NR_MAX 1024
+#define SB_WARMUP 16
+#define SB_BUFFER_US 40000
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(*(a)))
+
+/*
+ * Marker syscall, getpid() ignores its arguments so they are used to tell the
+ * tracer when measurement starts and stops
+ */
+#define sb_marker(on, periods) syscall(SYS_getpid, SB_MAGIC, (on), (periods))
+
+#define SB_SYSCALL(name) { SYS_##name, #name }
+
+static struct {
+	long nr;
+	char const *name;
+} const sb_names[] = {
+	SB_SYSCALL(read),
+	SB_SYSCALL(write),
+	SB_SYSCALL(readv),
+	SB_SYSCALL(writev),
+	SB_SYSCALL(ioctl),
+	SB_SYSCALL(lseek),
+	SB_SYSCALL(flock),
+	SB_SYSCALL(ppoll),
+	SB_SYSCALL(pselect6),
+	SB_SYSCALL(epoll_ctl),
+	SB_SYSCALL(epoll_pwait),
+	SB_SYSCALL(timerfd_settime),
+	SB_SYSCALL(timerfd_gettime),
+	SB_SYSCALL(clock_gettime),
+	SB_SYSCALL(clock_nanosleep),
+	SB_SYSCALL(nanosleep),
+	SB_SYSCALL(futex),
+	SB_SYSCALL(mmap),
+	SB_SYSCALL(munmap),
+	SB_SYSCALL(mprotect),
+	SB_SYSCALL(madvise),
+	SB_SYSCALL(brk),
+	SB_SYSCALL(openat),
+	SB_SYSCALL(close),
+	SB_SYSCALL(fstat),
+	SB_SYSCALL(gettid),
+	SB_SYSCALL(getpid),
+	SB_SYSCALL(rt_sigprocmask),
+	SB_SYSCALL(sched_yield),
+	SB_SYSCALL(dup3),
+#ifdef SYS_poll
+	SB_SYSCALL(poll),
+#endif
+#ifdef SYS_select
+	SB_SYSCALL(select),
+#endif
+#ifdef SYS_epoll_wait
+	SB_SYSCALL(epoll_wait),
+#endif
+#ifdef SYS_dup2
+	SB_SYSCALL(dup2),
+#endif
+#ifdef SYS_newfstatat
+	SB_SYSCALL(newfstatat),
+#endif
+};
+
+static unsigned long sb_count[SB_NR_MAX];
+
+static char const *sb_name(long nr)
+{
+	static char buf[32];
+	size_t i;
+
+	for(i = 0; i < ARRAY_SIZE(sb_names); ++i)
+		if(sb_names[i].nr == nr)
+			return sb_names[i].name;
+
+	snprintf(buf, sizeof(buf), "syscall_%ld", nr);
+	return buf;
+}
+
+static long sb_nr(char const *name)
+{
+	size_t i;
+
+	for(i = 0; i < ARRAY_SIZE(sb_names); ++i)
+		if(strcmp(sb_names[i].name, name) == 0)
+			return sb_names[i].nr;
+
+	if(strncmp(name, "syscall_", 8) == 0)
+		return strtol(name + 8, NULL, 10);
+
+	return -1;
+}
+
+/*
+ * Wait for PCM to be ready the way applications do, through PCM poll
+ * descriptors and poll_revents
+ */
+static int sb_wait(snd_pcm_t *pcm)
+{
+	struct pollfd pfd[16];
+	unsigned short revents;
+	int nr, ret;
+
+	nr = snd_pcm_poll_descriptors(pcm, pfd, ARRAY_SIZE(pfd));
+	if(nr < 0)
+		return nr;
+
+	for(;;) {
+		ret = poll(pfd, nr, 1000);
+		if(ret < 0)
+			return -errno;
+		if(ret == 0)
+			return -ETIMEDOUT;
+		ret = snd_pcm_poll_descriptors_revents(pcm, pfd, nr, &revents);
+		if(ret < 0)
+			return ret;
+		if(revents & (POLLERR | POLLNVAL))
+			return -EIO;
+		if(revents & POLLOUT)
+			return 0;
+	}
+}
+
+/*
+ * Traced child: play silence on PCM, measuring only steady state periods
+ */
+static int sb_play(char const *name, unsigned int periods)
+{
+	snd_pcm_uframes_t psize, bsize;
+	snd_pcm_sframes_t ret;
+	unsigned int i;
+	snd_pcm_t *pcm;
+	int16_t *buf;
+	int err;
+
+	err = snd_pcm_open(&pcm, name, SND_PCM_STREAM_PLAYBACK, 0);
+	if(err < 0) {
+		fprintf(stderr, "Cannot open %s: %s\n", name,
+				snd_strerror(err));
+		return 1;
+	}
+
+	err = snd_pcm_set_params(pcm, SND_PCM_FORMAT_S16_LE,
+			SND_PCM_ACCESS_RW_INTERLEAVED, 2, 48000, 1,
+			SB_BUFFER_US);
+	if(err == 0)
+		err = snd_pcm_get_params(pcm, &bsize, &psize);
+	if(err < 0) {
+		fprintf(stderr, "Cannot configure %s: %s\n", name,
+				snd_strerror(err));
+		return 1;
+	}
+
+	buf = calloc(psize, 2 * sizeof(*buf));
+	if(buf == NULL)
+		return 1;
+
+	for(i = 0; i < SB_WARMUP + periods; ++i) {
+		if(i == SB_WARMUP)
+			sb_marker(1, 0);
+		err = sb_wait(pcm);
+		if(err < 0) {
+			fprintf(stderr, "Wait error: %s\n", snd_strerror(err));
+			break;
+		}
+		ret = snd_pcm_writei(pcm, buf, psize);
+		if(ret == -EPIPE)
+			ret = snd_pcm_recover(pcm, ret, 1);
+		if(ret < 0) {
+			fprintf(stderr, "Write error: %s\n",
+					snd_strerror(ret));
+			break;
+		}
+	}
+	sb_marker(0, (i > SB_WARMUP) ? i - SB_WARMUP : 0);
+
+	snd_pcm_drop(pcm);
+	snd_pcm_close(pcm);
+	free(buf);
+
+	return (i == SB_WARMUP + periods) ? 0 : 1;
+}
+
+/*
+ * Tracer: count syscalls of every child thread between markers
+ *
+ * @return: Number of measured periods, 0 on failure
+ */
+static unsigned long sb_trace(pid_t child)
+{
+	struct __ptrace_syscall_info info;
+	unsigned long periods = 0;
+	int measuring = 0, status, sig;
+	pid_t pid;
+
+	if((waitpid(child, &status, 0) != child) || !WIFSTOPPED(status))
+		return 0;
+
+	if(ptrace(PTRACE_SETOPTIONS, child, 0, PTRACE_O_TRACESYSGOOD |
+				PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL) < 0) {
+		perror("ptrace");
+		return 0;
+	}
+	ptrace(PTRACE_SYSCALL, child, 0, 0);
+
+	for(;;) {
+		pid = waitpid(-1, &status, __WALL);
+		if(pid < 0)
+			break;
+		if(WIFEXITED(status) || WIFSIGNALED(status)) {
+			if(pid == child)
+				break;
+			continue;
+		}
+
+		sig = 0;
+		if(WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+			if(ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info),
+						&info) > 0 &&
+					(info.op == PTRACE_SYSCALL_INFO_ENTRY)) {
+				if((info.entry.nr == SYS_getpid) &&
+						(info.entry.args[0] == SB_MAGIC)) {
+					measuring = info.entry.args[1];
+					if(!measuring)
+						periods = info.entry.args[2];
+				} else if(measuring &&
+						(info.entry.nr < SB_NR_MAX)) {
+					++sb_count[info.entry.nr];
+				}
+			}
+		} else if((WSTOPSIG(status) != SIGTRAP) &&
+				(WSTOPSIG(status) != SIGSTOP)) {
+			/* Forward signals that are not tracing ones */
+			sig = WSTOPSIG(status);
+		}
+		ptrace(PTRACE_SYSCALL, pid, 0, sig);
+	}
+
+	return periods;
+}
+
+/*
+ * Check syscalls per period against budget file
+ *
+ * @return: Number of exceeded budgets, negative number on error
+ */
+static int sb_check(char const *path, char const *tag, unsigned long periods,
+		unsigned long total)
+{
+	char line[256], btag[64], bname[64];
+	double max, val;
+	int exceeded = 0;
+	long nr;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if(f == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	while(fgets(line, sizeof(line), f) != NULL) {
+		if((line[0] == '#') || (sscanf(line, "%63s %63s %lf", btag,
+						bname, &max) != 3))
+			continue;
+		if(fnmatch(btag, tag, 0) != 0)
+			continue;
+
+		if(strcmp(bname, "total") == 0) {
+			val = (double)total / periods;
+		} else {
+			nr = sb_nr(bname);
+			if((nr < 0) || (nr >= SB_NR_MAX))
+				continue;
+			val = (double)sb_count[nr] / periods;
+		}
+
+		if(val > max) {
+			printf("FAIL %s: %s %.2f per period, budget %.2f\n",
+					tag, bname, val, max);
+			++exceeded;
+		}
+	}
+
+	fclose(f);
+	return exceeded;
+}
+
+int main(int argc, char *argv[])
+{
+	char const *budget = NULL, *tag = NULL;
+	unsigned long total = 0, periods;
+	unsigned int nperiods = 1000;
+	pid_t child;
+	long nr;
+	int opt, ret;
+
+	while((opt = getopt(argc, argv, "n:b:t:")) != -1) {
+		switch(opt) {
+		case 'n':
+			nperiods = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			budget = optarg;
+			break;
+		case 't':
+			tag = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if((optind != argc - 1) || (nperiods == 0))
+		goto usage;
+	if(tag == NULL)
+		tag = argv[optind];
+
+	child = fork();
+	if(child < 0) {
+		perror("fork");
+		return 1;
+	}
+	if(child == 0) {
+		ptrace(PTRACE_TRACEME, 0, 0, 0);
+		raise(SIGSTOP);
+		return sb_play(argv[optind], nperiods);
+	}
+
+	periods = sb_trace(child);
+	if(periods == 0) {
+		fprintf(stderr, "%s: no period measured\n", tag);
+		return 1;
+	}
+
+	for(nr = 0; nr < SB_NR_MAX; ++nr)
+		total += sb_count[nr];
+
+	printf("%s: %lu periods, %.2f syscalls per period\n", tag, periods,
+			(double)total / periods);
+	for(nr = 0; nr < SB_NR_MAX; ++nr)
+		if(sb_count[nr] != 0)
+			printf("  %-16s %8.2f\n", sb_name(nr),
+					(double)sb_count[nr] / periods);
+
+	if(budget == NULL)
+		return 0;
+
+	ret = sb_check(budget, tag, periods, total);
+	return (ret != 0) ? 1 : 0;
+
+usage:
+	fprintf(stderr, "Usage: %s [-n periods] [-b budget_file] [-t tag] "
+			"pcm\n", argv[0]);
+	return 1;
+}
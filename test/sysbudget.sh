@@ -0,0 +1,63 @@
+#!/bin/sh
+# Count syscalls per period of a stream through amux for each poller and slave
+# and check them against sysbudget.conf. Run "make" first.
+#
+# Usage: sysbudget.sh [-n periods] [poller...]
+
+CURDIR=$(dirname $(realpath ${0}))
+BUILDDIR=${CURDIR}/../build
+TMPDIR=$(mktemp -d)
+PERIODS=1000
+POLLERS="dupfd thread epoller timer"
+SLAVES="null mock"
+
+trap 'rm -rf ${TMPDIR}' EXIT
+
+if [ "${1}" = "-n" ]; then
+	PERIODS=${2}
+	shift 2
+fi
+[ $# -ne 0 ] && POLLERS="$@"
+
+gcc -W -Wall -O2 -o ${TMPDIR}/sysbudget ${CURDIR}/sysbudget.c -lasound || \
+	exit 1
+
+cat > ${TMPDIR}/asoundrc << ASOUNDRC
+</usr/share/alsa/alsa.conf>
+
+pcm_type.!amux {
+	lib "${BUILDDIR}/libasound_pcm_amux.so"
+}
+
+# Slave writing every frame, through write() syscalls, to /dev/null
+pcm.mock {
+	type file
+	slave.pcm "null"
+	file "/dev/null"
+	format "raw"
+}
+ASOUNDRC
+
+for p in ${POLLERS}; do
+	cat >> ${TMPDIR}/asoundrc << ASOUNDRC
+
+pcm.amux_${p} {
+	type amux
+	file "${TMPDIR}/ctl"
+	poller "${p}"
+	stats false
+}
+ASOUNDRC
+done
+
+ret=0
+for s in ${SLAVES}; do
+	printf '%s' ${s} > ${TMPDIR}/ctl
+	for p in ${POLLERS}; do
+		ALSA_CONFIG_PATH=${TMPDIR}/asoundrc \
+		${TMPDIR}/sysbudget -n ${PERIODS} -b ${CURDIR}/sysbudget.conf \
+			-t ${p}/${s} amux_${p} || ret=1
+	done
+done
+
+exit ${ret}